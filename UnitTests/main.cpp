@@ -7,8 +7,26 @@
 //
 
 #include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <dirent.h>
 #include "Transition.h"
 #include "VideoLoop.h"
+#include "FrameDistance.h"
+#include "GreyscaleConversion.h"
+#include "ThreadPool.h"
+#include "SparseMatrix.h"
+#include "CacheMetadata.h"
+#include "HistogramDistance.h"
+#include "RingBuffer.h"
+#include "FrameStore.h"
+#include "FrameCache.h"
+#include "DistanceCache.h"
+#include "PackedDistanceMatrix.h"
+#include "AnalysisCache.h"
 
 using namespace std;
 
@@ -369,6 +387,1065 @@ void testSequencing()
 }
 
 
+/**
+ * Test that the SIMD frame distance kernels match the scalar kernel exactly
+ */
+void testFrameDistanceKernels()
+{
+    //Odd lengths so the remainder loops get exercised too
+    int lengths[] = {0, 1, 15, 16, 17, 33, 1000, 640 * 480 + 7};
+    
+    for (int n=0; n<8; n++)
+    {
+        int length = lengths[n];
+        unsigned char* a = new unsigned char[length + 1];
+        unsigned char* b = new unsigned char[length + 1];
+        for (int i=0; i<length; i++)
+        {
+            a[i] = (unsigned char)(rand() % 256);
+            b[i] = (unsigned char)(rand() % 256);
+        }
+        
+        uint64_t scalar = FrameDistance::sumSquaredDifferenceScalar(a, b, length);
+        assertTrue(FrameDistance::sumSquaredDifference(a, b, length) == scalar);
+        
+        delete [] a;
+        delete [] b;
+    }
+    
+    //Worst case, every pixel 0 against 255
+    int length = 1920 * 1080;
+    unsigned char* a = new unsigned char[length];
+    unsigned char* b = new unsigned char[length];
+    for (int i=0; i<length; i++)
+    {
+        a[i] = 0;
+        b[i] = 255;
+    }
+    assertTrue(FrameDistance::sumSquaredDifference(a, b, length) == (uint64_t)length * 255 * 255);
+    assertTrue(FrameDistance::distanceFromSumSquaredDifference(FrameDistance::sumSquaredDifference(a, b, length)) == sqrt((double)length));
+    delete [] a;
+    delete [] b;
+}
+
+/**
+ * Test that the Gram matrix identity gives exactly the same sum squared difference
+ */
+void testGreyscaleConversion()
+{
+    //OpenCV's CV_RGB2GRAY on 8 bit frames, with the weights in a table
+    int table[768];
+    for (int i=0; i<256; i++)
+    {
+        table[i] = 4899 * i;
+        table[i + 256] = 9617 * i;
+        table[i + 512] = 1868 * i + (1 << 13);
+    }
+    
+    //Odd lengths so the remainder loop gets exercised too, and every value of every channel
+    int lengths[] = {0, 1, 15, 16, 17, 33, 768, 640 * 480 + 7};
+    for (int n=0; n<8; n++)
+    {
+        int length = lengths[n];
+        unsigned char* bgr = new unsigned char[3 * length + 1];
+        unsigned char* grey = new unsigned char[length + 1];
+        unsigned char* scalar = new unsigned char[length + 1];
+        for (int i=0; i<3 * length; i++)
+        {
+            bgr[i] = (unsigned char)(rand() % 256);
+        }
+        
+        //Pixel v + 256c has v in channel c and 255 in the others
+        for (int i=0; i<length && i<768; i++)
+        {
+            for (int c=0; c<3; c++)
+            {
+                bgr[3 * i + c] = (c == i / 256) ? (unsigned char)(i % 256) : 255;
+            }
+        }
+        
+        GreyscaleConversion::fromBGR(bgr, grey, length);
+        GreyscaleConversion::fromBGRScalar(bgr, scalar, length);
+        for (int i=0; i<length; i++)
+        {
+            const unsigned char* p = bgr + 3 * i;
+            int expected = (table[p[0]] + table[p[1] + 256] + table[p[2] + 512]) >> 14;
+            assertIntEquals(grey[i], expected);
+            assertIntEquals(scalar[i], expected);
+        }
+        
+        delete [] bgr;
+        delete [] grey;
+        delete [] scalar;
+    }
+}
+
+void testGramIdentity()
+{
+    int lengths[] = {1, 15, 16, 33, 8192, 640 * 480 + 3};
+    
+    for (int n=0; n<6; n++)
+    {
+        int length = lengths[n];
+        unsigned char* frames[4];
+        for (int f=0; f<4; f++)
+        {
+            frames[f] = new unsigned char[length];
+            for (int i=0; i<length; i++)
+            {
+                frames[f][i] = (unsigned char)(rand() % 256);
+            }
+        }
+        
+        uint64_t block[4];
+        FrameDistance::dotProducts2x2(frames[0], frames[1], frames[2], frames[3], length, block);
+        assertTrue(block[0] == FrameDistance::dotProductScalar(frames[0], frames[2], length));
+        assertTrue(block[1] == FrameDistance::dotProductScalar(frames[0], frames[3], length));
+        assertTrue(block[2] == FrameDistance::dotProductScalar(frames[1], frames[2], length));
+        assertTrue(block[3] == FrameDistance::dotProductScalar(frames[1], frames[3], length));
+        
+        uint64_t norm0 = FrameDistance::dotProduct(frames[0], frames[0], length);
+        uint64_t norm2 = FrameDistance::dotProduct(frames[2], frames[2], length);
+        assertTrue(FrameDistance::sumSquaredDifferenceFromDot(norm0, norm2, block[0]) == FrameDistance::sumSquaredDifferenceScalar(frames[0], frames[2], length));
+        
+        for (int f=0; f<4; f++)
+        {
+            delete [] frames[f];
+        }
+    }
+}
+
+
+/**
+ * Task for testThreadPool. Adds more tasks from inside the pool so they get stolen.
+ */
+class CountingTask : public Task
+{
+public:
+    ThreadPool* pool;
+    int* counts;
+    int index;
+    int children;
+    
+    CountingTask(ThreadPool* pool, int* counts, int index, int children)
+    {
+        this->pool = pool;
+        this->counts = counts;
+        this->index = index;
+        this->children = children;
+    }
+    
+    void run()
+    {
+        //Every task writes only its own slot
+        counts[index]++;
+        for (int i=0; i<children; i++)
+        {
+            pool->add(new CountingTask(pool, counts, index * 4 + 100 + i, 0));
+        }
+    }
+};
+
+/**
+ * Test that every task runs exactly once for any number of threads
+ */
+void testThreadPool()
+{
+    int threadCounts[] = {1, 2, 3, 8};
+    
+    for (int t=0; t<4; t++)
+    {
+        ThreadPool pool(threadCounts[t]);
+        assertIntEquals(pool.getNumThreads(), threadCounts[t]);
+        
+        int counts[500];
+        for (int i=0; i<500; i++)
+        {
+            counts[i] = 0;
+        }
+        
+        for (int i=0; i<100; i++)
+        {
+            pool.add(new CountingTask(&pool, counts, i, 3));
+        }
+        pool.wait();
+        
+        int total = 0;
+        for (int i=0; i<500; i++)
+        {
+            assertTrue(counts[i] <= 1);
+            total += counts[i];
+        }
+        assertIntEquals(total, 400);
+    }
+}
+
+
+/**
+ * Test sparse matrix lookups and normalization
+ */
+void testSparseMatrix()
+{
+    SparseMatrix matrix(4);
+    
+    //Out of order, and one overwrite
+    matrix.set(1, 3, 2.0f);
+    matrix.set(1, 0, 4.0f);
+    matrix.set(1, 2, 1.0f);
+    matrix.set(1, 3, 3.0f);
+    
+    vector<SparseEntry> row;
+    SparseEntry entry;
+    entry.col = 2;
+    entry.value = 8.0f;
+    row.push_back(entry);
+    entry.col = 0;
+    entry.value = 0.0f;
+    row.push_back(entry);
+    matrix.setRow(2, row);
+    
+    assertIntEquals((int)matrix.numEntries(), 5);
+    assertIntEquals(matrix.rows[1][0].col, 0);
+    assertIntEquals(matrix.rows[1][2].col, 3);
+    assertIntEquals(matrix.rows[2][0].col, 0);
+    
+    double value = 0.0f;
+    assertTrue(matrix.find(1, 3, value) && value == 3.0f);
+    assertTrue(!matrix.find(0, 0, value));
+    assertTrue(matrix.get(3, 1, -1.0f) == -1.0f);
+    
+    matrix.normalize();
+    assertTrue(matrix.get(2, 2, 0.0f) == 1.0f);
+    assertTrue(matrix.get(1, 0, 0.0f) == 0.5f);
+    
+    matrix.normalizeRows();
+    assertTrue(matrix.get(1, 0, 0.0f) == 0.5f);
+    
+    //A pruned matrix is normalized by the largest distance of the whole matrix, not the largest one it kept
+    SparseMatrix pruned(2);
+    pruned.set(0, 1, 4.0f);
+    pruned.largestValue = 16.0f;
+    pruned.normalize();
+    assertTrue(pruned.get(0, 1, 0.0f) == 0.25f);
+    assertTrue(pruned.largestValue == 1.0f);
+}
+
+
+/**
+ * Test that cache metadata survives a save and load
+ */
+void testCacheMetadata()
+{
+    string file = "/tmp/videotexture_unittest.txt.meta";
+    assertTrue(CacheMetadata::sidecarFile("/tmp/videotexture_unittest.txt") == file);
+    
+    CacheMetadata metadata;
+    metadata.set("mode", "dense");
+    metadata.setInt("frames", 1200);
+    metadata.setInt("lastFrameNorm", 123456789012LL);
+    metadata.set("source", "clip with spaces.mov");
+    metadata.setDouble("scale", 0.1);
+    metadata.save(file);
+    
+    CacheMetadata loaded;
+    assertTrue(loaded.load(file));
+    assertTrue(loaded.get("mode") == "dense");
+    assertIntEquals((int)loaded.getInt("frames"), 1200);
+    assertTrue(loaded.getInt("lastFrameNorm") == 123456789012LL);
+    assertTrue(loaded.get("source") == "clip with spaces.mov");
+    assertTrue(loaded.getDouble("scale") == 0.1);
+    assertTrue(!loaded.has("width"));
+    assertIntEquals((int)loaded.getInt("width", -1), -1);
+    
+    remove(file.c_str());
+    assertTrue(!loaded.load(file));
+}
+
+
+/**
+ * Test that the batched chi-square kernel matches the reference chi-square
+ */
+void testHistogramDistance()
+{
+    //Odd lengths for the remainder loop, 512 is the default 8x8x8 histogram
+    int lengths[] = {1, 3, 4, 7, 512, 4099};
+    
+    for (int n=0; n<6; n++)
+    {
+        int length = lengths[n];
+        float* ref = new float[length];
+        float* input = new float[length];
+        float* inverse = new float[length];
+        for (int i=0; i<length; i++)
+        {
+            //Plenty of empty bins, like a real histogram
+            ref[i] = (rand() % 3 == 0) ? 0.0f : (float)(rand() % 5000);
+            input[i] = (rand() % 3 == 0) ? 0.0f : (float)(rand() % 5000);
+        }
+        
+        HistogramDistance::inverseBins(ref, inverse, length);
+        double expected = HistogramDistance::chiSquareScalar(ref, input, length);
+        double batched = HistogramDistance::chiSquareInverse(ref, inverse, input, length);
+        assertTrue(fabs(batched - expected) <= 1e-5 * expected + 1e-6);
+        
+        //Identical histograms are at distance 0
+        assertTrue(HistogramDistance::chiSquareInverse(ref, inverse, ref, length) == 0.0f);
+        
+        delete [] ref;
+        delete [] input;
+        delete [] inverse;
+    }
+}
+
+
+/**
+ * Producer pushes 1..count then a 0, consumer pops and adds up values until it sees a 0
+ */
+class RingTask : public Task
+{
+public:
+    RingBuffer<int>* ring;
+    int count;              //0 = consumer
+    long long* results;     //Consumer adds {sum, number of values} here
+    
+    RingTask(RingBuffer<int>* ring, int count, long long* results)
+    {
+        this->ring = ring;
+        this->count = count;
+        this->results = results;
+    }
+    
+    void run()
+    {
+        if (this->count > 0)
+        {
+            for (int i=1; i<=this->count; i++)
+            {
+                this->ring->push(i);
+            }
+            this->ring->push(0);
+            return;
+        }
+        
+        int value;
+        while (true)
+        {
+            this->ring->pop(value);
+            if (value == 0)
+            {
+                break;
+            }
+            this->results[0] += value;
+            this->results[1]++;
+        }
+    }
+};
+
+/**
+ * Test that every value pushed into the ring buffer is popped exactly once with several producers and consumers
+ */
+void testRingBuffer()
+{
+    RingBuffer<int> small(5);
+    assertIntEquals((int)small.capacity(), 8);
+    
+    int value = 0;
+    assertTrue(!small.tryPop(value));
+    for (int i=0; i<8; i++)
+    {
+        assertTrue(small.tryPush(i));
+    }
+    assertTrue(!small.tryPush(8));
+    for (int i=0; i<8; i++)
+    {
+        assertTrue(small.tryPop(value) && value == i);
+    }
+    assertTrue(!small.tryPop(value));
+    
+    //2 producers and 2 consumers through a ring much smaller than the data.
+    //Each producer ends with a 0 and each consumer stops at the first 0 it sees, so between them they see every value.
+    RingBuffer<int> ring(16);
+    long long count = 100000;
+    long long results[2][2] = {{0, 0}, {0, 0}};
+    
+    ThreadPool pool(4);
+    for (int i=0; i<2; i++)
+    {
+        pool.add(new RingTask(&ring, 0, results[i]));
+        pool.add(new RingTask(&ring, (int)count, NULL));
+    }
+    pool.wait();
+    
+    assertTrue(results[0][1] + results[1][1] == 2 * count);
+    assertTrue(results[0][0] + results[1][0] == count * (count + 1));
+}
+
+
+void testFrameStore()
+{
+    //Odd frame size, every frame still starts on a 64 byte boundary
+    FrameStore store(100 * 3 + 1);
+    assertIntEquals((int)store.getFrameStride(), 320);
+    assertIntEquals(store.size(), 0);
+    
+    //Enough frames to commit more than one step of the reservation
+    int count = 250000;
+    unsigned char* first = store.append();
+    first[0] = 7;
+    for (int i=1; i<count; i++)
+    {
+        unsigned char* frame = store.append();
+        assertTrue(((size_t)frame % FrameStore::alignment) == 0);
+        frame[0] = (unsigned char)i;
+        frame[300] = (unsigned char)(i >> 8);
+    }
+    assertIntEquals(store.size(), count);
+    
+    //Frames never move
+    assertTrue(store.frame(0) == first);
+    assertIntEquals(first[0], 7);
+    assertIntEquals(store.frame(count - 1)[0], (unsigned char)(count - 1));
+    assertIntEquals(store.frame(count - 1)[300], (unsigned char)((count - 1) >> 8));
+    
+    //Sized up front and written in any order, then trimmed to what was used
+    FrameStore sized(1000);
+    sized.resize(100);
+    assertIntEquals(sized.size(), 100);
+    sized.frame(99)[999] = 1;
+    sized.frame(0)[0] = 2;
+    assertTrue(sized.append() == sized.frame(100));
+    sized.resize(50);
+    assertIntEquals(sized.size(), 50);
+    assertIntEquals(sized.frame(0)[0], 2);
+    
+    //Growing past a commit step to a size that doesn't end on a page boundary, then appending
+    FrameStore grown(6401);
+    grown.resize(11381);
+    assertTrue(((size_t)grown.getFrameStride() * 11381) % 4096 != 0);
+    grown.frame(11380)[6400] = 3;
+    unsigned char* appended = grown.append();
+    appended[6400] = 4;
+    assertIntEquals(grown.size(), 11382);
+    assertIntEquals(grown.frame(11380)[6400], 3);
+    
+    //A store that is full says so
+    FrameStore full(64, 2);
+    full.append();
+    full.append();
+    bool threw = false;
+    try
+    {
+        full.append();
+    }
+    catch (string e)
+    {
+        threw = true;
+    }
+    assertTrue(threw);
+}
+
+void testFrameCache()
+{
+    string source = "/tmp/videotexture_test_source.mov";
+    string file = "/tmp/videotexture_test_frames.bin";
+    
+    FILE* video = fopen(source.c_str(), "wb");
+    fputs("not really a video", video);
+    fclose(video);
+    
+    //3 frames of 5 x 3
+    unsigned char pixels[3][15];
+    const unsigned char* frames[3];
+    for (int f=0; f<3; f++)
+    {
+        for (int i=0; i<15; i++)
+        {
+            pixels[f][i] = (unsigned char)(f * 15 + i);
+        }
+        frames[f] = pixels[f];
+    }
+    FrameCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.frameCount = 3;
+    header.width = 5;
+    header.height = 3;
+    header.channels = 1;
+    header.startFrame = 10;
+    header.endFrame = -1;
+    header.temporalStride = 2;
+    FrameCache::write(file, source, header, frames);
+    
+    FrameCache cache;
+    assertTrue(cache.open(file));
+    assertIntEquals(cache.header.frameCount, 3);
+    assertIntEquals(cache.header.width, 5);
+    assertIntEquals(cache.header.height, 3);
+    assertIntEquals(cache.header.startFrame, 10);
+    assertIntEquals(cache.header.endFrame, -1);
+    assertIntEquals(cache.header.temporalStride, 2);
+    assertTrue(cache.matchesSource(source));
+    assertTrue(((size_t)cache.frame(0) % 64) == 0);
+    for (int f=0; f<3; f++)
+    {
+        assertTrue(memcmp(cache.frame(f), pixels[f], 15) == 0);
+    }
+    
+    //A video that changed size no longer matches
+    video = fopen(source.c_str(), "ab");
+    fputs("more", video);
+    fclose(video);
+    assertTrue(!cache.matchesSource(source));
+    
+    //Anything that isn't a frame cache is refused
+    FrameCache other;
+    assertTrue(!other.open(source));
+    assertTrue(!other.open("/tmp/videotexture_test_missing.bin"));
+    
+    remove(source.c_str());
+    remove(file.c_str());
+}
+
+void testDistanceCache()
+{
+    string source = "/tmp/videotexture_test_source.mov";
+    string text = "/tmp/videotexture_test_distances.txt";
+    string file = "/tmp/videotexture_test_distances.vtd";
+    
+    FILE* video = fopen(source.c_str(), "wb");
+    fputs("not really a video", video);
+    fclose(video);
+    
+    assertTrue(DistanceCache::usesBinaryFormat(file));
+    assertTrue(!DistanceCache::usesBinaryFormat(text));
+    
+    //3 x 3 text cache with its sidecar
+    FILE* out = fopen(text.c_str(), "w");
+    for (int i=0; i<9; i++)
+    {
+        fprintf(out, "%g\n", (i / 3) * 0.5 + (i % 3) * 0.125);
+    }
+    fclose(out);
+    CacheMetadata metadata;
+    metadata.set("mode", "dense");
+    metadata.setInt("frames", 3);
+    metadata.setDouble("analysisScale", 0.5);
+    metadata.set("maskHash", "abc123");
+    metadata.save(CacheMetadata::sidecarFile(text));
+    
+    DistanceCache::convertTextCache(text, file, source);
+    assertTrue(DistanceCache::isDistanceCache(file));
+    assertTrue(!DistanceCache::isDistanceCache(text));
+    
+    DistanceCache cache;
+    assertTrue(cache.open(file));
+    assertIntEquals(cache.header.frameCount, 3);
+    assertIntEquals(cache.header.rows, 3);
+    assertIntEquals(cache.header.cols, 3);
+    assertTrue(strcmp(cache.header.metric, "dense") == 0);
+    assertTrue(cache.header.analysisScale == 0.5);
+    assertTrue(cache.matchesSource(source));
+    assertTrue(cache.metadata.get("maskHash") == "abc123");
+    assertTrue(((size_t)cache.row(0) % 64) == 0);
+    for (int row=0; row<3; row++)
+    {
+        for (int col=0; col<3; col++)
+        {
+            assertTrue(cache.row(row)[col] == row * 0.5 + col * 0.125);
+        }
+    }
+    
+    //Changes to the mapping stay in memory
+    cache.row(1)[1] = 42.0;
+    DistanceCache again;
+    assertTrue(again.open(file));
+    assertTrue(again.row(1)[1] == 0.5 + 0.125);
+    
+    //A cache that was never finished doesn't replace anything
+    {
+        DistanceCacheHeader header;
+        memset(&header, 0, sizeof(header));
+        header.frameCount = 2;
+        header.rows = 2;
+        header.cols = 2;
+        DistanceCache partial;
+        partial.create(file, source, header, metadata);
+        partial.row(0)[0] = 1.0;
+    }
+    assertTrue(again.open(file));
+    assertIntEquals(again.header.frameCount, 3);
+    
+    //Text caches and other files are refused
+    DistanceCache other;
+    assertTrue(!other.open(text));
+    assertTrue(!other.open("/tmp/videotexture_test_missing.vtd"));
+    
+    remove(source.c_str());
+    remove(text.c_str());
+    remove(CacheMetadata::sidecarFile(text).c_str());
+    remove(file.c_str());
+}
+
+struct PackedSum
+{
+    int size;
+    double sum;
+    
+    template <class Distances>
+    void operator()(const Distances& distances)
+    {
+        for (int row=0; row<size; row++)
+        {
+            for (int col=0; col<size; col++)
+            {
+                sum += distances(row, col);
+            }
+        }
+    }
+};
+
+void testPackedDistanceMatrix()
+{
+    //Every pair above the diagonal has its own slot, in order
+    const int size = 5;
+    assertIntEquals((int)PackedDistanceMatrix<Float32Element>::length(size), 10);
+    int expected = 0;
+    for (int row=0; row<size; row++)
+    {
+        for (int col=row+1; col<size; col++)
+        {
+            assertIntEquals((int)PackedDistanceMatrix<Float32Element>::index(row, col, size), expected);
+            expected++;
+        }
+    }
+    
+    //Symmetric with a zero diagonal, and exact for float32
+    float stored[10];
+    PackedDistanceMatrix<Float32Element> packed(stored, size, 1.0);
+    for (int row=0; row<size; row++)
+    {
+        for (int col=row+1; col<size; col++)
+        {
+            packed.set(col, row, row + col * 0.25);
+        }
+    }
+    for (int row=0; row<size; row++)
+    {
+        assertTrue(packed(row, row) == 0.0);
+        for (int col=row+1; col<size; col++)
+        {
+            assertTrue(packed(row, col) == row + col * 0.25);
+            assertTrue(packed(col, row) == row + col * 0.25);
+        }
+    }
+    assertTrue(packed.max() == 3 + 4 * 0.25);
+    
+    //Half precision: exact for small binary fractions, otherwise within half a step of the 10 bit mantissa
+    assertTrue(Float16Element::decode(Float16Element::encode(0.0)) == 0.0);
+    assertTrue(Float16Element::decode(Float16Element::encode(1.0)) == 1.0);
+    assertTrue(Float16Element::decode(Float16Element::encode(0.375)) == 0.375);
+    assertTrue(Float16Element::decode(Float16Element::encode(65504.0)) == 65504.0);
+    assertTrue(Float16Element::encode(1e6) == 0x7c00);
+    assertTrue(Float16Element::decode(Float16Element::encode(5.9604644775390625e-08)) == 5.9604644775390625e-08);
+    for (double value = 0.001; value < 1000.0; value *= 1.37)
+    {
+        double decoded = Float16Element::decode(Float16Element::encode(value));
+        assertTrue(fabs(decoded - value) <= value / 2048.0);
+    }
+    
+    //uint16 is quantized against the scale, the largest distance
+    assertTrue(Uint16Element::encode(1.0) == 65535);
+    assertTrue(Uint16Element::encode(2.0) == 65535);
+    assertTrue(Uint16Element::encode(-1.0) == 0);
+    uint16_t codes[10];
+    PackedDistanceMatrix<Uint16Element> quantized(codes, size, 4.0);
+    quantized.set(0, 1, 4.0);
+    quantized.set(2, 3, 1.0);
+    assertTrue(quantized(1, 0) == 4.0);
+    assertTrue(fabs(quantized(3, 2) - 1.0) <= 4.0 / 65535.0 / 2.0);
+    
+    //Dispatch on the run time element type
+    PackedDistances distances;
+    distances.element = ELEMENT_FLOAT32;
+    distances.size = size;
+    distances.scale = 2.0;
+    distances.data = stored;
+    assertIntEquals((int)distances.bytes(), 40);
+    PackedSum total = {size, 0.0};
+    distances.visit(total);
+    double sum = 0.0;
+    for (int row=0; row<size; row++)
+    {
+        for (int col=row+1; col<size; col++)
+        {
+            sum += 2.0 * 2.0 * (row + col * 0.25);
+        }
+    }
+    assertTrue(fabs(total.sum - sum) < 1e-9);
+}
+
+void testPackedDistanceCache()
+{
+    string file = "/tmp/videotexture_test_packed.vtd";
+    const int size = 4;
+    
+    DistanceCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.frameCount = size;
+    header.rows = size;
+    header.cols = size;
+    header.layout = DistanceCache::LAYOUT_PACKED_UPPER;
+    header.elementType = ELEMENT_FLOAT16;
+    
+    DistanceCache cache;
+    cache.create(file, "", header, CacheMetadata());
+    PackedDistanceMatrix<Float16Element> packed(cache.packed().data, size, 1.0);
+    for (int row=0; row<size; row++)
+    {
+        for (int col=row+1; col<size; col++)
+        {
+            packed.set(row, col, row * 0.5 + col);
+        }
+    }
+    cache.finish();
+    
+    DistanceCache loaded;
+    assertTrue(loaded.open(file));
+    assertTrue(loaded.isPacked());
+    assertIntEquals((int)loaded.header.elementType, (int)ELEMENT_FLOAT16);
+    PackedDistances distances = loaded.packed();
+    assertIntEquals(distances.size, size);
+    PackedDistanceMatrix<Float16Element> view(distances.data, distances.size, distances.scale);
+    assertTrue(view(3, 1) == 0.5 + 3);
+    assertTrue(view(2, 2) == 0.0);
+    
+    //Only float64 can be stored as full rows
+    header.layout = DistanceCache::LAYOUT_FULL;
+    bool threw = false;
+    try
+    {
+        DistanceCache full;
+        full.create(file, "", header, CacheMetadata());
+    }
+    catch (string e)
+    {
+        threw = true;
+    }
+    assertTrue(threw);
+    
+    remove(file.c_str());
+}
+
+void testTiledDistanceCache()
+{
+    string file = "/tmp/videotexture_test_tiled.vtd";
+    const int size = 10;
+    const int tileSize = 4;
+    
+    DistanceCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.frameCount = size;
+    header.rows = size;
+    header.cols = size;
+    header.layout = DistanceCache::LAYOUT_TILED;
+    header.tileSize = tileSize;
+    
+    DistanceCache cache;
+    cache.create(file, "", header, CacheMetadata());
+    assertIntEquals(cache.tilesAcross(), 3);
+    assertTrue(cache.tile(1, 0) == NULL);
+    
+    //A 4x4 tile is 128 bytes but still gets a page to itself
+    assertTrue((char*)cache.tile(0, 1) - (char*)cache.tile(0, 0) == (long)DistanceCache::dataAlignment);
+    assertTrue((char*)cache.tile(1, 1) - (char*)cache.tile(0, 2) == (long)DistanceCache::dataAlignment);
+    
+    //Tiles are independent, fill them in last to first
+    TiledDistanceMatrix tiled = cache.tiled();
+    for (int tileRow=2; tileRow>=0; tileRow--)
+    {
+        for (int tileCol=2; tileCol>=tileRow; tileCol--)
+        {
+            for (int row=tileRow*tileSize; row<min(size, (tileRow+1)*tileSize); row++)
+            {
+                for (int col=max(row+1, tileCol*tileSize); col<min(size, (tileCol+1)*tileSize); col++)
+                {
+                    tiled.set(row, col, row * 100 + col);
+                }
+            }
+        }
+    }
+    cache.finish();
+    
+    DistanceCache loaded;
+    assertTrue(loaded.open(file));
+    assertTrue(loaded.isTiled());
+    assertIntEquals((int)loaded.header.tileSize, tileSize);
+    
+    //A window across tiles on both sides of the diagonal
+    double window[3][5];
+    double* rows[3] = {window[0], window[1], window[2]};
+    loaded.readWindow(5, 2, 3, 5, rows);
+    assertTrue(window[0][0] == 205);
+    assertTrue(window[0][3] == 0.0);
+    assertTrue(window[0][4] == 506);
+    assertTrue(window[2][0] == 207);
+    assertTrue(window[2][4] == 607);
+    
+    //Last row, in the padded tiles on the edge
+    double last[size];
+    double* lastRow[1] = {last};
+    loaded.readWindow(size - 1, 0, 1, size, lastRow);
+    assertTrue(last[0] == 9);
+    assertTrue(last[8] == 809);
+    assertTrue(last[9] == 0.0);
+    
+    bool threw = false;
+    try
+    {
+        loaded.readWindow(8, 0, 3, 1, lastRow);
+    }
+    catch (string e)
+    {
+        threw = true;
+    }
+    assertTrue(threw);
+    
+    remove(file.c_str());
+}
+
+void testAsymmetricDistanceCache()
+{
+    string file = "/tmp/videotexture_test_asymmetric.vtd";
+    const int size = 5;
+    
+    DistanceCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.frameCount = size;
+    header.rows = size;
+    header.cols = size;
+    strcpy(header.metric, "histogram");
+    assertTrue(!DistanceCache::isSymmetricMetric(header.metric));
+    assertTrue(DistanceCache::isSymmetricMetric("dense"));
+    
+    //Chi-square distances keep both triangles
+    DistanceCache cache;
+    cache.create(file, "", header, CacheMetadata());
+    for (int row=0; row<size; row++)
+    {
+        for (int col=0; col<size; col++)
+        {
+            cache.row(row)[col] = (row == col) ? 0.0 : row * 10 + col;
+        }
+    }
+    cache.finish();
+    
+    DistanceCache loaded;
+    assertTrue(loaded.open(file));
+    double window[size][size];
+    double* rows[size] = {window[0], window[1], window[2], window[3], window[4]};
+    loaded.readWindow(0, 0, size, size, rows);
+    assertTrue(window[1][3] == 13);
+    assertTrue(window[3][1] == 31);
+    assertTrue(window[4][0] == 40);
+    
+    //Packing would replace the lower triangle with the upper one
+    header.layout = DistanceCache::LAYOUT_PACKED_UPPER;
+    header.elementType = ELEMENT_FLOAT32;
+    bool threw = false;
+    try
+    {
+        DistanceCache packed;
+        packed.create(file, "", header, CacheMetadata());
+    }
+    catch (string e)
+    {
+        threw = true;
+    }
+    assertTrue(threw);
+    
+    //So would tiles, only the ones on and above the diagonal are stored
+    DistanceCacheHeader tiledHeader = header;
+    tiledHeader.layout = DistanceCache::LAYOUT_TILED;
+    tiledHeader.elementType = ELEMENT_FLOAT64;
+    tiledHeader.tileSize = 2;
+    threw = false;
+    try
+    {
+        DistanceCache tiled;
+        tiled.create(file, "", tiledHeader, CacheMetadata());
+    }
+    catch (string e)
+    {
+        threw = true;
+    }
+    assertTrue(threw);
+    
+    //A packed file that claims an asymmetric metric isn't opened
+    strcpy(header.metric, "dense");
+    DistanceCache packed;
+    packed.create(file, "", header, CacheMetadata());
+    packed.finish();
+    FILE* handle = fopen(file.c_str(), "r+b");
+    fseek(handle, offsetof(DistanceCacheHeader, metric), SEEK_SET);
+    fwrite("histogram", 1, 10, handle);
+    fclose(handle);
+    assertTrue(!loaded.open(file));
+    
+    //And a tiled one
+    strcpy(tiledHeader.metric, "dense");
+    DistanceCache tiled;
+    tiled.create(file, "", tiledHeader, CacheMetadata());
+    tiled.finish();
+    assertTrue(loaded.open(file));
+    handle = fopen(file.c_str(), "r+b");
+    fseek(handle, offsetof(DistanceCacheHeader, metric), SEEK_SET);
+    fwrite("histogram", 1, 10, handle);
+    fclose(handle);
+    assertTrue(!loaded.open(file));
+    
+    remove(file.c_str());
+}
+
+void testTextDistanceCache()
+{
+    string file = "/tmp/videotexture_test_text.txt";
+    const int size = 200;
+    
+    //Big enough to be split into several chunks, with a blank line and no line break after the last distance
+    FILE* out = fopen(file.c_str(), "w");
+    for (int i=0; i<size*size; i++)
+    {
+        if (i == 5)
+        {
+            fprintf(out, "\n");
+        }
+        else
+        {
+            fprintf(out, (i == size*size - 1) ? "%.10g" : "%.10g\n", (i / size) * 1000 + (i % size) + 0.25);
+        }
+    }
+    fclose(out);
+    
+    assertIntEquals((int)DistanceCache::readTextCache(file, NULL, 0), size * size);
+    
+    vector<double> values(size * size, -1.0);
+    vector<double*> rows;
+    for (int row=0; row<size; row++)
+    {
+        rows.push_back(&values[row * size]);
+    }
+    assertIntEquals((int)DistanceCache::readTextCache(file, &rows[0], size, 4), size * size);
+    assertTrue(rows[0][0] == 0.25);
+    assertTrue(rows[0][5] == 0.0);
+    assertTrue(rows[123][45] == 123045.25);
+    assertTrue(rows[size-1][size-1] == (size-1) * 1000 + size - 1 + 0.25);
+    
+    //A count x count matrix from the first count * count lines
+    double corner[2][2];
+    double* cornerRows[2] = {corner[0], corner[1]};
+    DistanceCache::readTextCache(file, cornerRows, 2, 2);
+    assertTrue(corner[1][0] == 2.25);
+    assertTrue(corner[1][1] == 3.25);
+    
+    remove(file.c_str());
+}
+
+//Writes bytes of one value to a file, and sets its modification time to seconds ago
+void writeTestFile(string file, size_t bytes, int value, int age)
+{
+    FILE* out = fopen(file.c_str(), "wb");
+    for (size_t i=0; i<bytes; i++)
+    {
+        fputc(value, out);
+    }
+    fclose(out);
+    
+    struct timeval now[2];
+    gettimeofday(&now[0], NULL);
+    now[0].tv_sec -= age;
+    now[1] = now[0];
+    utimes(file.c_str(), now);
+}
+
+void testAnalysisCache()
+{
+    string directory = "/tmp/videotexture_test_analysis/";
+    string video = "/tmp/videotexture_test_video.mov";
+    
+    //The hash follows the content, not the name or the modification time
+    writeTestFile(video, 300000, 'a', 0);
+    uint64_t hash = AnalysisCache::contentHash(video);
+    writeTestFile(video, 300000, 'a', 100);
+    assertTrue(AnalysisCache::contentHash(video) == hash);
+    writeTestFile(video, 300001, 'a', 0);
+    assertTrue(AnalysisCache::contentHash(video) != hash);
+    
+    //Every part of a large file is sampled, including the last byte
+    writeTestFile(video, 4000000, 'a', 0);
+    hash = AnalysisCache::contentHash(video);
+    FILE* out = fopen(video.c_str(), "r+b");
+    fseek(out, 3999999, SEEK_SET);
+    fputc('b', out);
+    fclose(out);
+    assertTrue(AnalysisCache::contentHash(video) != hash);
+    
+    //Different parameters or extensions are different results
+    AnalysisCache cache(directory, 2500);
+    CacheMetadata parameters;
+    parameters.set("mode", "dense");
+    string dense = cache.file(video, parameters, ".vtd");
+    assertTrue(dense.compare(0, directory.size(), directory) == 0);
+    assertTrue(cache.file(video, parameters, ".vtd") == dense);
+    assertTrue(cache.file(video, parameters, ".frames") != dense);
+    parameters.setDouble("analysisScale", 0.5);
+    string scaled = cache.file(video, parameters, ".vtd");
+    assertTrue(scaled != dense);
+    assertTrue(!cache.find(dense));
+    
+    //Over the limit the least recently used results go first, never the one just added
+    writeTestFile(dense, 1000, 'x', 300);
+    writeTestFile(scaled, 1000, 'y', 200);
+    assertTrue(cache.find(dense));  //Used now, so scaled is the oldest
+    string newest = directory + "newest.vtd";
+    writeTestFile(newest, 1000, 'z', 0);
+    cache.added(newest);
+    assertTrue(cache.find(dense));
+    assertTrue(!cache.find(scaled));
+    assertTrue(cache.find(newest));
+    assertTrue(cache.size() == 2000);
+    
+    //The latest result follows the path through a change of content, and doesn't count towards the size
+    assertTrue(cache.latest(video, parameters, ".vtd") == "");
+    cache.setLatest(video, parameters, ".vtd", dense);
+    writeTestFile(video, 4000001, 'a', 0);
+    AnalysisCache grown(directory, 2500);   //The content hash is kept for the life of the cache
+    assertTrue(grown.file(video, parameters, ".vtd") != scaled);
+    assertTrue(grown.latest(video, parameters, ".vtd") == dense);
+    assertTrue(grown.latest(video, parameters, ".frames") == "");
+    assertTrue(grown.size() == 2000);
+    remove(dense.c_str());
+    assertTrue(grown.latest(video, parameters, ".vtd") == "");
+    
+    //Caches from before the analysis cache were named after the video
+    assertTrue(cache.legacyFile(video, ".txt") == directory + "videotexture_test_video.mov.txt");
+    
+    cache.setLatest(video, parameters, ".vtd", "");
+    remove(newest.c_str());
+    remove(video.c_str());
+    
+    //The link files are the only ones left
+    DIR* dir = opendir(directory.c_str());
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] != '.')
+        {
+            remove((directory + entry->d_name).c_str());
+        }
+    }
+    closedir(dir);
+    rmdir(directory.c_str());
+}
+
 int main (int argc, const char * argv[])
 {
     std::cout << "Running unit tests\n";
@@ -449,6 +1526,24 @@ int main (int argc, const char * argv[])
     
     testSequencing();
     
+    testFrameDistanceKernels();
+    testGreyscaleConversion();
+    testGramIdentity();
+    testThreadPool();
+    testSparseMatrix();
+    testCacheMetadata();
+    testHistogramDistance();
+    testRingBuffer();
+    testFrameStore();
+    testFrameCache();
+    testDistanceCache();
+    testPackedDistanceMatrix();
+    testPackedDistanceCache();
+    testTiledDistanceCache();
+    testAsymmetricDistanceCache();
+    testTextDistanceCache();
+    testAnalysisCache();
+    
     cout << "If you don't see any errors, unit tests passed!" << endl;
     
     return 0;
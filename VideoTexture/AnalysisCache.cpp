@@ -0,0 +1,271 @@
+//
+//  AnalysisCache.cpp
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-12-07.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <vector>
+#include <algorithm>
+#include "AnalysisCache.h"
+
+//FNV-1a
+static uint64_t hashBytes(uint64_t hash, const unsigned char* bytes, size_t length)
+{
+    for (size_t i=0; i<length; i++)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static string hexString(uint64_t value)
+{
+    char text[17];
+    snprintf(text, sizeof(text), "%016llx", (unsigned long long)value);
+    return string(text);
+}
+
+/**
+ * A result in the directory, for trimming
+ */
+struct CachedResult
+{
+    string path;
+    uint64_t bytes;
+    time_t used;
+
+    bool operator<(const CachedResult& other) const
+    {
+        return this->used < other.used;
+    }
+};
+
+AnalysisCache::AnalysisCache(string directory, uint64_t maxBytes)
+{
+    if (!directory.empty() && directory[directory.size() - 1] != '/')
+    {
+        directory += "/";
+    }
+    this->directory = directory;
+    this->maxBytes = maxBytes;
+    this->hashedContent = 0;
+
+    mkdir(this->directory.c_str(), 0755);
+}
+
+uint64_t AnalysisCache::contentHash(string file)
+{
+    FILE* in = fopen(file.c_str(), "rb");
+    if (in == NULL)
+    {
+        throw string("Couldn't read " + file);
+    }
+
+    struct stat info;
+    if (fstat(fileno(in), &info) != 0)
+    {
+        fclose(in);
+        throw string("Couldn't read " + file);
+    }
+    uint64_t fileSize = (uint64_t)info.st_size;
+
+    uint64_t hash = 14695981039346656037ULL;
+    hash = hashBytes(hash, (const unsigned char*)&fileSize, sizeof(fileSize));
+
+    vector<unsigned char> block(AnalysisCache::hashBlockSize);
+    uint64_t sampled = (uint64_t)AnalysisCache::hashBlocks * AnalysisCache::hashBlockSize;
+    int numBlocks = (fileSize <= sampled) ? (int)((fileSize + hashBlockSize - 1) / hashBlockSize) : AnalysisCache::hashBlocks;
+    for (int i=0; i<numBlocks; i++)
+    {
+        //Evenly spaced from the first block to the last, so the start and the end of the file are always included
+        uint64_t offset = (fileSize <= sampled) ? (uint64_t)i * hashBlockSize
+            : (fileSize - hashBlockSize) * i / (AnalysisCache::hashBlocks - 1);
+        if (fseeko(in, (off_t)offset, SEEK_SET) != 0)
+        {
+            break;
+        }
+        size_t length = fread(&block[0], 1, block.size(), in);
+        hash = hashBytes(hash, &block[0], length);
+    }
+
+    fclose(in);
+    return hash;
+}
+
+string AnalysisCache::file(string videoFile, const CacheMetadata& parameters, string extension)
+{
+    if (videoFile != this->hashedFile)
+    {
+        this->hashedContent = AnalysisCache::contentHash(videoFile);
+        this->hashedFile = videoFile;
+    }
+
+    //The content and every parameter, in the "key value" lines of the metadata
+    string key = hexString(this->hashedContent) + "\n" + parameters.format() + extension;
+    uint64_t hash = hashBytes(14695981039346656037ULL, (const unsigned char*)key.data(), key.size());
+
+    return this->directory + hexString(this->hashedContent) + "-" + hexString(hash) + extension;
+}
+
+bool AnalysisCache::find(string file)
+{
+    struct stat info;
+    if (stat(file.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+    {
+        return false;
+    }
+
+    //The modification time doubles as the last time it was used
+    utimes(file.c_str(), NULL);
+    return true;
+}
+
+void AnalysisCache::added(string file)
+{
+    utimes(file.c_str(), NULL);
+    this->trim(file);
+}
+
+string AnalysisCache::latestFile(string videoFile, const CacheMetadata& parameters, string extension)
+{
+    //The path rather than the content, the content changes when the video grows
+    string key = videoFile + "\n" + parameters.format() + extension;
+    uint64_t hash = hashBytes(14695981039346656037ULL, (const unsigned char*)key.data(), key.size());
+
+    return this->directory + hexString(hash) + ".latest";
+}
+
+void AnalysisCache::setLatest(string videoFile, const CacheMetadata& parameters, string extension, string file)
+{
+    string latest = this->latestFile(videoFile, parameters, extension);
+    FILE* out = fopen(latest.c_str(), "w");
+    if (out == NULL)
+    {
+        return;
+    }
+    fprintf(out, "%s\n", file.c_str());
+    fclose(out);
+}
+
+string AnalysisCache::latest(string videoFile, const CacheMetadata& parameters, string extension)
+{
+    FILE* in = fopen(this->latestFile(videoFile, parameters, extension).c_str(), "r");
+    if (in == NULL)
+    {
+        return "";
+    }
+
+    char line[4096];
+    string file;
+    if (fgets(line, sizeof(line), in) != NULL)
+    {
+        file = line;
+        if (!file.empty() && file[file.size() - 1] == '\n')
+        {
+            file.erase(file.size() - 1);
+        }
+    }
+    fclose(in);
+
+    struct stat info;
+    if (file.empty() || stat(file.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+    {
+        return "";
+    }
+    return file;
+}
+
+string AnalysisCache::legacyFile(string videoFile, string extension)
+{
+    size_t slash = videoFile.find_last_of('/');
+    string name = (slash == string::npos) ? videoFile : videoFile.substr(slash + 1);
+    return this->directory + name + extension;
+}
+
+/**
+ * Every regular file in the directory counts, apart from ones that are still being written and the latest result links
+ */
+static vector<CachedResult> listResults(string directory)
+{
+    vector<CachedResult> results;
+
+    DIR* dir = opendir(directory.c_str());
+    if (dir == NULL)
+    {
+        return results;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        string name = entry->d_name;
+        if (name.empty() || name[0] == '.' || (name.size() > 8 && name.compare(name.size() - 8, 8, ".partial") == 0)
+            || (name.size() > 7 && name.compare(name.size() - 7, 7, ".latest") == 0))
+        {
+            continue;
+        }
+
+        CachedResult result;
+        result.path = directory + name;
+        struct stat info;
+        if (stat(result.path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+        {
+            continue;
+        }
+        result.bytes = (uint64_t)info.st_size;
+        result.used = info.st_mtime;
+        results.push_back(result);
+    }
+    closedir(dir);
+
+    return results;
+}
+
+uint64_t AnalysisCache::size()
+{
+    vector<CachedResult> results = listResults(this->directory);
+    uint64_t total = 0;
+    for (size_t i=0; i<results.size(); i++)
+    {
+        total += results[i].bytes;
+    }
+    return total;
+}
+
+void AnalysisCache::trim(string keep)
+{
+    if (this->maxBytes == 0)
+    {
+        return;
+    }
+
+    vector<CachedResult> results = listResults(this->directory);
+    uint64_t total = 0;
+    for (size_t i=0; i<results.size(); i++)
+    {
+        total += results[i].bytes;
+    }
+
+    //Oldest first
+    stable_sort(results.begin(), results.end());
+    for (size_t i=0; i<results.size() && total > this->maxBytes; i++)
+    {
+        if (results[i].path == keep)
+        {
+            continue;
+        }
+        if (remove(results[i].path.c_str()) == 0)
+        {
+            cout << "Removed least recently used analysis cache " << results[i].path << endl;
+            total -= results[i].bytes;
+        }
+    }
+}
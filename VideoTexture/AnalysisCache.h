@@ -0,0 +1,76 @@
+//
+//  AnalysisCache.h
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-12-07.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include <iostream>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+#include "CacheMetadata.h"
+
+#ifndef ANALYSISCACHE_H
+#define ANALYSISCACHE_H
+
+using namespace std;
+
+/**
+ * Directory of analysis results (distance matrices, frame caches) shared by every tool
+ * Files are named after a hash of the video's content and of everything that affects the result, so a different or
+ * re-encoded video never picks up another video's results, whatever it is called. Results are touched when they are
+ * used, and the least recently used ones are deleted once the directory grows past its size limit.
+ */
+class AnalysisCache
+{
+public:
+    //maxBytes = 0 = no limit
+    AnalysisCache(string directory, uint64_t maxBytes);
+
+    //Path of the result for a video with these parameters, it may not exist yet
+    string file(string videoFile, const CacheMetadata& parameters, string extension);
+
+    //True if the result exists, and marks it as just used
+    bool find(string file);
+
+    //Call after writing a result, deletes old results until the directory fits in the limit again
+    void added(string file);
+
+    //Remembers file as the latest result for the video at this path with these parameters
+    void setLatest(string videoFile, const CacheMetadata& parameters, string extension, string file);
+
+    //Latest result for the video at this path with these parameters, whatever its content was then. A video that grew
+    //since can extend it instead of starting again. "" if there is none, or it has been deleted since
+    string latest(string videoFile, const CacheMetadata& parameters, string extension);
+
+    //Where the tools kept a video's result before there was an analysis cache: the video's file name plus extension
+    string legacyFile(string videoFile, string extension);
+
+    //Deletes least recently used results until the directory is at most maxBytes, never keep
+    void trim(string keep = "");
+
+    //Total size of the results in the directory
+    uint64_t size();
+
+    //Fast fingerprint of a file's content: its size and 16 blocks of 64KB spread evenly through it (all of it if it is
+    //smaller than that). Throws if the file can't be read.
+    static uint64_t contentHash(string file);
+
+    static const int hashBlocks = 16;
+    static const size_t hashBlockSize = 65536;
+
+private:
+    //File that names the latest result for the video at this path with these parameters
+    string latestFile(string videoFile, const CacheMetadata& parameters, string extension);
+
+    string directory;
+    uint64_t maxBytes;
+
+    //Content hash of the last video, hashing reads a megabyte
+    string hashedFile;
+    uint64_t hashedContent;
+};
+
+#endif
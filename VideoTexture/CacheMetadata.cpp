@@ -0,0 +1,129 @@
+//
+//  CacheMetadata.cpp
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-11-26.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+#include "CacheMetadata.h"
+
+void CacheMetadata::set(string key, string value)
+{
+    this->values[key] = value;
+}
+
+void CacheMetadata::setInt(string key, int64_t value)
+{
+    stringstream stream;
+    stream << value;
+    this->values[key] = stream.str();
+}
+
+void CacheMetadata::setDouble(string key, double value)
+{
+    stringstream stream;
+    stream.precision(17);
+    stream << value;
+    this->values[key] = stream.str();
+}
+
+bool CacheMetadata::has(string key)
+{
+    return this->values.find(key) != this->values.end();
+}
+
+string CacheMetadata::get(string key, string missing)
+{
+    map<string, string>::iterator it = this->values.find(key);
+    if (it == this->values.end())
+    {
+        return missing;
+    }
+    return it->second;
+}
+
+int64_t CacheMetadata::getInt(string key, int64_t missing)
+{
+    if (!this->has(key))
+    {
+        return missing;
+    }
+    return strtoll(this->values[key].c_str(), NULL, 10);
+}
+
+double CacheMetadata::getDouble(string key, double missing)
+{
+    if (!this->has(key))
+    {
+        return missing;
+    }
+    return strtod(this->values[key].c_str(), NULL);
+}
+
+/**
+ * Read "key value" lines, the value is the rest of the line
+ */
+bool CacheMetadata::load(string file)
+{
+    fstream infile;
+    infile.open(file.c_str(), ios::in);
+    if (!infile.is_open())
+    {
+        return false;
+    }
+    
+    stringstream text;
+    text << infile.rdbuf();
+    this->parse(text.str());
+    
+    return true;
+}
+
+void CacheMetadata::parse(const string& text)
+{
+    this->values.clear();
+    
+    stringstream lines(text);
+    string line;
+    while (getline(lines, line))
+    {
+        size_t space = line.find(' ');
+        if (line.empty() || space == string::npos)
+        {
+            continue;
+        }
+        this->values[line.substr(0, space)] = line.substr(space + 1);
+    }
+}
+
+string CacheMetadata::format() const
+{
+    stringstream text;
+    for (map<string, string>::const_iterator it = this->values.begin(); it != this->values.end(); it++)
+    {
+        text << it->first << " " << it->second << endl;
+    }
+    return text.str();
+}
+
+void CacheMetadata::save(string file)
+{
+    fstream outfile;
+    outfile.open(file.c_str(), ios::out);
+    if (!outfile.is_open())
+    {
+        throw string("Could not open " + file);
+    }
+    
+    outfile << this->format();
+    outfile.close();
+}
+
+string CacheMetadata::sidecarFile(string cacheFile)
+{
+    return cacheFile + ".meta";
+}
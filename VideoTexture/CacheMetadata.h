@@ -0,0 +1,50 @@
+//
+//  CacheMetadata.h
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-11-26.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <stdint.h>
+
+#ifndef CACHEMETADATA_H
+#define CACHEMETADATA_H
+
+using namespace std;
+
+/**
+ * Describes what a distance matrix cache was computed from
+ * Stored next to a text cache as "<cache>.meta", one "key value" pair per line. Binary caches keep the same lines
+ * inside the file.
+ */
+class CacheMetadata
+{
+public:
+    map<string, string> values;
+    
+    void set(string key, string value);
+    void setInt(string key, int64_t value);
+    void setDouble(string key, double value);
+    
+    bool has(string key);
+    string get(string key, string missing = "");
+    int64_t getInt(string key, int64_t missing = 0);
+    double getDouble(string key, double missing = 0.0f);
+    
+    //Returns false if there is no metadata file
+    bool load(string file);
+    void save(string file);
+    
+    //The "key value" lines as a string, and back
+    string format() const;
+    void parse(const string& text);
+    
+    //Name of the metadata file for a cache file
+    static string sidecarFile(string cacheFile);
+};
+
+#endif
@@ -0,0 +1,201 @@
+//
+//  CompressedFrameStore.cpp
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-12-01.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include "CompressedFrameStore.h"
+
+/**
+ * Encodes one frame
+ */
+class EncodeFrameTask : public Task
+{
+public:
+    CompressedFrameStore* store;
+    vector<uchar>* buffer;
+    cv::Mat frame;
+    
+    void run()
+    {
+        this->store->encode(this->frame, *this->buffer);
+    }
+};
+
+/**
+ * Decodes one frame into the cache
+ */
+class PrefetchFrameTask : public Task
+{
+public:
+    CompressedFrameStore* store;
+    int index;
+    
+    void run()
+    {
+        this->store->decodeIntoCache(this->index);
+    }
+};
+
+
+CompressedFrameStore::CompressedFrameStore(string extension, size_t cacheBytes, int numThreads)
+{
+    this->extension = extension;
+    this->cacheBytes = cacheBytes;
+    this->cachedBytes = 0;
+    this->pool = new ThreadPool(numThreads);
+    this->encoding = 0;
+    this->maxEncoding = 2 * this->pool->getNumThreads();
+    pthread_mutex_init(&this->lock, NULL);
+    pthread_cond_init(&this->encodeFinished, NULL);
+}
+
+CompressedFrameStore::~CompressedFrameStore()
+{
+    //Finishes the background work before anything it uses goes away
+    delete this->pool;
+    pthread_cond_destroy(&this->encodeFinished);
+    pthread_mutex_destroy(&this->lock);
+}
+
+void CompressedFrameStore::add(const cv::Mat& frame)
+{
+    //Every copy is a whole decoded frame, they would pile up if the video decodes faster than it encodes
+    pthread_mutex_lock(&this->lock);
+    while (this->encoding >= this->maxEncoding)
+    {
+        pthread_cond_wait(&this->encodeFinished, &this->lock);
+    }
+    this->encoding++;
+    pthread_mutex_unlock(&this->lock);
+    
+    this->encoded.push_back(vector<uchar>());
+    
+    EncodeFrameTask* task = new EncodeFrameTask();
+    task->store = this;
+    task->buffer = &this->encoded.back();   //The deque never moves it, even while more frames are added
+    task->frame = frame.clone();    //The capture reuses its frame
+    this->pool->add(task);
+}
+
+void CompressedFrameStore::encode(cv::Mat frame, vector<uchar>& buffer)
+{
+    if (!cv::imencode(this->extension, frame, buffer))
+    {
+        //Runs on a worker, so it can't throw
+        cout << "Couldn't encode frame as " << this->extension << endl;
+    }
+    
+    pthread_mutex_lock(&this->lock);
+    this->encoding--;
+    pthread_cond_signal(&this->encodeFinished);
+    pthread_mutex_unlock(&this->lock);
+}
+
+void CompressedFrameStore::finish()
+{
+    this->pool->wait();
+}
+
+int CompressedFrameStore::size()
+{
+    return (int)this->encoded.size();
+}
+
+size_t CompressedFrameStore::getEncodedBytes()
+{
+    size_t total = 0;
+    for (size_t i=0; i<this->encoded.size(); i++)
+    {
+        total += this->encoded[i].size();
+    }
+    return total;
+}
+
+cv::Mat CompressedFrameStore::decode(int index)
+{
+    return cv::imdecode(cv::Mat(this->encoded[index]), 1);
+}
+
+/**
+ * Adds a decoded frame to the cache and evicts the least recently used frames until it fits
+ * Must be called with lock held
+ */
+void CompressedFrameStore::insert(int index, cv::Mat frame)
+{
+    if (this->cached.find(index) != this->cached.end())
+    {
+        return;
+    }
+    
+    this->recent.push_front(index);
+    CachedFrame& entry = this->cached[index];
+    entry.frame = frame;
+    entry.position = this->recent.begin();
+    this->cachedBytes += frame.total() * frame.elemSize();
+    
+    //Always keep the newest frame, even if it is bigger than the whole cache
+    while (this->cachedBytes > this->cacheBytes && this->recent.size() > 1)
+    {
+        int oldest = this->recent.back();
+        this->recent.pop_back();
+        
+        map<int, CachedFrame>::iterator victim = this->cached.find(oldest);
+        this->cachedBytes -= victim->second.frame.total() * victim->second.frame.elemSize();
+        this->cached.erase(victim);
+    }
+}
+
+cv::Mat CompressedFrameStore::get(int index)
+{
+    pthread_mutex_lock(&this->lock);
+    map<int, CachedFrame>::iterator found = this->cached.find(index);
+    if (found != this->cached.end())
+    {
+        //Move it to the front
+        this->recent.splice(this->recent.begin(), this->recent, found->second.position);
+        cv::Mat frame = found->second.frame;
+        pthread_mutex_unlock(&this->lock);
+        return frame;
+    }
+    pthread_mutex_unlock(&this->lock);
+    
+    //Decode outside the lock so prefetching carries on
+    cv::Mat frame = this->decode(index);
+    
+    pthread_mutex_lock(&this->lock);
+    this->insert(index, frame);
+    pthread_mutex_unlock(&this->lock);
+    return frame;
+}
+
+void CompressedFrameStore::prefetch(int first, int count)
+{
+    int last = min(first + count, this->size());
+    for (int i=max(first, 0); i<last; i++)
+    {
+        pthread_mutex_lock(&this->lock);
+        bool queue = this->cached.find(i) == this->cached.end() && this->pending.insert(i).second;
+        pthread_mutex_unlock(&this->lock);
+        
+        if (queue)
+        {
+            PrefetchFrameTask* task = new PrefetchFrameTask();
+            task->store = this;
+            task->index = i;
+            this->pool->add(task);
+        }
+    }
+}
+
+void CompressedFrameStore::decodeIntoCache(int index)
+{
+    cv::Mat frame = this->decode(index);
+    
+    pthread_mutex_lock(&this->lock);
+    this->pending.erase(index);
+    this->insert(index, frame);
+    pthread_mutex_unlock(&this->lock);
+}
@@ -0,0 +1,94 @@
+//
+//  CompressedFrameStore.h
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-12-01.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <pthread.h>
+
+#include "core.hpp"
+#include "highgui.hpp"
+
+#include "ThreadPool.h"
+
+#ifndef COMPRESSEDFRAMESTORE_H
+#define COMPRESSEDFRAMESTORE_H
+
+using namespace std;
+
+/**
+ * Colour frames kept encoded in memory, with the most recently used ones kept decoded
+ * Frames are encoded on a thread pool as they are added. A frame that isn't in the cache is decoded when it is asked
+ * for, and prefetch() decodes the frames that are about to be asked for in the background.
+ */
+class CompressedFrameStore
+{
+public:
+    //extension = ".jpg" or ".png", cacheBytes = decoded frames kept in memory
+    CompressedFrameStore(string extension, size_t cacheBytes, int numThreads = 0);
+    ~CompressedFrameStore();
+    
+    //Adds a copy of the frame, it is encoded in the background
+    //Waits while maxEncoding copies are waiting to be encoded, so decoding can't run ahead of the encoders
+    void add(const cv::Mat& frame);
+    
+    //Wait until every frame that was added is encoded
+    void finish();
+    
+    int size();
+    size_t getEncodedBytes();
+    
+    //Decoded frame. It stays valid after it leaves the cache.
+    cv::Mat get(int index);
+    
+    //Decode frames [first, first + count) in the background if they aren't cached
+    void prefetch(int first, int count);
+    
+    //Used by the background tasks
+    void encode(cv::Mat frame, vector<uchar>& buffer);
+    void decodeIntoCache(int index);
+    
+private:
+    struct CachedFrame
+    {
+        cv::Mat frame;
+        list<int>::iterator position;  //In recent
+    };
+    
+    string extension;
+    ThreadPool* pool;
+    
+    //Copies of frames that are queued or being encoded, protected by lock. 2 per thread keeps every encoder busy
+    int encoding;
+    int maxEncoding;
+    pthread_cond_t encodeFinished;
+    
+    //Frames are never moved once they are added, the encoders write straight into them
+    deque< vector<uchar> > encoded;
+    
+    //Decoded frames, protected by lock. recent is most recently used first.
+    pthread_mutex_t lock;
+    map<int, CachedFrame> cached;
+    list<int> recent;
+    set<int> pending;   //Queued for prefetching
+    size_t cacheBytes;
+    size_t cachedBytes;
+    
+    cv::Mat decode(int index);
+    void insert(int index, cv::Mat frame);
+    
+    //Not copyable
+    CompressedFrameStore(const CompressedFrameStore&);
+    CompressedFrameStore& operator=(const CompressedFrameStore&);
+};
+
+#endif
@@ -0,0 +1,647 @@
+//
+//  DistanceCache.cpp
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-12-05.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include "DistanceCache.h"
+#include "FrameCache.h"
+#include "ThreadPool.h"
+#include "VideoTextureSettings.h"
+
+static const char distanceCacheMagic[8] = {'V', 'T', 'D', 'I', 'S', 'T', 'M', 'X'};
+
+//LAYOUT_TILED
+static int tilesAcrossMatrix(const DistanceCacheHeader& header)
+{
+    return header.tileSize > 0 ? (int)((header.rows + header.tileSize - 1) / header.tileSize) : 0;
+}
+
+static uint64_t tileBytes(const DistanceCacheHeader& header)
+{
+    return (uint64_t)header.tileSize * header.tileSize * sizeof(double);
+}
+
+//Every tile starts on a page of its own whatever the tile size, the rest of its last page is padding
+static uint64_t tileStride(const DistanceCacheHeader& header)
+{
+    return (tileBytes(header) + DistanceCache::dataAlignment - 1) / DistanceCache::dataAlignment * DistanceCache::dataAlignment;
+}
+
+const char* DistanceCache::extension = ".vtd";
+
+DistanceCache::DistanceCache()
+{
+    memset(&this->header, 0, sizeof(this->header));
+    this->mapping = NULL;
+    this->mappedBytes = 0;
+}
+
+DistanceCache::~DistanceCache()
+{
+    this->close();
+}
+
+void DistanceCache::close()
+{
+    if (this->mapping != NULL)
+    {
+        munmap(this->mapping, this->mappedBytes);
+        this->mapping = NULL;
+        this->mappedBytes = 0;
+    }
+    this->tilePointers.clear();
+
+    //A created file that was never finished is thrown away
+    if (!this->file.empty())
+    {
+        remove((this->file + ".partial").c_str());
+        this->file = "";
+    }
+}
+
+bool DistanceCache::open(string file)
+{
+    this->close();
+
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(DistanceCacheHeader))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    //Copy on write, nothing written to the mapping ever reaches the file
+    void* memory = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED)
+    {
+        return false;
+    }
+    this->mapping = (unsigned char*) memory;
+    this->mappedBytes = (size_t)info.st_size;
+
+    memcpy(&this->header, this->mapping, sizeof(DistanceCacheHeader));
+    if (memcmp(this->header.magic, distanceCacheMagic, sizeof(distanceCacheMagic)) != 0
+        || this->header.version != DistanceCache::currentVersion
+        || this->header.headerSize != sizeof(DistanceCacheHeader)
+        || this->header.rows < 0 || this->header.cols < 0
+        || (this->header.layout == LAYOUT_FULL && this->header.elementType != ELEMENT_FLOAT64)
+        || (this->header.layout == LAYOUT_PACKED_UPPER && this->header.rows != this->header.cols)
+        || (this->header.layout == LAYOUT_TILED && (this->header.rows != this->header.cols || this->header.tileSize == 0
+            || this->header.elementType != ELEMENT_FLOAT64))
+        || (this->header.layout != LAYOUT_FULL && this->header.layout != LAYOUT_PACKED_UPPER && this->header.layout != LAYOUT_TILED)
+        || distanceElementSize((DistanceElement)this->header.elementType) == 0
+        || (this->header.layout != LAYOUT_FULL && !isSymmetricMetric(this->header.metric))
+        || this->header.metadataOffset + this->header.metadataBytes > this->mappedBytes
+        || this->header.dataOffset + DistanceCache::dataBytes(this->header) > this->mappedBytes)
+    {
+        this->close();
+        return false;
+    }
+
+    if (this->header.layout == LAYOUT_TILED)
+    {
+        //Every tile on and above the diagonal has to be somewhere in the file, wherever the writer put it
+        int across = tilesAcrossMatrix(this->header);
+        uint64_t indexBytes = (uint64_t)across * across * sizeof(uint64_t);
+        if (this->header.indexOffset % sizeof(uint64_t) != 0 || this->header.indexOffset + indexBytes > this->mappedBytes)
+        {
+            this->close();
+            return false;
+        }
+        uint64_t* offsets = this->index();
+        this->tilePointers.assign((size_t)across * across, (double*)NULL);
+        for (int tileRow=0; tileRow < across; tileRow++)
+        {
+            for (int tileCol=tileRow; tileCol < across; tileCol++)
+            {
+                uint64_t offset = offsets[tileRow * across + tileCol];
+                if (offset < this->header.dataOffset || offset % sizeof(double) != 0 || offset + tileBytes(this->header) > this->mappedBytes)
+                {
+                    this->close();
+                    return false;
+                }
+                this->tilePointers[tileRow * across + tileCol] = (double*)(this->mapping + offset);
+            }
+        }
+
+        //Windows only touch the tiles they cover, reading ahead would page in the rest of the row of tiles
+        madvise(this->mapping, this->mappedBytes, MADV_RANDOM);
+    }
+
+    this->metadata.parse(string((const char*)this->mapping + this->header.metadataOffset, (size_t)this->header.metadataBytes));
+    return true;
+}
+
+void DistanceCache::create(string file, string videoFile, DistanceCacheHeader header, const CacheMetadata& metadata)
+{
+    this->close();
+
+    string text = metadata.format();
+
+    memcpy(header.magic, distanceCacheMagic, sizeof(distanceCacheMagic));
+    header.version = DistanceCache::currentVersion;
+    header.headerSize = sizeof(DistanceCacheHeader);
+    if (header.layout == 0)
+    {
+        header.layout = LAYOUT_FULL;
+    }
+    if (header.elementType == 0)
+    {
+        header.elementType = ELEMENT_FLOAT64;
+    }
+    if (header.elementScale == 0.0)
+    {
+        header.elementScale = 1.0;
+    }
+    if ((header.layout == LAYOUT_FULL && header.elementType != ELEMENT_FLOAT64)
+        || (header.layout == LAYOUT_PACKED_UPPER && (header.rows != header.cols || !isSymmetricMetric(header.metric)))
+        || (header.layout == LAYOUT_TILED && (header.rows != header.cols || header.tileSize == 0 || header.elementType != ELEMENT_FLOAT64
+            || !isSymmetricMetric(header.metric)))
+        || distanceElementSize((DistanceElement)header.elementType) == 0)
+    {
+        throw string("Unsupported distance cache layout for " + file);
+    }
+    if (header.layout != LAYOUT_TILED)
+    {
+        header.tileSize = 0;
+    }
+    int across = tilesAcrossMatrix(header);
+    header.rowStride = (header.layout == LAYOUT_FULL) ? ((uint64_t)header.cols * sizeof(double) + 63) / 64 * 64 : 0;
+    header.metadataOffset = sizeof(DistanceCacheHeader);
+    header.metadataBytes = text.size();
+    header.indexOffset = (header.layout == LAYOUT_TILED) ? (header.metadataOffset + header.metadataBytes + 7) / 8 * 8 : 0;
+    uint64_t dataStart = (header.layout == LAYOUT_TILED) ? header.indexOffset + (uint64_t)across * across * sizeof(uint64_t)
+        : header.metadataOffset + header.metadataBytes;
+    header.dataOffset = (dataStart + dataAlignment - 1) / dataAlignment * dataAlignment;
+    if (!FrameCache::getSourceStamp(videoFile, header.sourceSize, header.sourceModified))
+    {
+        header.sourceSize = 0;
+        header.sourceModified = 0;
+    }
+
+    //Filled in under another name and renamed at the end, so a half written cache is never opened
+    string partial = file + ".partial";
+    size_t bytes = (size_t)(header.dataOffset + DistanceCache::dataBytes(header));
+
+    int fd = ::open(partial.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        throw string("Couldn't write distance cache " + file);
+    }
+
+    void* memory = MAP_FAILED;
+    if (ftruncate(fd, (off_t)bytes) == 0)
+    {
+        memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (memory == MAP_FAILED)
+    {
+        remove(partial.c_str());
+        throw string("Couldn't write distance cache " + file);
+    }
+
+    this->mapping = (unsigned char*) memory;
+    this->mappedBytes = bytes;
+    this->file = file;
+    this->header = header;
+    this->metadata = metadata;
+
+    memcpy(this->mapping, &header, sizeof(header));
+    memcpy(this->mapping + header.metadataOffset, text.data(), text.size());
+
+    //Tiles go in the data row by row, the index is what readers go by so another writer could order them differently
+    if (header.layout == LAYOUT_TILED)
+    {
+        uint64_t* offsets = this->index();
+        uint64_t offset = header.dataOffset;
+        this->tilePointers.assign((size_t)across * across, (double*)NULL);
+        for (int tileRow=0; tileRow < across; tileRow++)
+        {
+            for (int tileCol=tileRow; tileCol < across; tileCol++)
+            {
+                offsets[tileRow * across + tileCol] = offset;
+                this->tilePointers[tileRow * across + tileCol] = (double*)(this->mapping + offset);
+                offset += tileStride(header);
+            }
+        }
+    }
+}
+
+void DistanceCache::finish()
+{
+    if (this->file.empty())
+    {
+        return;
+    }
+
+    string partial = this->file + ".partial";
+    bool ok = msync(this->mapping, this->mappedBytes, MS_SYNC) == 0;
+    munmap(this->mapping, this->mappedBytes);
+    this->mapping = NULL;
+    this->mappedBytes = 0;
+    this->tilePointers.clear();
+
+    if (!ok || rename(partial.c_str(), this->file.c_str()) != 0)
+    {
+        remove(partial.c_str());
+        this->file = "";
+        throw string("Couldn't write distance cache");
+    }
+    this->file = "";
+}
+
+double* DistanceCache::row(int index)
+{
+    return (double*)(this->mapping + this->header.dataOffset + (uint64_t)index * this->header.rowStride);
+}
+
+PackedDistances DistanceCache::packed()
+{
+    PackedDistances packed;
+    packed.element = (DistanceElement)this->header.elementType;
+    packed.size = this->header.rows;
+    packed.scale = this->header.elementScale;
+    packed.data = this->mapping + this->header.dataOffset;
+    return packed;
+}
+
+double* DistanceCache::tile(int tileRow, int tileCol)
+{
+    return this->tilePointers[tileRow * this->tilesAcross() + tileCol];
+}
+
+TiledDistanceMatrix DistanceCache::tiled()
+{
+    return TiledDistanceMatrix(this->tilePointers.empty() ? NULL : &this->tilePointers[0], this->tilesAcross(), (int)this->header.tileSize);
+}
+
+int DistanceCache::tilesAcross()
+{
+    return tilesAcrossMatrix(this->header);
+}
+
+uint64_t* DistanceCache::index()
+{
+    return (uint64_t*)(this->mapping + this->header.indexOffset);
+}
+
+/**
+ * Copies a window out of any of the accessors
+ */
+struct ReadDistanceWindow
+{
+    int row;
+    int col;
+    int numRows;
+    int numCols;
+    double* const* out;
+
+    template <class Distances>
+    void operator()(const Distances& distances)
+    {
+        for (int i=0; i<this->numRows; i++)
+        {
+            for (int j=0; j<this->numCols; j++)
+            {
+                this->out[i][j] = distances(this->row + i, this->col + j);
+            }
+        }
+    }
+};
+
+void DistanceCache::readWindow(int row, int col, int numRows, int numCols, double* const* out)
+{
+    if (row < 0 || col < 0 || numRows < 0 || numCols < 0 || row + numRows > this->header.rows || col + numCols > this->header.cols)
+    {
+        throw string("Window is outside the distance cache");
+    }
+
+    ReadDistanceWindow window = {row, col, numRows, numCols, out};
+    if (this->isPacked())
+    {
+        this->packed().visit(window);
+    }
+    else if (this->isTiled())
+    {
+        window(this->tiled());
+    }
+    else
+    {
+        for (int i=0; i<numRows; i++)
+        {
+            memcpy(out[i], this->row(row + i) + col, numCols * sizeof(double));
+        }
+    }
+}
+
+bool DistanceCache::isPacked()
+{
+    return this->header.layout == LAYOUT_PACKED_UPPER;
+}
+
+bool DistanceCache::isTiled()
+{
+    return this->header.layout == LAYOUT_TILED;
+}
+
+uint64_t DistanceCache::dataBytes(const DistanceCacheHeader& header)
+{
+    if (header.layout == LAYOUT_PACKED_UPPER)
+    {
+        return (uint64_t)PackedDistanceMatrix<Float64Element>::length(header.rows) * distanceElementSize((DistanceElement)header.elementType);
+    }
+    if (header.layout == LAYOUT_TILED)
+    {
+        //Only the tiles on and above the diagonal
+        uint64_t across = (uint64_t)tilesAcrossMatrix(header);
+        return across * (across + 1) / 2 * tileStride(header);
+    }
+    return (uint64_t)header.rows * header.rowStride;
+}
+
+bool DistanceCache::isSymmetricMetric(const char* metric)
+{
+    //Chi-square takes the first histogram as the reference, the other modes compare both frames the same way
+    return strcmp(metric, distanceModeName(DISTANCE_HISTOGRAM)) != 0;
+}
+
+bool DistanceCache::matchesSource(string videoFile)
+{
+    int64_t size, modified;
+    if (!FrameCache::getSourceStamp(videoFile, size, modified))
+    {
+        return false;
+    }
+    return size == this->header.sourceSize && modified == this->header.sourceModified;
+}
+
+bool DistanceCache::isDistanceCache(string file)
+{
+    char magic[sizeof(distanceCacheMagic)];
+    FILE* in = fopen(file.c_str(), "rb");
+    if (in == NULL)
+    {
+        return false;
+    }
+    bool ok = fread(magic, sizeof(magic), 1, in) == 1;
+    fclose(in);
+    return ok && memcmp(magic, distanceCacheMagic, sizeof(magic)) == 0;
+}
+
+bool DistanceCache::usesBinaryFormat(string file)
+{
+    size_t length = strlen(DistanceCache::extension);
+    return file.size() >= length && file.compare(file.size() - length, length, DistanceCache::extension) == 0;
+}
+
+/**
+ * Lines of a text cache between two line breaks
+ */
+struct TextChunk
+{
+    const char* start;
+    const char* end;    //Just after the chunk's last line break, or the end of the file
+    const char* fileEnd;
+    size_t firstLine;
+    size_t lines;
+};
+
+/**
+ * Counts the lines of a chunk, or parses them into the matrix once every chunk knows its first line
+ */
+class TextChunkTask : public Task
+{
+public:
+    TextChunk* chunk;
+    double* const* rows;   //NULL = count
+    int count;
+
+    void run()
+    {
+        if (this->rows == NULL)
+        {
+            this->countLines();
+        }
+        else
+        {
+            this->parseLines();
+        }
+    }
+
+    void countLines()
+    {
+        size_t lines = 0;
+        const char* p = this->chunk->start;
+        while (p < this->chunk->end)
+        {
+            const char* lineEnd = (const char*) memchr(p, '\n', this->chunk->end - p);
+            lines++;
+            if (lineEnd == NULL)
+            {
+                break;
+            }
+            p = lineEnd + 1;
+        }
+        this->chunk->lines = lines;
+    }
+
+    void parseLines()
+    {
+        size_t line = this->chunk->firstLine;
+        size_t values = (size_t)this->count * this->count;
+        const char* p = this->chunk->start;
+        while (p < this->chunk->end && line < values)
+        {
+            const char* lineEnd = (const char*) memchr(p, '\n', this->chunk->end - p);
+            double value;
+            if (lineEnd != NULL)
+            {
+                value = parseLine(p, lineEnd);
+            }
+            else
+            {
+                //The last line has no line break after it, strtod would read past the end of the mapping
+                char text[64];
+                size_t length = min((size_t)(this->chunk->fileEnd - p), sizeof(text) - 1);
+                memcpy(text, p, length);
+                text[length] = '\0';
+                value = parseLine(text, text + length);
+            }
+            this->rows[line / this->count][line % this->count] = value;
+            line++;
+            if (lineEnd == NULL)
+            {
+                break;
+            }
+            p = lineEnd + 1;
+        }
+    }
+
+    //Same as atof on the line, strtod stops at the line break as long as it doesn't start on whitespace
+    static double parseLine(const char* p, const char* lineEnd)
+    {
+        while (p < lineEnd && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\v' || *p == '\f'))
+        {
+            p++;
+        }
+        if (p == lineEnd)
+        {
+            return 0.0;
+        }
+        return strtod(p, NULL);
+    }
+};
+
+size_t DistanceCache::readTextCache(string file, double* const* rows, int count, int numThreads)
+{
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw string("Couldn't open file " + file);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        ::close(fd);
+        throw string("Couldn't open file " + file);
+    }
+    size_t bytes = (size_t)info.st_size;
+    if (bytes == 0)
+    {
+        ::close(fd);
+        return 0;
+    }
+
+    void* memory = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED)
+    {
+        throw string("Couldn't map file " + file);
+    }
+    madvise(memory, bytes, MADV_SEQUENTIAL);
+    const char* text = (const char*) memory;
+    const char* fileEnd = text + bytes;
+
+    //A few chunks per thread so uneven ones balance out, each starting just after a line break
+    ThreadPool pool(numThreads);
+    size_t numChunks = min((size_t)pool.getNumThreads() * 4, bytes / DistanceCache::textChunkBytes + 1);
+    vector<TextChunk> chunks(numChunks);
+    const char* start = text;
+    for (size_t i=0; i<numChunks; i++)
+    {
+        const char* end = fileEnd;
+        if (i + 1 < numChunks)
+        {
+            end = max(start, text + bytes * (i + 1) / numChunks);
+            const char* lineEnd = (end < fileEnd) ? (const char*) memchr(end, '\n', fileEnd - end) : NULL;
+            end = (lineEnd == NULL) ? fileEnd : lineEnd + 1;
+        }
+        chunks[i].start = start;
+        chunks[i].end = end;
+        chunks[i].fileEnd = fileEnd;
+        chunks[i].firstLine = 0;
+        chunks[i].lines = 0;
+        start = end;
+    }
+
+    //Lines in every chunk first, then every chunk knows which distances it holds
+    for (int pass=0; pass < 2; pass++)
+    {
+        if (pass == 1 && (rows == NULL || count <= 0))
+        {
+            break;
+        }
+        for (size_t i=0; i<numChunks; i++)
+        {
+            TextChunkTask* task = new TextChunkTask();
+            task->chunk = &chunks[i];
+            task->rows = (pass == 0) ? NULL : rows;
+            task->count = count;
+            pool.add(task);
+        }
+        pool.wait();
+
+        for (size_t i=1; pass == 0 && i<numChunks; i++)
+        {
+            chunks[i].firstLine = chunks[i - 1].firstLine + chunks[i - 1].lines;
+        }
+    }
+
+    munmap(memory, bytes);
+    return chunks[numChunks - 1].firstLine + chunks[numChunks - 1].lines;
+}
+
+/**
+ * The text cache is one distance per line in row order. The number of frames comes from the sidecar, or from the
+ * number of lines if there isn't one.
+ */
+void DistanceCache::convertTextCache(string textFile, string binaryFile, string videoFile)
+{
+    fstream infile;
+    infile.open(textFile.c_str(), ios::in);
+    if (!infile.is_open())
+    {
+        throw string("Couldn't open file " + textFile);
+    }
+    if (infile.peek() == 's')
+    {
+        throw string("Only dense caches can be converted: " + textFile);
+    }
+    infile.close();
+
+    size_t lines = DistanceCache::readTextCache(textFile, NULL, 0);
+
+    CacheMetadata metadata;
+    metadata.load(CacheMetadata::sidecarFile(textFile));
+    int frames = (int)metadata.getInt("frames", (int64_t)sqrt((double)lines));
+    if ((size_t)frames * frames != lines)
+    {
+        throw string("Cache doesn't hold a square matrix: " + textFile);
+    }
+    metadata.setInt("frames", frames);
+
+    DistanceCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.frameCount = frames;
+    header.rows = frames;
+    header.cols = frames;
+    strncpy(header.metric, metadata.get("mode", "dense").c_str(), sizeof(header.metric) - 1);
+    header.analysisScale = metadata.getDouble("analysisScale", 1.0);
+    header.analysisWidth = (int32_t)metadata.getInt("analysisWidth", metadata.getInt("width"));
+    header.analysisHeight = (int32_t)metadata.getInt("analysisHeight", metadata.getInt("height"));
+
+    DistanceCache cache;
+    cache.create(binaryFile, videoFile, header, metadata);
+    vector<double*> rows;
+    for (int row=0; row<frames; row++)
+    {
+        rows.push_back(cache.row(row));
+    }
+    if (frames > 0)
+    {
+        DistanceCache::readTextCache(textFile, &rows[0], frames);
+    }
+    cache.finish();
+}
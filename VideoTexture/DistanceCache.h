@@ -0,0 +1,207 @@
+//
+//  DistanceCache.h
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-12-05.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include "CacheMetadata.h"
+#include "PackedDistanceMatrix.h"
+
+#ifndef DISTANCECACHE_H
+#define DISTANCECACHE_H
+
+using namespace std;
+
+/**
+ * Fixed size header at the start of a binary distance cache
+ */
+struct DistanceCacheHeader
+{
+    char magic[8];          //"VTDISTMX"
+    uint32_t version;
+    uint32_t headerSize;    //sizeof(DistanceCacheHeader) when it was written
+    int32_t frameCount;     //Frames the matrix covers
+    int32_t rows;
+    int32_t cols;
+    uint32_t elementType;   //DistanceElement
+    uint32_t layout;        //DistanceCache::Layout
+    uint32_t tileSize;      //LAYOUT_TILED: rows and columns of a tile, 0 otherwise
+    char metric[16];        //Distance mode name, eg. "dense", zero padded
+    double analysisScale;   //Frames were compared at this fraction of the video's size
+    double elementScale;    //Distance of a stored value is its decoded value times this, the largest distance for uint16
+    int32_t analysisWidth;
+    int32_t analysisHeight;
+    int64_t sourceSize;     //Size and modification time of the video the distances were calculated from
+    int64_t sourceModified;
+    uint64_t metadataOffset;    //CacheMetadata as "key value" lines, what used to be the .meta sidecar
+    uint64_t metadataBytes;
+    uint64_t dataOffset;    //Start of the distances, page aligned
+    uint64_t rowStride;     //LAYOUT_FULL: bytes from the start of one row to the next, a multiple of 64
+    uint64_t indexOffset;   //LAYOUT_TILED: file offset of every tile, tilesAcross x tilesAcross uint64_t in row order
+};
+
+/**
+ * Accessor for a symmetric matrix stored as square tiles on and above the diagonal, same interface as
+ * PackedDistanceMatrix and FullDistanceMatrix. Distances below the diagonal are read from the transposed tile.
+ */
+class TiledDistanceMatrix
+{
+public:
+    double** tiles;     //tilesAcross x tilesAcross, NULL below the diagonal
+    int tilesAcross;
+    int tileSize;
+
+    TiledDistanceMatrix(double** tiles, int tilesAcross, int tileSize)
+    {
+        this->tiles = tiles;
+        this->tilesAcross = tilesAcross;
+        this->tileSize = tileSize;
+    }
+
+    double operator()(int row, int col) const
+    {
+        int tileRow = row / this->tileSize, tileCol = col / this->tileSize;
+        if (tileRow <= tileCol)
+        {
+            return this->tiles[tileRow * this->tilesAcross + tileCol][(row % this->tileSize) * this->tileSize + col % this->tileSize];
+        }
+        return this->tiles[tileCol * this->tilesAcross + tileRow][(col % this->tileSize) * this->tileSize + row % this->tileSize];
+    }
+
+    //Setting (row, col) also sets (col, row), both are in the same tile on the diagonal
+    void set(int row, int col, double distance) const
+    {
+        if (row / this->tileSize > col / this->tileSize)
+        {
+            int swap = row;
+            row = col;
+            col = swap;
+        }
+        int tileRow = row / this->tileSize, tileCol = col / this->tileSize;
+        double* tile = this->tiles[tileRow * this->tilesAcross + tileCol];
+        tile[(row % this->tileSize) * this->tileSize + col % this->tileSize] = distance;
+        if (tileRow == tileCol)
+        {
+            tile[(col % this->tileSize) * this->tileSize + row % this->tileSize] = distance;
+        }
+    }
+};
+
+/**
+ * Dense distance matrix in a binary file that is loaded with one mmap and no parsing
+ * The file is a DistanceCacheHeader, the metadata and then the distances. They are either every row of doubles, each
+ * starting on a 64 byte boundary, only the upper triangle as a PackedDistanceMatrix of any DistanceElement, or square
+ * tiles of doubles found through an index, so a window of the matrix only touches the pages of the tiles it overlaps.
+ * Files whose name ends in DistanceCache::extension are written in this format, text caches are still read and written
+ * for every other name. Readers tell the formats apart by the magic, not the name.
+ */
+class DistanceCache
+{
+public:
+    static const uint32_t currentVersion = 3;
+    static const uint64_t dataAlignment = 4096;
+    static const char* extension;   //".vtd"
+
+    enum Layout
+    {
+        LAYOUT_FULL = 1,            //rows x cols doubles
+        LAYOUT_PACKED_UPPER = 2,    //N(N-1)/2 values of header.elementType, rows == cols
+        LAYOUT_TILED = 3            //tileSize x tileSize doubles on and above the diagonal, rows == cols
+    };
+
+    DistanceCacheHeader header;
+    CacheMetadata metadata;
+
+    DistanceCache();
+    ~DistanceCache();
+
+    //Returns false if the file is missing or isn't a distance cache of this version.
+    //The mapping is private, so rows can be changed in memory (eg. normalized) without changing the file.
+    bool open(string file);
+
+    //Makes "<file>.partial" with room for header.rows x header.cols distances in header.layout and header.elementType
+    //(LAYOUT_FULL and ELEMENT_FLOAT64 if they are 0, LAYOUT_TILED needs header.tileSize). The rest of the header is
+    //filled in here, with the source stamp taken from videoFile. Fill in the distances, then finish() moves the file
+    //into place. Each tile starts on a page boundary and is padded to a whole number of pages, so tiles share no pages
+    //and can be filled in any order by any number of threads.
+    void create(string file, string videoFile, DistanceCacheHeader header, const CacheMetadata& metadata);
+    void finish();
+
+    //Distances of a row in the mapped file, LAYOUT_FULL only
+    double* row(int index);
+
+    //The upper triangle in the mapped file, LAYOUT_PACKED_UPPER only
+    PackedDistances packed();
+
+    //Tile tileRow, tileCol (tileRow <= tileCol) in the mapped file, LAYOUT_TILED only. Tiles are tileSize x tileSize
+    //doubles in row order, the ones on the right and bottom edges are padded. NULL for tiles below the diagonal,
+    //they are the transpose of the tile across it.
+    double* tile(int tileRow, int tileCol);
+
+    //Accessor for the tiles in the mapped file, LAYOUT_TILED only
+    TiledDistanceMatrix tiled();
+
+    //Tiles in each row and column of a LAYOUT_TILED cache
+    int tilesAcross();
+
+    //Copies distances [row, row + numRows) x [col, col + numCols) into out[0..numRows)[0..numCols), in any layout.
+    //Only the parts of the file the window covers are read.
+    void readWindow(int row, int col, int numRows, int numCols, double* const* out);
+
+    //True if the distances are stored as the upper triangle
+    bool isPacked();
+
+    //True if the distances are stored as tiles
+    bool isTiled();
+
+    //True if the cache was made from the video as it is now
+    bool matchesSource(string videoFile);
+
+    //True if the file starts with the magic of a binary cache
+    static bool isDistanceCache(string file);
+
+    //True if a cache with this name is written in the binary format
+    static bool usesBinaryFormat(string file);
+
+    //True if D[i][j] == D[j][i] for the metric (a header.metric name), only those can be stored as the upper triangle
+    //or as the tiles on and above the diagonal
+    static bool isSymmetricMetric(const char* metric);
+
+    //Reads a dense text cache, one distance per line in row order, into the top left count x count of rows. The file
+    //is mapped and split at line breaks into chunks that are parsed on numThreads threads (0 = one per core).
+    //Returns the number of lines in the file, rows can be NULL to only count them.
+    static size_t readTextCache(string file, double* const* rows, int count, int numThreads = 0);
+
+    //Writes a dense text cache, and the metadata in its .meta sidecar if there is one, as a binary cache
+    static void convertTextCache(string textFile, string binaryFile, string videoFile = "");
+
+    //readTextCache: smallest chunk of the file given to a thread
+    static const size_t textChunkBytes = 65536;
+
+private:
+    unsigned char* mapping;
+    size_t mappedBytes;
+    string file;            //Set while a created file is being filled in
+    vector<double*> tilePointers;   //LAYOUT_TILED: start of every tile in the mapping, for tiled()
+
+    void close();
+
+    //Tile offsets, LAYOUT_TILED only
+    uint64_t* index();
+
+    //Bytes of distances after dataOffset
+    static uint64_t dataBytes(const DistanceCacheHeader& header);
+
+    //Not copyable
+    DistanceCache(const DistanceCache&);
+    DistanceCache& operator=(const DistanceCache&);
+};
+
+#endif
@@ -0,0 +1,152 @@
+//
+//  FrameCache.cpp
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-11-30.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "FrameCache.h"
+
+static const char frameCacheMagic[8] = {'V', 'T', 'F', 'R', 'A', 'M', 'E', 'S'};
+
+FrameCache::FrameCache()
+{
+    memset(&this->header, 0, sizeof(this->header));
+    this->mapping = NULL;
+    this->mappedBytes = 0;
+}
+
+FrameCache::~FrameCache()
+{
+    this->close();
+}
+
+void FrameCache::close()
+{
+    if (this->mapping != NULL)
+    {
+        munmap(this->mapping, this->mappedBytes);
+        this->mapping = NULL;
+        this->mappedBytes = 0;
+    }
+}
+
+bool FrameCache::open(string file)
+{
+    this->close();
+    
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(FrameCacheHeader))
+    {
+        ::close(fd);
+        return false;
+    }
+    
+    //The mapping keeps the file open
+    void* memory = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED)
+    {
+        return false;
+    }
+    this->mapping = (unsigned char*) memory;
+    this->mappedBytes = (size_t)info.st_size;
+    
+    memcpy(&this->header, this->mapping, sizeof(FrameCacheHeader));
+    if (memcmp(this->header.magic, frameCacheMagic, sizeof(frameCacheMagic)) != 0
+        || this->header.version != FrameCache::currentVersion
+        || this->header.headerSize != sizeof(FrameCacheHeader)
+        || this->header.frameCount < 0
+        || this->header.dataOffset + (uint64_t)this->header.frameCount * this->header.frameStride > this->mappedBytes)
+    {
+        this->close();
+        return false;
+    }
+    
+    //Frames are read front to back
+    madvise(this->mapping, this->mappedBytes, MADV_SEQUENTIAL);
+    return true;
+}
+
+const unsigned char* FrameCache::frame(int index)
+{
+    return this->mapping + this->header.dataOffset + (uint64_t)index * this->header.frameStride;
+}
+
+bool FrameCache::matchesSource(string videoFile)
+{
+    int64_t size, modified;
+    if (!FrameCache::getSourceStamp(videoFile, size, modified))
+    {
+        return false;
+    }
+    return size == this->header.sourceSize && modified == this->header.sourceModified;
+}
+
+bool FrameCache::getSourceStamp(string file, int64_t& size, int64_t& modified)
+{
+    struct stat info;
+    if (stat(file.c_str(), &info) != 0)
+    {
+        return false;
+    }
+    size = (int64_t)info.st_size;
+    modified = (int64_t)info.st_mtime;
+    return true;
+}
+
+void FrameCache::write(string file, string videoFile, FrameCacheHeader header, const unsigned char* const* frames)
+{
+    memcpy(header.magic, frameCacheMagic, sizeof(frameCacheMagic));
+    header.version = FrameCache::currentVersion;
+    header.headerSize = sizeof(FrameCacheHeader);
+    header.reserved = 0;
+    
+    int frameCount = header.frameCount;
+    size_t frameBytes = (size_t)header.width * header.height * header.channels;
+    header.frameStride = (frameBytes + 63) / 64 * 64;
+    header.dataOffset = FrameCache::dataAlignment;
+    FrameCache::getSourceStamp(videoFile, header.sourceSize, header.sourceModified);
+    
+    //Written under another name and renamed at the end, so a half written cache is never opened
+    string partial = file + ".partial";
+    FILE* out = fopen(partial.c_str(), "wb");
+    if (out == NULL)
+    {
+        throw string("Couldn't write frame cache");
+    }
+    
+    char padding[FrameCache::dataAlignment];
+    memset(padding, 0, sizeof(padding));
+    
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    ok = ok && fwrite(padding, header.dataOffset - sizeof(header), 1, out) == 1;
+    for (int i=0; ok && i<frameCount; i++)
+    {
+        ok = fwrite(frames[i], frameBytes, 1, out) == 1;
+        if (ok && header.frameStride > frameBytes)
+        {
+            ok = fwrite(padding, header.frameStride - frameBytes, 1, out) == 1;
+        }
+    }
+    ok = (fclose(out) == 0) && ok;
+    
+    if (!ok || rename(partial.c_str(), file.c_str()) != 0)
+    {
+        remove(partial.c_str());
+        throw string("Couldn't write frame cache");
+    }
+}
@@ -0,0 +1,84 @@
+//
+//  FrameCache.h
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-11-30.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include <iostream>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef FRAMECACHE_H
+#define FRAMECACHE_H
+
+using namespace std;
+
+/**
+ * Fixed size header at the start of a frame cache
+ */
+struct FrameCacheHeader
+{
+    char magic[8];          //"VTFRAMES"
+    uint32_t version;
+    uint32_t headerSize;    //sizeof(FrameCacheHeader) when it was written
+    int32_t frameCount;
+    int32_t width;
+    int32_t height;
+    int32_t channels;
+    uint64_t frameStride;   //Bytes from the start of one frame to the next, a multiple of 64
+    uint64_t dataOffset;    //Start of the first frame, page aligned
+    int64_t sourceSize;     //Size and modification time of the video the frames were decoded from
+    int64_t sourceModified;
+    int32_t startFrame;     //Range of the video the frames were taken from, endFrame < 0 = to the end
+    int32_t endFrame;
+    int32_t temporalStride; //Every nth frame of the range was kept
+    int32_t reserved;
+};
+
+/**
+ * Raw analysis frames saved to disk so later runs don't have to decode the video again
+ * The file is a FrameCacheHeader followed by the frames, one after the other, each starting on a 64 byte boundary.
+ * It is opened with mmap, so frames are only read from disk when they are first touched and are never copied.
+ */
+class FrameCache
+{
+public:
+    static const uint32_t currentVersion = 2;
+    static const uint64_t dataAlignment = 4096;
+    
+    FrameCacheHeader header;
+    
+    FrameCache();
+    ~FrameCache();
+    
+    //Returns false if the file is missing or isn't a frame cache of this version
+    bool open(string file);
+    
+    //Pixels of a frame in the mapped file, read only
+    const unsigned char* frame(int index);
+    
+    //True if the cache was made from the video as it is now
+    bool matchesSource(string videoFile);
+    
+    //Writes header.frameCount frames of header.width x header.height x header.channels bytes each, with the frame range
+    //in the header. The rest of the header is filled in here, with the source stamp taken from videoFile.
+    static void write(string file, string videoFile, FrameCacheHeader header, const unsigned char* const* frames);
+    
+    //Size and modification time of a file, false if it doesn't exist
+    static bool getSourceStamp(string file, int64_t& size, int64_t& modified);
+    
+private:
+    unsigned char* mapping;
+    size_t mappedBytes;
+    
+    void close();
+    
+    //Not copyable
+    FrameCache(const FrameCache&);
+    FrameCache& operator=(const FrameCache&);
+};
+
+#endif
@@ -0,0 +1,285 @@
+//
+//  FrameDistance.h
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-11-20.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#ifndef FRAMEDISTANCE_H
+#define FRAMEDISTANCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Integer kernels for comparing 8 bit greyscale frames.
+ *
+ * All of the kernels accumulate the exact integer sum of squared differences, so the SIMD paths
+ * and the scalar fallback always agree bit for bit. The scaling to the 0-1 pixel range is done
+ * once at the end by distanceFromSumSquaredDifference().
+ */
+class FrameDistance
+{
+public:
+
+    //Plain C fallback, also the reference for the SIMD paths
+    static uint64_t sumSquaredDifferenceScalar(const unsigned char* a, const unsigned char* b, size_t length)
+    {
+        uint64_t sum = 0;
+        for (size_t i=0; i<length; i++)
+        {
+            int diff = (int)a[i] - (int)b[i];
+            sum += (uint64_t)(diff * diff);
+        }
+        return sum;
+    }
+
+#if defined(__SSE2__)
+    //16 pixels per iteration
+    static uint64_t sumSquaredDifferenceSSE2(const unsigned char* a, const unsigned char* b, size_t length)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i total = _mm_setzero_si128();    //2 x 64 bit
+
+        size_t i = 0;
+        while (i + 16 <= length)
+        {
+            //Each 32 bit lane grows by at most 4 * 255^2 per iteration, so flush to 64 bits every 4096 iterations
+            size_t blockEnd = i + 16 * 4096;
+            if (blockEnd > length) blockEnd = length;
+
+            __m128i acc = _mm_setzero_si128();  //4 x 32 bit
+            for (; i + 16 <= blockEnd; i += 16)
+            {
+                __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+                __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+
+                //|a - b| without leaving 8 bits
+                __m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+
+                __m128i lo = _mm_unpacklo_epi8(diff, zero);
+                __m128i hi = _mm_unpackhi_epi8(diff, zero);
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+            }
+
+            total = _mm_add_epi64(total, _mm_unpacklo_epi32(acc, zero));
+            total = _mm_add_epi64(total, _mm_unpackhi_epi32(acc, zero));
+        }
+
+        uint64_t lanes[2];
+        _mm_storeu_si128((__m128i*)lanes, total);
+
+        //Remaining pixels
+        return lanes[0] + lanes[1] + sumSquaredDifferenceScalar(a + i, b + i, length - i);
+    }
+#endif
+
+#if defined(__AVX2__)
+    //32 pixels per iteration
+    static uint64_t sumSquaredDifferenceAVX2(const unsigned char* a, const unsigned char* b, size_t length)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        __m256i total = _mm256_setzero_si256();    //4 x 64 bit
+
+        size_t i = 0;
+        while (i + 32 <= length)
+        {
+            size_t blockEnd = i + 32 * 4096;
+            if (blockEnd > length) blockEnd = length;
+
+            __m256i acc = _mm256_setzero_si256();  //8 x 32 bit
+            for (; i + 32 <= blockEnd; i += 32)
+            {
+                __m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+                __m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+
+                __m256i diff = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+
+                __m256i lo = _mm256_unpacklo_epi8(diff, zero);
+                __m256i hi = _mm256_unpackhi_epi8(diff, zero);
+                acc = _mm256_add_epi32(acc, _mm256_madd_epi16(lo, lo));
+                acc = _mm256_add_epi32(acc, _mm256_madd_epi16(hi, hi));
+            }
+
+            total = _mm256_add_epi64(total, _mm256_unpacklo_epi32(acc, zero));
+            total = _mm256_add_epi64(total, _mm256_unpackhi_epi32(acc, zero));
+        }
+
+        uint64_t lanes[4];
+        _mm256_storeu_si256((__m256i*)lanes, total);
+
+        return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sumSquaredDifferenceScalar(a + i, b + i, length - i);
+    }
+#endif
+
+    //Best available kernel for this build
+    static uint64_t sumSquaredDifference(const unsigned char* a, const unsigned char* b, size_t length)
+    {
+#if defined(__AVX2__)
+        return sumSquaredDifferenceAVX2(a, b, length);
+#elif defined(__SSE2__)
+        return sumSquaredDifferenceSSE2(a, b, length);
+#else
+        return sumSquaredDifferenceScalar(a, b, length);
+#endif
+    }
+
+    //L2 distance with pixels scaled to 0-1, ie. sqrt(sum((a/255 - b/255)^2))
+    static double distanceFromSumSquaredDifference(uint64_t ssd)
+    {
+        return sqrt((double)ssd) / 255.0;
+    }
+
+    //Sum squared difference from the Gram matrix identity |a-b|^2 = |a|^2 + |b|^2 - 2a.b (exact in integers)
+    static uint64_t sumSquaredDifferenceFromDot(uint64_t normA, uint64_t normB, uint64_t dot)
+    {
+        return normA + normB - 2 * dot;
+    }
+
+
+    //DOT PRODUCTS
+
+    static uint64_t dotProductScalar(const unsigned char* a, const unsigned char* b, size_t length)
+    {
+        uint64_t sum = 0;
+        for (size_t i=0; i<length; i++)
+        {
+            sum += (uint64_t)(a[i] * b[i]);
+        }
+        return sum;
+    }
+
+    //Dot products of two frames against two other frames in one pass, so every load is used twice
+    //out = {a0.b0, a0.b1, a1.b0, a1.b1}
+    static void dotProducts2x2Scalar(const unsigned char* a0, const unsigned char* a1, const unsigned char* b0, const unsigned char* b1, size_t length, uint64_t out[4])
+    {
+        uint64_t s00 = 0, s01 = 0, s10 = 0, s11 = 0;
+        for (size_t i=0; i<length; i++)
+        {
+            unsigned int x0 = a0[i], x1 = a1[i], y0 = b0[i], y1 = b1[i];
+            s00 += x0 * y0;
+            s01 += x0 * y1;
+            s10 += x1 * y0;
+            s11 += x1 * y1;
+        }
+        out[0] = s00;
+        out[1] = s01;
+        out[2] = s10;
+        out[3] = s11;
+    }
+
+#if defined(__SSE2__)
+    static uint64_t dotProductSSE2(const unsigned char* a, const unsigned char* b, size_t length)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i total = _mm_setzero_si128();
+
+        size_t i = 0;
+        while (i + 16 <= length)
+        {
+            size_t blockEnd = i + 16 * 4096;
+            if (blockEnd > length) blockEnd = length;
+
+            __m128i acc = _mm_setzero_si128();
+            for (; i + 16 <= blockEnd; i += 16)
+            {
+                __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+                __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero)));
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero)));
+            }
+            total = widenAdd(total, acc);
+        }
+
+        return horizontalSum(total) + dotProductScalar(a + i, b + i, length - i);
+    }
+
+    static void dotProducts2x2SSE2(const unsigned char* a0, const unsigned char* a1, const unsigned char* b0, const unsigned char* b1, size_t length, uint64_t out[4])
+    {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i t00 = zero, t01 = zero, t10 = zero, t11 = zero;
+
+        size_t i = 0;
+        while (i + 16 <= length)
+        {
+            size_t blockEnd = i + 16 * 4096;
+            if (blockEnd > length) blockEnd = length;
+
+            __m128i c00 = zero, c01 = zero, c10 = zero, c11 = zero;
+            for (; i + 16 <= blockEnd; i += 16)
+            {
+                __m128i x0 = _mm_loadu_si128((const __m128i*)(a0 + i));
+                __m128i x1 = _mm_loadu_si128((const __m128i*)(a1 + i));
+                __m128i y0 = _mm_loadu_si128((const __m128i*)(b0 + i));
+                __m128i y1 = _mm_loadu_si128((const __m128i*)(b1 + i));
+
+                __m128i x0l = _mm_unpacklo_epi8(x0, zero), x0h = _mm_unpackhi_epi8(x0, zero);
+                __m128i x1l = _mm_unpacklo_epi8(x1, zero), x1h = _mm_unpackhi_epi8(x1, zero);
+                __m128i y0l = _mm_unpacklo_epi8(y0, zero), y0h = _mm_unpackhi_epi8(y0, zero);
+                __m128i y1l = _mm_unpacklo_epi8(y1, zero), y1h = _mm_unpackhi_epi8(y1, zero);
+
+                c00 = _mm_add_epi32(c00, _mm_add_epi32(_mm_madd_epi16(x0l, y0l), _mm_madd_epi16(x0h, y0h)));
+                c01 = _mm_add_epi32(c01, _mm_add_epi32(_mm_madd_epi16(x0l, y1l), _mm_madd_epi16(x0h, y1h)));
+                c10 = _mm_add_epi32(c10, _mm_add_epi32(_mm_madd_epi16(x1l, y0l), _mm_madd_epi16(x1h, y0h)));
+                c11 = _mm_add_epi32(c11, _mm_add_epi32(_mm_madd_epi16(x1l, y1l), _mm_madd_epi16(x1h, y1h)));
+            }
+            t00 = widenAdd(t00, c00);
+            t01 = widenAdd(t01, c01);
+            t10 = widenAdd(t10, c10);
+            t11 = widenAdd(t11, c11);
+        }
+
+        dotProducts2x2Scalar(a0 + i, a1 + i, b0 + i, b1 + i, length - i, out);
+        out[0] += horizontalSum(t00);
+        out[1] += horizontalSum(t01);
+        out[2] += horizontalSum(t10);
+        out[3] += horizontalSum(t11);
+    }
+
+    //Add 4 x 32 bit lanes into 2 x 64 bit lanes
+    static __m128i widenAdd(__m128i total, __m128i acc)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        total = _mm_add_epi64(total, _mm_unpacklo_epi32(acc, zero));
+        return _mm_add_epi64(total, _mm_unpackhi_epi32(acc, zero));
+    }
+
+    static uint64_t horizontalSum(__m128i total)
+    {
+        uint64_t lanes[2];
+        _mm_storeu_si128((__m128i*)lanes, total);
+        return lanes[0] + lanes[1];
+    }
+#endif
+
+    static uint64_t dotProduct(const unsigned char* a, const unsigned char* b, size_t length)
+    {
+#if defined(__SSE2__)
+        return dotProductSSE2(a, b, length);
+#else
+        return dotProductScalar(a, b, length);
+#endif
+    }
+
+    static void dotProducts2x2(const unsigned char* a0, const unsigned char* a1, const unsigned char* b0, const unsigned char* b1, size_t length, uint64_t out[4])
+    {
+#if defined(__SSE2__)
+        dotProducts2x2SSE2(a0, a1, b0, b1, length, out);
+#else
+        dotProducts2x2Scalar(a0, a1, b0, b1, length, out);
+#endif
+    }
+};
+
+#endif
@@ -0,0 +1,138 @@
+//
+//  FrameRangeReader.cpp
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-12-04.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include <string.h>
+#include "FrameRangeReader.h"
+
+map<string, bool> FrameRangeReader::checkedFiles;
+pthread_mutex_t FrameRangeReader::checkedLock = PTHREAD_MUTEX_INITIALIZER;
+
+FrameRangeReader::FrameRangeReader(string file, int startFrame, int endFrame, int stride, int first, bool verifySeek)
+{
+    this->endFrame = endFrame;
+    this->stride = max(1, stride);
+    this->position = 0;
+    this->next = max(0, startFrame) + first * this->stride;
+    
+    this->capture.open(file);
+    this->opened = this->capture.isOpened();
+    
+    if (this->opened && this->next > 0 && ((verifySeek && !FrameRangeReader::seekIsAccurate(file, this->next)) || !this->seek(this->next)))
+    {
+        //The backend couldn't seek there, or can't be trusted to, so walk up to it from the start
+        this->capture.release();
+        this->capture.open(file);
+        this->position = 0;
+        this->opened = this->capture.isOpened();
+    }
+}
+
+FrameRangeReader::~FrameRangeReader()
+{
+    this->capture.release();
+}
+
+bool FrameRangeReader::isOpened()
+{
+    return this->opened;
+}
+
+/**
+ * Seeks, and only trusts it if the capture reports being where it was asked to go
+ */
+bool FrameRangeReader::seek(int frame)
+{
+    if (!this->capture.set(CV_CAP_PROP_POS_FRAMES, frame) || (int)this->capture.get(CV_CAP_PROP_POS_FRAMES) != frame)
+    {
+        return false;
+    }
+    this->position = frame;
+    return true;
+}
+
+bool FrameRangeReader::read(cv::Mat& frame)
+{
+    if (!this->opened || (this->endFrame >= 0 && this->next >= this->endFrame))
+    {
+        return false;
+    }
+    
+    //Frames between the ones in the range are grabbed and thrown away
+    while (this->position < this->next)
+    {
+        if (!this->capture.grab())
+        {
+            return false;
+        }
+        this->position++;
+    }
+    
+    if (!this->capture.read(frame))
+    {
+        return false;
+    }
+    this->position++;
+    this->next += this->stride;
+    return true;
+}
+
+bool FrameRangeReader::skip(int count)
+{
+    this->next += count * this->stride;
+    return this->endFrame < 0 || this->next <= this->endFrame;
+}
+
+int FrameRangeReader::rangeLength(int frameCount, int startFrame, int endFrame, int stride)
+{
+    int end = (endFrame >= 0) ? min(endFrame, frameCount) : frameCount;
+    int start = max(0, startFrame);
+    if (end <= start)
+    {
+        return 0;
+    }
+    return (end - start + max(1, stride) - 1) / max(1, stride);
+}
+
+/**
+ * Seeks on one capture and grabs up to the same frame on another, the two frames have to be identical
+ */
+bool FrameRangeReader::seekIsAccurate(string file, int frame)
+{
+    pthread_mutex_lock(&FrameRangeReader::checkedLock);
+    map<string, bool>::iterator checked = FrameRangeReader::checkedFiles.find(file);
+    bool known = (checked != FrameRangeReader::checkedFiles.end());
+    bool accurate = known && checked->second;
+    pthread_mutex_unlock(&FrameRangeReader::checkedLock);
+    if (known)
+    {
+        return accurate;
+    }
+    
+    cv::VideoCapture seeking(file);
+    cv::VideoCapture walking(file);
+    cv::Mat seeked;
+    cv::Mat walked;
+    accurate = seeking.isOpened() && walking.isOpened() && seeking.set(CV_CAP_PROP_POS_FRAMES, frame)
+        && (int)seeking.get(CV_CAP_PROP_POS_FRAMES) == frame && seeking.read(seeked);
+    for (int i=0; accurate && i<frame; i++)
+    {
+        accurate = walking.grab();
+    }
+    accurate = accurate && walking.read(walked) && seeked.size() == walked.size() && seeked.type() == walked.type();
+    for (int y=0; accurate && y<seeked.rows; y++)
+    {
+        accurate = memcmp(seeked.ptr<uchar>(y), walked.ptr<uchar>(y), seeked.cols * seeked.elemSize()) == 0;
+    }
+    
+    cout << "Seeking in " << file << (accurate ? " is" : " isn't") << " frame accurate" << endl;
+    
+    pthread_mutex_lock(&FrameRangeReader::checkedLock);
+    FrameRangeReader::checkedFiles[file] = accurate;
+    pthread_mutex_unlock(&FrameRangeReader::checkedLock);
+    return accurate;
+}
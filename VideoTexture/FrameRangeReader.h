@@ -0,0 +1,68 @@
+//
+//  FrameRangeReader.h
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-12-04.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <map>
+#include <pthread.h>
+
+#include "core.hpp"
+#include "highgui.hpp"
+
+#ifndef FRAMERANGEREADER_H
+#define FRAMERANGEREADER_H
+
+using namespace std;
+
+/**
+ * Reads every stride'th frame of a video from startFrame up to (not including) endFrame
+ * Frames that aren't used are only grabbed, never retrieved, so they are not converted to BGR.
+ * Backends often seek to the nearest keyframe and still report the frame they were asked for, so seeking is only used
+ * once it has been checked for the file, unless the caller checks the frames itself.
+ */
+class FrameRangeReader
+{
+public:
+    //endFrame < 0 = until the video ends. Starts at the first'th frame of the range.
+    //verifySeek = false trusts the position the backend reports after seeking
+    FrameRangeReader(string file, int startFrame, int endFrame, int stride, int first = 0, bool verifySeek = true);
+    ~FrameRangeReader();
+    
+    bool isOpened();
+    
+    //Next frame of the range, false at the end of the range or the video
+    bool read(cv::Mat& frame);
+    
+    //Skips frames of the range without decoding them to BGR
+    bool skip(int count);
+    
+    //Number of frames in the range of a video with frameCount frames
+    static int rangeLength(int frameCount, int startFrame, int endFrame, int stride);
+    
+    //True if seeking to frame gives the same frame as grabbing every frame up to it. Only the first call for a file
+    //decodes anything, the answer is kept for the life of the program.
+    static bool seekIsAccurate(string file, int frame);
+    
+private:
+    cv::VideoCapture capture;
+    int position;   //Frame of the video the capture will return next
+    int next;       //Frame of the video to return next
+    int endFrame;
+    int stride;
+    bool opened;
+    
+    //Moves the capture to a frame of the video
+    bool seek(int frame);
+    
+    //seekIsAccurate results by file, protected by checkedLock
+    static map<string, bool> checkedFiles;
+    static pthread_mutex_t checkedLock;
+};
+
+#endif
@@ -0,0 +1,116 @@
+//
+//  FrameStore.cpp
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-11-29.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include "FrameStore.h"
+
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#if !defined(MAP_NORESERVE)
+#define MAP_NORESERVE 0
+#endif
+
+//Memory is committed this much at a time
+static const size_t commitStep = 64 * 1024 * 1024;
+
+FrameStore::FrameStore(size_t frameBytes, size_t maxFrames)
+{
+    this->frameBytes = frameBytes;
+    this->frameStride = (frameBytes + FrameStore::alignment - 1) / FrameStore::alignment * FrameStore::alignment;
+    this->count = 0;
+    this->committedBytes = 0;
+    
+    //1 TB of address space on 64 bit, 1 GB on 32 bit
+    if (maxFrames == 0)
+    {
+        size_t addressSpace = (sizeof(void*) == 8) ? ((size_t)1 << 40) : ((size_t)1 << 30);
+        maxFrames = addressSpace / this->frameStride;
+    }
+    
+    this->maxFrames = maxFrames;
+    
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    this->reservedBytes = (maxFrames * this->frameStride + page - 1) / page * page;
+    
+    //Reserved but not usable until it is committed
+    void* memory = mmap(NULL, this->reservedBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        throw string("Couldn't reserve memory for frames");
+    }
+    this->base = (unsigned char*) memory;
+}
+
+FrameStore::~FrameStore()
+{
+    munmap(this->base, this->reservedBytes);
+}
+
+unsigned char* FrameStore::append()
+{
+    if ((size_t)this->count >= this->maxFrames)
+    {
+        throw string("Frame store is full");
+    }
+    this->commit((size_t)(this->count + 1) * this->frameStride);
+    
+    unsigned char* frame = this->base + (size_t)this->count * this->frameStride;
+    this->count++;
+    return frame;
+}
+
+void FrameStore::resize(int count)
+{
+    if (count < 0 || (size_t)count > this->maxFrames)
+    {
+        throw string("Frame store is full");
+    }
+    this->commit((size_t)count * this->frameStride);
+    this->count = count;
+}
+
+void FrameStore::commit(size_t bytes)
+{
+    if (bytes <= this->committedBytes)
+    {
+        return;
+    }
+    
+    //Commit the next step of the reservation, mprotect needs the start of the next commit to be page aligned
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t end = (max(bytes, this->committedBytes + commitStep) + page - 1) / page * page;
+    end = min(this->reservedBytes, end);
+    if (mprotect(this->base + this->committedBytes, end - this->committedBytes, PROT_READ | PROT_WRITE) != 0)
+    {
+        throw string("Couldn't allocate memory for frames");
+    }
+    this->committedBytes = end;
+}
+
+unsigned char* FrameStore::frame(int index)
+{
+    return this->base + (size_t)index * this->frameStride;
+}
+
+int FrameStore::size()
+{
+    return this->count;
+}
+
+size_t FrameStore::getFrameBytes()
+{
+    return this->frameBytes;
+}
+
+size_t FrameStore::getFrameStride()
+{
+    return this->frameStride;
+}
@@ -0,0 +1,65 @@
+//
+//  FrameStore.h
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-11-29.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include <iostream>
+#include <string>
+#include <stddef.h>
+
+#ifndef FRAMESTORE_H
+#define FRAMESTORE_H
+
+using namespace std;
+
+/**
+ * One plane of frames (eg. all of the colour frames) in a single allocation
+ * Address space for the whole store is reserved up front and memory is committed as frames are appended, so the
+ * store can grow without knowing the number of frames and without ever moving a frame.
+ * Every frame starts on a 64 byte boundary and its rows follow each other without padding, so a frame can be used
+ * as one flat array by the SIMD kernels and wrapped in a cv::Mat view.
+ */
+class FrameStore
+{
+public:
+    static const size_t alignment = 64;
+    
+    //frameBytes = rows * bytes per row of one frame, maxFrames = 0 reserves as much address space as is sensible
+    FrameStore(size_t frameBytes, size_t maxFrames = 0);
+    ~FrameStore();
+    
+    //Adds an uninitialized frame at the end and returns it
+    unsigned char* append();
+    
+    //Grows or shrinks the store to count frames. New frames are uninitialized, memory is kept when it shrinks.
+    //Frames below count can be written from other threads while it runs.
+    void resize(int count);
+    
+    unsigned char* frame(int index);
+    
+    int size();
+    size_t getFrameBytes();
+    size_t getFrameStride();    //Distance between the start of two frames
+    
+private:
+    unsigned char* base;
+    
+    //Makes the first bytes of the reservation usable
+    void commit(size_t bytes);
+
+    size_t reservedBytes;
+    size_t committedBytes;
+    size_t frameBytes;
+    size_t frameStride;
+    size_t maxFrames;
+    int count;
+    
+    //Not copyable
+    FrameStore(const FrameStore&);
+    FrameStore& operator=(const FrameStore&);
+};
+
+#endif
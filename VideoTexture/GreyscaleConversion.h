@@ -0,0 +1,107 @@
+//
+//  GreyscaleConversion.h
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-12-03.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#ifndef GREYSCALECONVERSION_H
+#define GREYSCALECONVERSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+/**
+ * 8 bit 3 channel frames to 8 bit luma, exactly the same as cv::cvtColor(frame, grey, CV_RGB2GRAY).
+ *
+ * The video texture has always converted the decoded BGR frames with CV_RGB2GRAY, so the first channel gets the red
+ * weight. OpenCV does that in 14 bit fixed point, y = (4899 c0 + 9617 c1 + 1868 c2 + 8192) >> 14, and so do these,
+ * which keeps existing caches valid.
+ */
+class GreyscaleConversion
+{
+public:
+    static const int weight0 = 4899;
+    static const int weight1 = 9617;
+    static const int weight2 = 1868;
+    static const int shift = 14;
+    
+    //Plain C fallback, also the reference for the SIMD path
+    static void fromBGRScalar(const unsigned char* bgr, unsigned char* grey, size_t pixels)
+    {
+        for (size_t i=0; i<pixels; i++)
+        {
+            const unsigned char* p = bgr + 3 * i;
+            grey[i] = (unsigned char)((weight0 * p[0] + weight1 * p[1] + weight2 * p[2] + (1 << (shift - 1))) >> shift);
+        }
+    }
+    
+#if defined(__SSSE3__)
+    //16 pixels per iteration
+    static void fromBGRSSSE3(const unsigned char* bgr, unsigned char* grey, size_t pixels)
+    {
+        //Gather each channel of 16 pixels out of the 48 bytes they are spread over, -1 leaves a 0
+        const __m128i c0a = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+        const __m128i c0b = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+        const __m128i c0c = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+        const __m128i c1a = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+        const __m128i c1b = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+        const __m128i c1c = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+        const __m128i c2a = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+        const __m128i c2b = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+        const __m128i c2c = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+        
+        //(c0, c1) . (weight0, weight1) + (c2, 1) . (weight2, rounding) with madd, all exact in 32 bits
+        const __m128i weights01 = _mm_setr_epi16(weight0, weight1, weight0, weight1, weight0, weight1, weight0, weight1);
+        const __m128i weights2r = _mm_setr_epi16(weight2, 1 << (shift - 1), weight2, 1 << (shift - 1), weight2, 1 << (shift - 1), weight2, 1 << (shift - 1));
+        const __m128i ones = _mm_set1_epi16(1);
+        const __m128i zero = _mm_setzero_si128();
+        
+        size_t i = 0;
+        for (; i + 16 <= pixels; i += 16)
+        {
+            const unsigned char* p = bgr + 3 * i;
+            __m128i a = _mm_loadu_si128((const __m128i*)p);
+            __m128i b = _mm_loadu_si128((const __m128i*)(p + 16));
+            __m128i c = _mm_loadu_si128((const __m128i*)(p + 32));
+            
+            __m128i ch0 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, c0a), _mm_shuffle_epi8(b, c0b)), _mm_shuffle_epi8(c, c0c));
+            __m128i ch1 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, c1a), _mm_shuffle_epi8(b, c1b)), _mm_shuffle_epi8(c, c1c));
+            __m128i ch2 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, c2a), _mm_shuffle_epi8(b, c2b)), _mm_shuffle_epi8(c, c2c));
+            
+            //8 pixels at a time in 16 bits
+            __m128i lo = luma8(_mm_unpacklo_epi8(ch0, zero), _mm_unpacklo_epi8(ch1, zero), _mm_unpacklo_epi8(ch2, zero), weights01, weights2r, ones);
+            __m128i hi = luma8(_mm_unpackhi_epi8(ch0, zero), _mm_unpackhi_epi8(ch1, zero), _mm_unpackhi_epi8(ch2, zero), weights01, weights2r, ones);
+            _mm_storeu_si128((__m128i*)(grey + i), _mm_packus_epi16(lo, hi));
+        }
+        
+        //Remaining pixels
+        fromBGRScalar(bgr + 3 * i, grey + i, pixels - i);
+    }
+    
+    //Luma of 8 pixels given as 16 bit channels
+    static __m128i luma8(__m128i ch0, __m128i ch1, __m128i ch2, __m128i weights01, __m128i weights2r, __m128i ones)
+    {
+        __m128i sumLo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(ch0, ch1), weights01), _mm_madd_epi16(_mm_unpacklo_epi16(ch2, ones), weights2r));
+        __m128i sumHi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(ch0, ch1), weights01), _mm_madd_epi16(_mm_unpackhi_epi16(ch2, ones), weights2r));
+        return _mm_packs_epi32(_mm_srli_epi32(sumLo, shift), _mm_srli_epi32(sumHi, shift));
+    }
+#endif
+    
+    //Best available conversion for this build
+    static void fromBGR(const unsigned char* bgr, unsigned char* grey, size_t pixels)
+    {
+#if defined(__SSSE3__)
+        fromBGRSSSE3(bgr, grey, pixels);
+#else
+        fromBGRScalar(bgr, grey, pixels);
+#endif
+    }
+};
+
+#endif
@@ -0,0 +1,101 @@
+//
+//  HistogramDistance.h
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-11-27.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#ifndef HISTOGRAMDISTANCE_H
+#define HISTOGRAMDISTANCE_H
+
+#include <stddef.h>
+#include <float.h>
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * Chi-square kernels for comparing colour histograms, the same measure as cv::compareHist with CV_COMP_CHISQR:
+ * sum((ref - input)^2 / ref) over the bins where ref isn't empty.
+ *
+ * When one reference is compared against many inputs the division is done once per reference bin by
+ * inverseBins(), and the batched kernels only multiply. They agree with chiSquareScalar() to float precision.
+ */
+class HistogramDistance
+{
+public:
+
+    //Reference version, one division per bin like cv::compareHist
+    static double chiSquareScalar(const float* ref, const float* input, size_t length)
+    {
+        double sum = 0.0f;
+        for (size_t i=0; i<length; i++)
+        {
+            double diff = ref[i] - input[i];
+            if (fabs((double)ref[i]) > DBL_EPSILON)
+            {
+                sum += diff * diff / ref[i];
+            }
+        }
+        return sum;
+    }
+
+    //1/ref for the bins that aren't empty, 0 for the ones that are
+    static void inverseBins(const float* ref, float* inverse, size_t length)
+    {
+        for (size_t i=0; i<length; i++)
+        {
+            inverse[i] = (fabs((double)ref[i]) > DBL_EPSILON) ? 1.0f / ref[i] : 0.0f;
+        }
+    }
+
+    static double chiSquareInverseScalar(const float* ref, const float* inverse, const float* input, size_t length)
+    {
+        double sum = 0.0f;
+        for (size_t i=0; i<length; i++)
+        {
+            float diff = ref[i] - input[i];
+            sum += diff * diff * inverse[i];
+        }
+        return sum;
+    }
+
+#if defined(__SSE2__)
+    //4 bins per iteration, the terms are summed in double
+    static double chiSquareInverseSSE2(const float* ref, const float* inverse, const float* input, size_t length)
+    {
+        __m128d total = _mm_setzero_pd();
+
+        size_t i = 0;
+        for (; i + 4 <= length; i += 4)
+        {
+            __m128 diff = _mm_sub_ps(_mm_loadu_ps(ref + i), _mm_loadu_ps(input + i));
+            __m128 term = _mm_mul_ps(_mm_mul_ps(diff, diff), _mm_loadu_ps(inverse + i));
+
+            total = _mm_add_pd(total, _mm_cvtps_pd(term));
+            total = _mm_add_pd(total, _mm_cvtps_pd(_mm_movehl_ps(term, term)));
+        }
+
+        double lanes[2];
+        _mm_storeu_pd(lanes, total);
+
+        //Remaining bins
+        return lanes[0] + lanes[1] + chiSquareInverseScalar(ref + i, inverse + i, input + i, length - i);
+    }
+#endif
+
+    //Best available kernel for this build
+    static double chiSquareInverse(const float* ref, const float* inverse, const float* input, size_t length)
+    {
+#if defined(__SSE2__)
+        return chiSquareInverseSSE2(ref, inverse, input, length);
+#else
+        return chiSquareInverseScalar(ref, inverse, input, length);
+#endif
+    }
+};
+
+#endif
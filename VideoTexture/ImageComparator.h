@@ -21,6 +21,7 @@
 #include "core.hpp"
 #include "imgproc.hpp"
 #include "colorhistogram.h"
+#include "HistogramDistance.h"
 
 class ImageComparator {
     
@@ -33,12 +34,15 @@ private:
     
 	ColorHistogram hist;
 	int div;
+	cv::Mat lut;	// colour reduction table for div
     int totalPixels;
     
 public:
     
 	ImageComparator() : div(32) {
         
+		hist.setSize(256/div);
+		lut= hist.colorReduceTable(div);
 	}
     
 	// Color reduction factor
@@ -47,6 +51,8 @@ public:
 	void setColorReduction( int factor) {
         
 		div= factor;
+		hist.setSize(256/div);
+		lut= hist.colorReduceTable(div);
 	}
     
 	int getColorReduction() {
@@ -56,7 +62,7 @@ public:
     
 	void setReferenceImage(const cv::Mat& image) {
         
-		reference= hist.colorReduce(image,div);
+		cv::LUT(image,lut,reference);
 		refH= hist.getHistogram(reference);
         
         totalPixels = image.cols * image.rows;
@@ -65,13 +71,56 @@ public:
     
 	double compare(const cv::Mat& image) {
         
-		input= hist.colorReduce(image,div);
+		// Reuses the input image from the last call
+		cv::LUT(image,lut,input);
 		inputH= hist.getHistogram(input);
         
         //Get the number of similar pixels
         return cv::compareHist(refH,inputH,CV_COMP_CHISQR);
         
 	}
+    
+	// Number of bins of a compact histogram,
+	// one for each colour left after the colour reduction
+	int getHistogramSize() {
+        
+        int levels= 256/div;
+		return levels*levels*levels;
+	}
+    
+	// Computes the histogram of an image into bins (getHistogramSize() floats).
+	// It has the same counts as the histogram used by compare(),
+	// so the chi-square distances are the same, without the reduced image.
+	void computeHistogram(const cv::Mat& image, float* bins) {
+        
+        int n= static_cast<int>(log(static_cast<double>(div))/log(2.0));
+        int levels= 256/div;
+        
+        for (int i=0; i<getHistogramSize(); i++)
+            bins[i]= 0.0f;
+        
+        for (int row=0; row<image.rows; row++) {
+            
+            const uchar* pixel= image.ptr<uchar>(row);
+            const uchar* end= pixel + image.cols*3;
+            
+            for ( ; pixel!=end; pixel+=3)
+                bins[((pixel[0]>>n)*levels + (pixel[1]>>n))*levels + (pixel[2]>>n)]+= 1.0f;
+        }
+	}
+    
+	// Compares a reference histogram against count input histograms stored one after the other,
+	// distances[i]= chi-square(reference, inputs[i])
+	// The reference's bins are inverted once, so each comparison is a multiply-add per bin.
+	void compareAll(const float* reference, const float* inputs, int count, double* distances) {
+        
+        int size= getHistogramSize();
+        std::vector<float> inverse(size);
+        HistogramDistance::inverseBins(reference, &inverse[0], size);
+        
+        for (int i=0; i<count; i++)
+            distances[i]= HistogramDistance::chiSquareInverse(reference, &inverse[0], inputs + (size_t)i*size, size);
+	}
 };
 
 
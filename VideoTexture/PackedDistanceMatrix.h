@@ -0,0 +1,313 @@
+//
+//  PackedDistanceMatrix.h
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-12-06.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#ifndef PACKEDDISTANCEMATRIX_H
+#define PACKEDDISTANCEMATRIX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Type of the stored distances
+ */
+enum DistanceElement
+{
+    ELEMENT_FLOAT64 = 1,
+    ELEMENT_FLOAT32 = 2,
+    ELEMENT_FLOAT16 = 3,    //IEEE half precision, about 3 significant digits
+    ELEMENT_UINT16 = 4      //Fraction of the largest distance in 1/65535 steps
+};
+
+inline size_t distanceElementSize(DistanceElement element)
+{
+    switch (element)
+    {
+        case ELEMENT_FLOAT64:
+            return 8;
+        case ELEMENT_FLOAT32:
+            return 4;
+        case ELEMENT_FLOAT16:
+        case ELEMENT_UINT16:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+
+//ELEMENTS
+//encode() takes the distance divided by the scale of the matrix, decode() gives it back
+
+struct Float64Element
+{
+    typedef double Stored;
+    static Stored encode(double value) { return value; }
+    static double decode(Stored stored) { return stored; }
+};
+
+struct Float32Element
+{
+    typedef float Stored;
+    static Stored encode(double value) { return (float)value; }
+    static double decode(Stored stored) { return stored; }
+};
+
+struct Float16Element
+{
+    typedef uint16_t Stored;
+
+    static Stored encode(double value)
+    {
+        union { float f; uint32_t u; } bits;
+        bits.f = (float)value;
+
+        uint32_t sign = (bits.u >> 16) & 0x8000;
+        int exponent = (int)((bits.u >> 23) & 0xff);
+        uint32_t mantissa = bits.u & 0x7fffff;
+
+        if (exponent == 0xff)
+        {
+            return (Stored)(sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0));  //Infinity, NaN
+        }
+        exponent += 15 - 127;
+        if (exponent >= 31)
+        {
+            return (Stored)(sign | 0x7c00);    //Too large, infinity
+        }
+
+        //Round to nearest even on the bits that are dropped, a carry into the exponent is still the right answer
+        int shift = 13;
+        uint32_t half;
+        if (exponent <= 0)
+        {
+            if (exponent < -10)
+            {
+                return (Stored)sign;    //Too small, zero
+            }
+            mantissa |= 0x800000;
+            shift = 14 - exponent;
+            half = mantissa >> shift;
+        }
+        else
+        {
+            half = ((uint32_t)exponent << 10) | (mantissa >> shift);
+        }
+
+        uint32_t remainder = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (half & 1)))
+        {
+            half++;
+        }
+        return (Stored)(sign | half);
+    }
+
+    static double decode(Stored stored)
+    {
+        uint32_t sign = ((uint32_t)stored & 0x8000) << 16;
+        int exponent = (stored >> 10) & 0x1f;
+        uint32_t mantissa = stored & 0x3ff;
+
+        if (exponent == 0)
+        {
+            //Zero and subnormals, mantissa * 2^-24
+            double value = mantissa / 16777216.0;
+            return sign ? -value : value;
+        }
+
+        union { float f; uint32_t u; } bits;
+        if (exponent == 31)
+        {
+            bits.u = sign | 0x7f800000 | (mantissa << 13);
+        }
+        else
+        {
+            bits.u = sign | ((uint32_t)(exponent - 15 + 127) << 23) | (mantissa << 13);
+        }
+        return bits.f;
+    }
+};
+
+struct Uint16Element
+{
+    typedef uint16_t Stored;
+
+    //The scale of a uint16 matrix is its largest distance, so values are 0-1
+    static Stored encode(double value)
+    {
+        if (!(value > 0.0))
+        {
+            return 0;
+        }
+        if (value >= 1.0)
+        {
+            return 65535;
+        }
+        return (Stored)(value * 65535.0 + 0.5);
+    }
+
+    static double decode(Stored stored) { return stored / 65535.0; }
+};
+
+
+/**
+ * View of a symmetric distance matrix with a zero diagonal stored as its upper triangle, row by row
+ * Only the N(N-1)/2 pairs with row < col are stored. (row, col) and (col, row) are the same distance and the diagonal is
+ * always 0, so the downstream stages can read it like a full matrix. The view doesn't own the distances.
+ * The distance of a stored value is Element::decode(value) * scale, so the whole matrix can be rescaled (eg. normalized)
+ * without touching the values.
+ */
+template <class Element>
+class PackedDistanceMatrix
+{
+public:
+    typedef typename Element::Stored Stored;
+
+    Stored* data;
+    int size;
+    double scale;
+
+    PackedDistanceMatrix(void* data, int size, double scale)
+    {
+        this->data = (Stored*) data;
+        this->size = size;
+        this->scale = scale;
+    }
+
+    //Number of stored values for an N x N matrix
+    static size_t length(int size)
+    {
+        return size > 1 ? (size_t)size * (size - 1) / 2 : 0;
+    }
+
+    //Position of (row, col), row < col. row * (2N - row - 1) is always even.
+    static size_t index(int row, int col, int size)
+    {
+        return (size_t)row * (size_t)(2 * size - row - 1) / 2 + (size_t)(col - row - 1);
+    }
+
+    double operator()(int row, int col) const
+    {
+        if (row == col)
+        {
+            return 0.0;
+        }
+        if (row > col)
+        {
+            int swap = row;
+            row = col;
+            col = swap;
+        }
+        return Element::decode(this->data[index(row, col, this->size)]) * this->scale;
+    }
+
+    //Writes through the view, setting (row, col) also sets (col, row). The diagonal is ignored.
+    void set(int row, int col, double distance) const
+    {
+        if (row == col)
+        {
+            return;
+        }
+        if (row > col)
+        {
+            int swap = row;
+            row = col;
+            col = swap;
+        }
+        this->data[index(row, col, this->size)] = Element::encode(distance / this->scale);
+    }
+
+    //Largest distance in the matrix
+    double max() const
+    {
+        double largest = 0.0;
+        size_t count = length(this->size);
+        for (size_t i=0; i<count; i++)
+        {
+            double value = Element::decode(this->data[i]);
+            if (value > largest)
+            {
+                largest = value;
+            }
+        }
+        return largest * this->scale;
+    }
+};
+
+/**
+ * Same accessor for a full N x N matrix of doubles, so a stage can be written once for both
+ */
+class FullDistanceMatrix
+{
+public:
+    double** rows;
+
+    FullDistanceMatrix(double** rows)
+    {
+        this->rows = rows;
+    }
+
+    double operator()(int row, int col) const
+    {
+        return this->rows[row][col];
+    }
+
+    void set(int row, int col, double distance) const
+    {
+        this->rows[row][col] = distance;
+        this->rows[col][row] = distance;
+    }
+};
+
+/**
+ * Packed distances whose element type is only known at run time, eg. from a cache file
+ * visit() calls visitor(matrix) with the PackedDistanceMatrix of the right type, so the visitor is a functor with a
+ * template operator() and the loops inside it are compiled once per element type.
+ */
+struct PackedDistances
+{
+    DistanceElement element;
+    int size;
+    double scale;
+    void* data;     //NULL = none
+
+    PackedDistances()
+    {
+        this->element = ELEMENT_FLOAT32;
+        this->size = 0;
+        this->scale = 1.0;
+        this->data = NULL;
+    }
+
+    size_t bytes() const
+    {
+        return PackedDistanceMatrix<Float64Element>::length(this->size) * distanceElementSize(this->element);
+    }
+
+    template <class Visitor>
+    void visit(Visitor& visitor) const
+    {
+        switch (this->element)
+        {
+            case ELEMENT_FLOAT64:
+                visitor(PackedDistanceMatrix<Float64Element>(this->data, this->size, this->scale));
+                break;
+            case ELEMENT_FLOAT32:
+                visitor(PackedDistanceMatrix<Float32Element>(this->data, this->size, this->scale));
+                break;
+            case ELEMENT_FLOAT16:
+                visitor(PackedDistanceMatrix<Float16Element>(this->data, this->size, this->scale));
+                break;
+            case ELEMENT_UINT16:
+                visitor(PackedDistanceMatrix<Uint16Element>(this->data, this->size, this->scale));
+                break;
+        }
+    }
+};
+
+#endif
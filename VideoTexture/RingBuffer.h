@@ -0,0 +1,154 @@
+//
+//  RingBuffer.h
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-11-28.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sched.h>
+
+/**
+ * Lock free bounded queue for passing work between threads
+ * Any number of threads can push and pop. Every slot carries a sequence number that says whether it is
+ * ready to be written or read on the current lap, so producers and consumers only contend on the position
+ * they claim with a compare and swap (Vyukov's bounded MPMC queue).
+ */
+template <typename T>
+class RingBuffer
+{
+public:
+    //capacity is rounded up to a power of 2
+    RingBuffer(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity)
+        {
+            size *= 2;
+        }
+        
+        this->mask = size - 1;
+        this->cells = new Cell[size];
+        for (size_t i=0; i<size; i++)
+        {
+            this->cells[i].sequence = i;
+        }
+        this->enqueuePosition = 0;
+        this->dequeuePosition = 0;
+    }
+    
+    ~RingBuffer()
+    {
+        delete [] this->cells;
+    }
+    
+    size_t capacity()
+    {
+        return this->mask + 1;
+    }
+    
+    //Returns false if the queue is full
+    bool tryPush(const T& value)
+    {
+        Cell* cell;
+        size_t position = this->enqueuePosition;
+        while (true)
+        {
+            cell = &this->cells[position & this->mask];
+            intptr_t difference = (intptr_t)cell->sequence - (intptr_t)position;
+            if (difference == 0)
+            {
+                //Slot is free on this lap, claim it
+                if (__sync_bool_compare_and_swap(&this->enqueuePosition, position, position + 1))
+                {
+                    break;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            position = this->enqueuePosition;
+        }
+        
+        cell->value = value;
+        __sync_synchronize();
+        cell->sequence = position + 1;
+        return true;
+    }
+    
+    //Returns false if the queue is empty
+    bool tryPop(T& value)
+    {
+        Cell* cell;
+        size_t position = this->dequeuePosition;
+        while (true)
+        {
+            cell = &this->cells[position & this->mask];
+            intptr_t difference = (intptr_t)cell->sequence - (intptr_t)(position + 1);
+            if (difference == 0)
+            {
+                //Slot has been written on this lap, claim it
+                if (__sync_bool_compare_and_swap(&this->dequeuePosition, position, position + 1))
+                {
+                    break;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            position = this->dequeuePosition;
+        }
+        
+        value = cell->value;
+        __sync_synchronize();
+        cell->sequence = position + this->mask + 1;
+        return true;
+    }
+    
+    //Blocking versions, yield while the queue is full or empty
+    void push(const T& value)
+    {
+        while (!this->tryPush(value))
+        {
+            sched_yield();
+        }
+    }
+    
+    void pop(T& value)
+    {
+        while (!this->tryPop(value))
+        {
+            sched_yield();
+        }
+    }
+    
+private:
+    struct Cell
+    {
+        volatile size_t sequence;
+        T value;
+    };
+    
+    Cell* cells;
+    size_t mask;
+    
+    //On separate cache lines so producers and consumers don't share one
+    char padding0[64];
+    volatile size_t enqueuePosition;
+    char padding1[64];
+    volatile size_t dequeuePosition;
+    char padding2[64];
+    
+    //Not copyable
+    RingBuffer(const RingBuffer&);
+    RingBuffer& operator=(const RingBuffer&);
+};
+
+#endif
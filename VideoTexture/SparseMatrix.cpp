@@ -0,0 +1,153 @@
+//
+//  SparseMatrix.cpp
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-11-24.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include <algorithm>
+#include "SparseMatrix.h"
+
+/**
+ * Order entries by column
+ */
+static bool entryBefore(const SparseEntry& a, const SparseEntry& b)
+{
+    return a.col < b.col;
+}
+
+SparseMatrix::SparseMatrix(int size)
+{
+    this->size = size;
+    this->rows.resize(size);
+    this->largestValue = 0.0;
+}
+
+void SparseMatrix::setRow(int row, vector<SparseEntry>& entries)
+{
+    sort(entries.begin(), entries.end(), entryBefore);
+    this->rows[row].swap(entries);
+}
+
+void SparseMatrix::set(int row, int col, double value)
+{
+    SparseEntry entry;
+    entry.col = col;
+    entry.value = value;
+    
+    vector<SparseEntry>& entries = this->rows[row];
+    vector<SparseEntry>::iterator it = lower_bound(entries.begin(), entries.end(), entry, entryBefore);
+    if (it != entries.end() && it->col == col)
+    {
+        it->value = value;
+    }
+    else
+    {
+        entries.insert(it, entry);
+    }
+}
+
+bool SparseMatrix::find(int row, int col, double& value)
+{
+    SparseEntry entry;
+    entry.col = col;
+    
+    vector<SparseEntry>& entries = this->rows[row];
+    vector<SparseEntry>::iterator it = lower_bound(entries.begin(), entries.end(), entry, entryBefore);
+    if (it != entries.end() && it->col == col)
+    {
+        value = it->value;
+        return true;
+    }
+    return false;
+}
+
+double SparseMatrix::get(int row, int col, double missing)
+{
+    double value;
+    if (this->find(row, col, value))
+    {
+        return value;
+    }
+    return missing;
+}
+
+size_t SparseMatrix::numEntries()
+{
+    size_t count = 0;
+    for (int row=0; row<this->size; row++)
+    {
+        count += this->rows[row].size();
+    }
+    return count;
+}
+
+double SparseMatrix::max()
+{
+    double max = 0.0f;
+    for (int row=0; row<this->size; row++)
+    {
+        double value = this->rowMax(row);
+        if (value > max)
+        {
+            max = value;
+        }
+    }
+    return max;
+}
+
+double SparseMatrix::rowMax(int row)
+{
+    double max = 0.0f;
+    for (size_t i=0; i<this->rows[row].size(); i++)
+    {
+        if (this->rows[row][i].value > max)
+        {
+            max = this->rows[row][i].value;
+        }
+    }
+    return max;
+}
+
+void SparseMatrix::normalize()
+{
+    //The stored values alone would put the largest kept distance at 1
+    double max = (this->largestValue > 0.0) ? std::max(this->largestValue, this->max()) : this->max();
+    if (max <= 0.0f)
+    {
+        return;
+    }
+    if (this->largestValue > 0.0)
+    {
+        this->largestValue /= max;
+    }
+    
+    for (int row=0; row<this->size; row++)
+    {
+        for (size_t i=0; i<this->rows[row].size(); i++)
+        {
+            this->rows[row][i].value /= max;
+        }
+    }
+}
+
+void SparseMatrix::normalizeRows()
+{
+    for (int row=0; row<this->size; row++)
+    {
+        double sum = 0.0f;
+        for (size_t i=0; i<this->rows[row].size(); i++)
+        {
+            sum += this->rows[row][i].value;
+        }
+        
+        for (size_t i=0; i<this->rows[row].size(); i++)
+        {
+            if (sum > 0.0f)
+                this->rows[row][i].value /= sum;
+            else
+                this->rows[row][i].value = 0.0f;
+        }
+    }
+}
@@ -0,0 +1,69 @@
+//
+//  SparseMatrix.h
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-11-24.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include <iostream>
+#include <vector>
+
+#ifndef SPARSEMATRIX_H
+#define SPARSEMATRIX_H
+
+using namespace std;
+
+/**
+ * One stored value of a sparse matrix
+ */
+struct SparseEntry
+{
+    int col;
+    double value;
+};
+
+/**
+ * Square matrix that only stores some of the values of each row
+ * Rows are kept sorted by column so lookups are a binary search
+ */
+class SparseMatrix
+{
+public:
+    int size;
+    vector< vector<SparseEntry> > rows;
+    
+    //Largest value of the whole matrix, counting the values that weren't kept. 0 = not known
+    double largestValue;
+    
+    SparseMatrix(int size);
+    
+    //Replaces the whole row. The entries don't need to be sorted.
+    void setRow(int row, vector<SparseEntry>& entries);
+    
+    //Adds a value to a row, keeping the row sorted
+    void set(int row, int col, double value);
+    
+    //Returns false if the value isn't stored
+    bool find(int row, int col, double& value);
+    
+    //Returns missing if the value isn't stored
+    double get(int row, int col, double missing);
+    
+    //Total number of stored values
+    size_t numEntries();
+    
+    //Largest stored value
+    double max();
+    
+    //Largest stored value in a row
+    double rowMax(int row);
+    
+    //Divide every value by largestValue, or by the largest stored value if it isn't known
+    void normalize();
+    
+    //Scale every row so that it adds up to 1
+    void normalizeRows();
+};
+
+#endif
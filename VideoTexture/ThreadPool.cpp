@@ -0,0 +1,263 @@
+//
+//  ThreadPool.cpp
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-11-22.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include <unistd.h>
+#include "ThreadPool.h"
+
+/**
+ * Start the workers
+ */
+ThreadPool::ThreadPool(int numThreads)
+{
+    if (numThreads <= 0)
+    {
+        numThreads = ThreadPool::defaultThreadCount();
+    }
+
+    this->numThreads = numThreads;
+    this->queuedTasks = 0;
+    this->pendingTasks = 0;
+    this->completedTasks = 0;
+    this->totalTasks = 0;
+    this->stopping = false;
+    this->nextQueue = 0;
+
+    pthread_mutex_init(&this->stateLock, NULL);
+    pthread_cond_init(&this->workAvailable, NULL);
+    pthread_cond_init(&this->allDone, NULL);
+
+    this->queues = new WorkerQueue[numThreads];
+    for (int i=0; i<numThreads; i++)
+    {
+        pthread_mutex_init(&this->queues[i].lock, NULL);
+    }
+
+    //Fill workerInfo completely before starting any thread, it must not reallocate afterwards
+    this->workerInfo.resize(numThreads);
+    this->threads.resize(numThreads);
+    for (int i=0; i<numThreads; i++)
+    {
+        this->workerInfo[i].pool = this;
+        this->workerInfo[i].index = i;
+    }
+
+    for (int i=0; i<numThreads; i++)
+    {
+        if (pthread_create(&this->threads[i], NULL, ThreadPool::workerMain, &this->workerInfo[i]) != 0)
+        {
+            //The destructor won't run, the workers that did start use this object and have to be gone before it is
+            this->stopWorkers(i);
+            throw string("Couldn't start worker thread");
+        }
+    }
+}
+
+/**
+ * Finish the queued work and stop the workers
+ */
+ThreadPool::~ThreadPool()
+{
+    this->wait();
+    this->stopWorkers(this->numThreads);
+}
+
+/**
+ * Wake the first started workers to stop, join them and free the queues and locks
+ */
+void ThreadPool::stopWorkers(int started)
+{
+    pthread_mutex_lock(&this->stateLock);
+    this->stopping = true;
+    pthread_cond_broadcast(&this->workAvailable);
+    pthread_mutex_unlock(&this->stateLock);
+
+    for (int i=0; i<started; i++)
+    {
+        pthread_join(this->threads[i], NULL);
+    }
+    for (int i=0; i<this->numThreads; i++)
+    {
+        pthread_mutex_destroy(&this->queues[i].lock);
+    }
+    delete [] this->queues;
+
+    pthread_cond_destroy(&this->allDone);
+    pthread_cond_destroy(&this->workAvailable);
+    pthread_mutex_destroy(&this->stateLock);
+}
+
+/**
+ * Number of cores on this machine
+ */
+int ThreadPool::defaultThreadCount()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 1;
+}
+
+int ThreadPool::getNumThreads()
+{
+    return this->numThreads;
+}
+
+void ThreadPool::setProgressLabel(string label)
+{
+    pthread_mutex_lock(&this->stateLock);
+    this->progressLabel = label;
+    pthread_mutex_unlock(&this->stateLock);
+}
+
+/**
+ * Index of the worker running on this thread, or -1 if called from outside the pool
+ */
+int ThreadPool::currentWorker()
+{
+    pthread_t self = pthread_self();
+    for (int i=0; i<this->numThreads; i++)
+    {
+        if (pthread_equal(self, this->threads[i]))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Queue a task
+ * Tasks added by a worker go to its own queue, tasks from outside are dealt out round robin
+ */
+void ThreadPool::add(Task* task)
+{
+    int index = this->currentWorker();
+
+    pthread_mutex_lock(&this->stateLock);
+    if (index < 0)
+    {
+        index = this->nextQueue % this->numThreads;
+        this->nextQueue++;
+    }
+    pthread_mutex_unlock(&this->stateLock);
+
+    pthread_mutex_lock(&this->queues[index].lock);
+    this->queues[index].tasks.push_back(task);
+    pthread_mutex_unlock(&this->queues[index].lock);
+
+    //Count it only once it can be found, so a sleeping worker can't miss it
+    pthread_mutex_lock(&this->stateLock);
+    this->queuedTasks++;
+    this->pendingTasks++;
+    this->totalTasks++;
+    pthread_cond_signal(&this->workAvailable);
+    pthread_mutex_unlock(&this->stateLock);
+}
+
+/**
+ * Wait until every task has run
+ */
+void ThreadPool::wait()
+{
+    pthread_mutex_lock(&this->stateLock);
+    while (this->pendingTasks > 0)
+    {
+        pthread_cond_wait(&this->allDone, &this->stateLock);
+    }
+
+    //Start counting progress again for the next batch
+    this->completedTasks = 0;
+    this->totalTasks = 0;
+    pthread_mutex_unlock(&this->stateLock);
+}
+
+/**
+ * Newest task from our own queue, otherwise the oldest task from someone else's
+ */
+Task* ThreadPool::takeTask(int index)
+{
+    Task* task = NULL;
+
+    pthread_mutex_lock(&this->queues[index].lock);
+    if (!this->queues[index].tasks.empty())
+    {
+        task = this->queues[index].tasks.back();
+        this->queues[index].tasks.pop_back();
+    }
+    pthread_mutex_unlock(&this->queues[index].lock);
+
+    //Steal
+    for (int i=1; task == NULL && i<this->numThreads; i++)
+    {
+        int victim = (index + i) % this->numThreads;
+
+        pthread_mutex_lock(&this->queues[victim].lock);
+        if (!this->queues[victim].tasks.empty())
+        {
+            task = this->queues[victim].tasks.front();
+            this->queues[victim].tasks.pop_front();
+        }
+        pthread_mutex_unlock(&this->queues[victim].lock);
+    }
+
+    return task;
+}
+
+void* ThreadPool::workerMain(void* info)
+{
+    WorkerInfo* worker = (WorkerInfo*) info;
+    worker->pool->workerLoop(worker->index);
+    return NULL;
+}
+
+/**
+ * Run tasks until the pool is destroyed
+ */
+void ThreadPool::workerLoop(int index)
+{
+    while (true)
+    {
+        //Sleep until there is something to do
+        pthread_mutex_lock(&this->stateLock);
+        while (this->queuedTasks == 0 && !this->stopping)
+        {
+            pthread_cond_wait(&this->workAvailable, &this->stateLock);
+        }
+        if (this->queuedTasks == 0 && this->stopping)
+        {
+            pthread_mutex_unlock(&this->stateLock);
+            return;
+        }
+        pthread_mutex_unlock(&this->stateLock);
+
+        Task* task = this->takeTask(index);
+        if (task == NULL)
+        {
+            //Someone else got there first
+            continue;
+        }
+
+        pthread_mutex_lock(&this->stateLock);
+        this->queuedTasks--;
+        pthread_mutex_unlock(&this->stateLock);
+
+        task->run();
+        delete task;
+
+        pthread_mutex_lock(&this->stateLock);
+        this->pendingTasks--;
+        this->completedTasks++;
+        if (!this->progressLabel.empty())
+        {
+            cout << this->progressLabel << ": " << this->completedTasks << "/" << this->totalTasks << endl;
+        }
+        if (this->pendingTasks == 0)
+        {
+            pthread_cond_broadcast(&this->allDone);
+        }
+        pthread_mutex_unlock(&this->stateLock);
+    }
+}
@@ -0,0 +1,88 @@
+//
+//  ThreadPool.h
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-11-22.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include <iostream>
+#include <string>
+#include <deque>
+#include <vector>
+#include <pthread.h>
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+using namespace std;
+
+/**
+ * A unit of work for the thread pool. The pool deletes the task after running it.
+ */
+class Task
+{
+public:
+    virtual ~Task() {}
+    virtual void run() = 0;
+};
+
+/**
+ * Work stealing thread pool
+ * Every worker has its own queue. Workers take the newest task from their own queue and when it is empty
+ * steal the oldest task from another worker, so uneven tiles balance themselves out.
+ */
+class ThreadPool
+{
+public:
+    ThreadPool(int numThreads = 0);    //0 = one thread per core
+    ~ThreadPool();
+
+    void add(Task* task);   //Queue a task. Safe to call from inside a running task.
+    void wait();            //Block until every queued task has finished
+
+    //Print "<label>: done/total" as tasks finish
+    void setProgressLabel(string label);
+
+    int getNumThreads();
+
+    static int defaultThreadCount();
+
+private:
+    struct WorkerQueue
+    {
+        deque<Task*> tasks;
+        pthread_mutex_t lock;
+    };
+
+    struct WorkerInfo
+    {
+        ThreadPool* pool;
+        int index;
+    };
+
+    int numThreads;
+    vector<pthread_t> threads;
+    vector<WorkerInfo> workerInfo;
+    WorkerQueue* queues;
+
+    //Shared state, protected by stateLock
+    pthread_mutex_t stateLock;
+    pthread_cond_t workAvailable;
+    pthread_cond_t allDone;
+    int queuedTasks;    //In a queue, not yet picked up
+    int pendingTasks;   //Queued or running
+    int completedTasks;
+    int totalTasks;
+    bool stopping;
+    unsigned int nextQueue;
+    string progressLabel;
+
+    static void* workerMain(void* info);
+    void workerLoop(int index);
+    void stopWorkers(int started);
+    Task* takeTask(int index);
+    int currentWorker();
+};
+
+#endif
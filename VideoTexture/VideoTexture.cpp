@@ -12,7 +12,7 @@
 /**
  * Constructor
  */
-VideoTexture::VideoTexture(string file, double sigma)
+VideoTexture::VideoTexture(string file, double sigma, VideoTextureSettings settings)
 {
     //Initialize random seed
     srand ( time(NULL) );
@@ -24,16 +24,126 @@ VideoTexture::VideoTexture(string file, double sigma)
     this->height = 0;
     
     this->sigma = sigma;
+    this->settings = settings;
+    this->file = file;
+    
+    this->frames = NULL;
+    this->greyscaleFrames = NULL;
+    this->colourStore = NULL;
+    this->greyscaleStore = NULL;
+    this->frameCache = NULL;
+    this->analysisCache = NULL;
+    this->compressedFrames = NULL;
+    this->sourceFrameCount = 0;
+    this->frameDistanceMatrix = NULL;
+    this->distanceCache = NULL;
+    this->frameNorms = NULL;
+    this->frameHistograms = NULL;
+    this->histogramSize = 0;
+    this->sparseFrameDistanceMatrix = NULL;
+    this->sparseFrameProbabilityMatrix = NULL;
+    this->sparseWeightedFrameDistanceMatrix = NULL;
+    this->sparseWeightedFrameProbabilityMatrix = NULL;
+    this->sparseAnticipatedFutureCostMatrix = NULL;
+    this->sparseAnticipatedFutureCostProbabilityMatrix = NULL;
+    this->frameProbabilityMatrix = NULL;
+    this->weightedFrameDistanceMatrix = NULL;
+    this->weightedFrameProbabilityMatrix = NULL;
+    this->anticipatedFutureCostMatrix = NULL;
+    this->anticipatedFutureCostProbabilityMatrix = NULL;
+    this->transitions = NULL;
+    
+    if (!this->settings.analysisCacheDirectory.empty())
+    {
+        this->analysisCache = new AnalysisCache(this->settings.analysisCacheDirectory, (uint64_t)this->settings.analysisCacheMegabytes * 1024 * 1024);
+    }
     
     //Load the video
     try {
         this->loadVideo(file);
+        
+        if (!this->settings.maskFile.empty())
+        {
+            this->loadAnalysisMask(this->settings.maskFile);
+        }
+        
+        if (this->settings.collapseDuplicates)
+        {
+            this->collapseDuplicateFrames();
+        }
     } catch (string e)
     {
         throw e;    //Duck!
     }
 }
 
+/**
+ * Frees a matrix made by initMatrix, or only its row pointers when the rows belong to someone else
+ */
+static void freeMatrix(double** matrix, int size, bool ownsRows = true)
+{
+    if (matrix == NULL)
+    {
+        return;
+    }
+    for (int i=0; ownsRows && i<size; i++)
+    {
+        delete [] matrix[i];
+    }
+    delete [] matrix;
+}
+
+/**
+ * Frees the frames, caches and matrices, and stops the threads of the compressed frame store
+ */
+VideoTexture::~VideoTexture()
+{
+    delete this->compressedFrames;
+    
+    //The frames are views into the stores and the frame cache, so they go first
+    delete [] this->frames;
+    delete [] this->greyscaleFrames;
+    delete this->colourStore;
+    delete this->greyscaleStore;
+    delete this->frameCache;
+    delete this->analysisCache;
+    
+    delete [] this->frameNorms;
+    delete [] this->frameHistograms;
+    
+    //Rows loaded from a full binary cache point into its mapping
+    freeMatrix(this->frameDistanceMatrix, this->frameCount, this->distanceCache == NULL);
+    delete this->distanceCache;
+    
+    freeMatrix(this->frameProbabilityMatrix, this->frameCount);
+    freeMatrix(this->weightedFrameDistanceMatrix, this->frameCount);
+    freeMatrix(this->weightedFrameProbabilityMatrix, this->frameCount);
+    freeMatrix(this->anticipatedFutureCostMatrix, this->frameCount);
+    freeMatrix(this->anticipatedFutureCostProbabilityMatrix, this->frameCount);
+    
+    //packedDistances is the mapping of distanceCache, the weighted ones are a copy
+    if (this->packedWeightedDistances.data != this->packedDistances.data)
+    {
+        delete [] (char*) this->packedWeightedDistances.data;
+    }
+    
+    delete this->sparseFrameDistanceMatrix;
+    delete this->sparseFrameProbabilityMatrix;
+    delete this->sparseWeightedFrameDistanceMatrix;
+    delete this->sparseWeightedFrameProbabilityMatrix;
+    delete this->sparseAnticipatedFutureCostMatrix;
+    delete this->sparseAnticipatedFutureCostProbabilityMatrix;
+    
+    if (this->transitions != NULL)
+    {
+        for (size_t i=0; i<this->transitions->size(); i++)
+        {
+            delete this->transitions->at(i);
+        }
+        delete this->transitions;
+    }
+}
+
 /**
  * Loads a video file
  * @param string file
@@ -49,8 +159,8 @@ void VideoTexture::loadVideo(string file)
         throw string("Couldn't open file");
     }
     
-    //Analyze the video
-    this->frameRate = capture.get(CV_CAP_PROP_FPS);
+    //Analyze the video, keeping every nth frame plays back at 1/n of the frame rate
+    this->frameRate = capture.get(CV_CAP_PROP_FPS) / max(1, this->settings.frameStride);
     this->width = (int) capture.get(CV_CAP_PROP_FRAME_WIDTH);
     this->height = (int) capture.get(CV_CAP_PROP_FRAME_HEIGHT);
     
@@ -71,229 +181,3014 @@ void VideoTexture::loadVideo(string file)
     cout << "Framerate: " << this->frameRate << endl;
     cout << "Width: " << this->width << endl;
     cout << "Height: " << this->height << endl;    
+    capture.release();
     
-    //Run through the frames once to get the real number of frames
-    cv::Mat frame;  //Temp frame
-    while (capture.read(frame))
+    if (this->settings.startFrame > 0 || this->settings.endFrame >= 0 || this->settings.frameStride > 1)
     {
-        this->frameCount++;
+        cout << "Frames: " << this->settings.startFrame << " to " << this->settings.endFrame << ", every " << max(1, this->settings.frameStride) << endl;
     }
-    capture.release();
     
-    cout << "Number of real frames in sequence: " << this->frameCount << endl;
+    //Frames are read from disk a block at a time when they are needed, so only count them
+    if (this->settings.memoryBudget > 0)
+    {
+        FrameRangeReader reader(this->file, this->settings.startFrame, this->settings.endFrame, this->settings.frameStride);
+        cv::Mat frame;  //Temp frame
+        while (reader.read(frame))
+        {
+            this->frameCount++;
+        }
+        
+        cout << "Number of real frames in sequence: " << this->frameCount << endl;
+        cout << "Streaming frames with a memory budget of " << this->settings.memoryBudget << " bytes" << endl;
+        return;
+    }
     
-    //Load the frames into the frame array
-    this->frames = new cv::Mat[this->frameCount];
+    //The frame cache goes in the analysis cache unless it was given, it only depends on the frames that are compared
+    if (this->analysisCache != NULL && this->settings.frameCacheFile.empty())
+    {
+        cv::Size analysisSize = this->getAnalysisSize();
+        CacheMetadata parameters;
+        parameters.setInt("analysisWidth", analysisSize.width);
+        parameters.setInt("analysisHeight", analysisSize.height);
+        parameters.setInt("startFrame", max(0, this->settings.startFrame));
+        parameters.setInt("endFrame", max(-1, this->settings.endFrame));
+        parameters.setInt("frameStride", max(1, this->settings.frameStride));
+        this->settings.frameCacheFile = this->analysisCache->file(file, parameters, ".frames");
+        this->analysisCache->find(this->settings.frameCacheFile);
+    }
     
-    capture.open(file);
-    if (!capture.isOpened())
+    //The analysis only needs the greyscale frames, the colour frames are decoded later if anything needs them
+    if (!this->settings.frameCacheFile.empty() && this->openFrameCache())
     {
-        throw string ("Couldn't open file");
+        return;
     }
     
-    for (int i=0; i<frameCount; i++)
+    //The frames are decoded while the distance matrix is calculated, unless duplicates have to be found first
+    if (this->settings.pipeline && !this->settings.collapseDuplicates)
     {
-        capture.read(frame);
-        frame.copyTo(this->frames[i]);  //Need to copy the actual frame
+        return;
     }
-    capture.release();
     
+    this->decodeFrames();
 }
 
 /**
- * Play the loaded video
+ * FNV-1a hash of some pixels, carrying on from hash to continue one over several runs of pixels
  */
-void VideoTexture::playVideo()
+static uint64_t hashPixels(const uchar* pixels, size_t length, uint64_t hash = 14695981039346656037ULL)
 {
-    cout << "Playing video straight through" << endl;
-    
-    bool stop = false;
-    int delay = 1000 / this->frameRate;
-    int currentFrame = 0;
-    
-    //Open a window
-    cv::namedWindow("Video");
+    for (size_t i=0; i<length; i++)
+    {
+        hash = (hash ^ pixels[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * FNV-1a hash of the pixels of an 8 bit image row by row, in hex for cache metadata
+ */
+static string hashImage(const cv::Mat& image)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (int y=0; y<image.rows; y++)
+    {
+        hash = hashPixels(image.ptr<uchar>(y), (size_t)image.cols * image.channels(), hash);
+    }
     
-    while (!stop)
+    stringstream hashText;
+    hashText << hex << hash;
+    return hashText.str();
+}
+
+/**
+ * Adds a frame to a store and returns a view of it, the store is made on the first frame
+ * The view doesn't own the pixels, it is only valid while the store is.
+ */
+static cv::Mat appendFrame(FrameStore*& store, cv::Size size, int type)
+{
+    size_t frameBytes = (size_t)size.width * size.height * CV_ELEM_SIZE(type);
+    if (store == NULL)
     {
-        //Display the current frame
-        cv::imshow("Video", this->frames[currentFrame]);
-        
-        currentFrame++;
-        
-        //Wait for key or delay
-        if (cv::waitKey(delay) >= 0)
-        {
-            stop = true;
-        }
+        store = new FrameStore(frameBytes);
+    }
+    else if (store->getFrameBytes() != frameBytes)
+    {
+        throw string("Frames change size part way through the video");
     }
+    
+    return cv::Mat(size, type, store->append());
 }
 
 /**
- * Play the greyscale video
+ * Decodes the video in one pass
  */
-void VideoTexture::playGreyscaleVideo()
+void VideoTexture::decodeFrames()
 {
-    cout << "Playing greyscale video straight through" << endl;
+    //Encoded colour frames are added in order, so they always come from one capture
+    if (this->settings.decodeSegments > 1 && this->settings.colourFrameEncoding.empty() && this->decodeFramesInSegments())
+    {
+        return;
+    }
     
-    bool stop = false;
-    int delay = 1000 / this->frameRate;
-    int currentFrame = 0;
+    FrameRangeReader reader(this->file, this->settings.startFrame, this->settings.endFrame, this->settings.frameStride);
+    if (!reader.isOpened())
+    {
+        throw string("Couldn't open file");
+    }
     
-    //Open a window
-    cv::namedWindow("Video");
+    //Decode once, the number of frames the container reports isn't reliable so the stores grow until the video ends.
+    //The greyscale frames for analysis are made while the colour frame is still in cache.
+    //They already exist if they came from the frame cache.
+    bool makeGreyscale = (this->greyscaleFrames == NULL);
+    bool encodeColour = !this->settings.colourFrameEncoding.empty();
+    vector<cv::Mat> colourViews;
+    vector<cv::Mat> greyscaleViews;
     
-    while (!stop)
+    if (encodeColour)
     {
-        //Display the current frame
-        cv::imshow("Video", this->greyscaleFrames[currentFrame]);
-
-        currentFrame++;
+        this->compressedFrames = new CompressedFrameStore(this->settings.colourFrameEncoding, (size_t)this->settings.colourCacheMegabytes * 1024 * 1024, this->settings.numThreads);
+    }
+    
+    int decoded = 0;
+    cv::Mat frame;  //Temp frame
+    cv::Mat fullSize;   //Greyscale frame before it is scaled down
+    while (reader.read(frame))
+    {
+        if (encodeColour)
+        {
+            this->compressedFrames->add(frame);
+        }
+        else
+        {
+            colourViews.push_back(appendFrame(this->colourStore, frame.size(), frame.type()));
+            frame.copyTo(colourViews.back());  //Need to copy the actual frame, the capture reuses it
+        }
         
-        //Wait for key or delay
-        if (cv::waitKey(delay) >= 0)
+        if (makeGreyscale)
         {
-            stop = true;
+            greyscaleViews.push_back(appendFrame(this->greyscaleStore, this->getAnalysisSize(), CV_8UC1));
+            this->makeAnalysisFrame(frame, greyscaleViews.back(), fullSize);
         }
+        decoded++;
+    }
+    
+    //frameCount is already known, and may count collapsed duplicates only once, if the greyscale frames exist
+    if (!makeGreyscale && decoded != this->getSourceFrameCount())
+    {
+        throw string("Frame cache doesn't match the video");
     }
-}
-
-/**
- * Calculate the L2 distance between two frames
- * Requires both frames to have 1 channel
- */
-double VideoTexture::getDistanceBetweenFrames(const cv::Mat& image1, const cv::Mat& image2)
-{
-    double sum = 0.0f;
     
-    //Analyze each pixel
-    for (int y=0; y<this->height; y++)
+    cout << "Number of real frames in sequence: " << decoded << endl;
+    
+    if (encodeColour)
+    {
+        this->compressedFrames->finish();
+        cout << "Encoded colour frames: " << this->compressedFrames->getEncodedBytes() << " bytes" << endl;
+    }
+    else
     {
-        for (int x=0; x<this->width; x++)
+        //Hand the views over to the arrays, the pixels stay in the stores
+        this->frames = new cv::Mat[decoded];
+        for (int i=0; i<decoded; i++)
         {
-
-            uchar pixelValue1 = image1.at<uchar>(y, x);
-            uchar pixelValue2 = image2.at<uchar>(y, x);
-
-            if (pixelValue1 != pixelValue2)
-            {
-                double diff = ((double) pixelValue1/255.0f) - ( (double) pixelValue2/255.0f);
-                sum = sum + (diff*diff);    //Distance squared
-            }
+            this->frames[i] = colourViews[i];
         }
     }
     
-    return sqrt(sum);
+    if (makeGreyscale)
+    {
+        this->frameCount = decoded;
+        this->greyscaleFrames = new cv::Mat[this->frameCount];
+        for (int i=0; i<this->frameCount; i++)
+        {
+            this->greyscaleFrames[i] = greyscaleViews[i];
+        }
+        
+        if (!this->settings.frameCacheFile.empty())
+        {
+            this->writeFrameCache();
+        }
+    }
 }
 
+/**
+ * One segment of the video for decodeFramesInSegments
+ */
+struct DecodeSegment
+{
+    VideoTexture* videoTexture;
+    int start;              //Frames are counted within the loaded range
+    int end;                //First frame of the next segment, -1 = until the range ends
+    int storedFrames;       //Frames the stores were sized for, only the last segment appends past them
+    bool makeGreyscale;
+    
+    //Results
+    int decoded;
+    cv::Mat nextFrame;      //The first frame of the next segment as this capture decoded it, to check the boundary
+    bool failed;
+};
 
 /**
- * Generates greyscale frames for analysis
+ * Decodes one segment on its own capture, straight into its place in the stores
  */
-void VideoTexture::generateGreyscaleFrames()
+class DecodeSegmentTask : public Task
 {
-    cout << "Generating greyscale frames" << endl;
+public:
+    DecodeSegment* segment;
     
-    this->greyscaleFrames = new cv::Mat[this->frameCount];
+    //Nothing catches exceptions on a pool thread, a segment that throws (eg. the store can't grow) just fails
+    void run()
+    {
+        try
+        {
+            this->decode();
+        }
+        catch (string e)
+        {
+            cout << "Decoding segment from frame " << this->segment->start << " failed: " << e << endl;
+            this->segment->failed = true;
+        }
+        catch (std::exception& e)
+        {
+            cout << "Decoding segment from frame " << this->segment->start << " failed: " << e.what() << endl;
+            this->segment->failed = true;
+        }
+    }
     
-    for (int i=0; i<this->frameCount; i++)
+    void decode()
     {
-        //Generate the greyscale frame
-        cv::cvtColor(this->frames[i], this->greyscaleFrames[i], CV_RGB2GRAY);
+        DecodeSegment& segment = *this->segment;
+        VideoTexture* videoTexture = segment.videoTexture;
+        segment.decoded = 0;
+        segment.failed = true;
+        
+        //Seeking lands on the nearest keyframe and decodes forward to the frame
+        //It isn't checked here, decodeFramesInSegments compares the frames at the boundaries instead
+        VideoTextureSettings& settings = videoTexture->settings;
+        FrameRangeReader reader(videoTexture->file, settings.startFrame, settings.endFrame, settings.frameStride, segment.start, false);
+        if (!reader.isOpened())
+        {
+            return;
+        }
+        
+        cv::Size analysisSize = videoTexture->getAnalysisSize();
+        cv::Mat frame, fullSize;
+        for (int i=segment.start; segment.end < 0 || i < segment.end; i++)
+        {
+            if (!reader.read(frame))
+            {
+                //Only the last segment may end early
+                segment.failed = (segment.end >= 0);
+                return;
+            }
+            if (frame.cols != videoTexture->width || frame.rows != videoTexture->height || frame.type() != CV_8UC3)
+            {
+                return;
+            }
+            
+            bool stored = (i < segment.storedFrames);
+            cv::Mat colour(frame.size(), CV_8UC3, stored ? videoTexture->colourStore->frame(i) : videoTexture->colourStore->append());
+            frame.copyTo(colour);
+            
+            if (segment.makeGreyscale)
+            {
+                cv::Mat greyscale(analysisSize, CV_8UC1, stored ? videoTexture->greyscaleStore->frame(i) : videoTexture->greyscaleStore->append());
+                videoTexture->makeAnalysisFrame(colour, greyscale, fullSize);
+            }
+            segment.decoded++;
+        }
+        
+        if (reader.read(frame))
+        {
+            segment.nextFrame = frame.clone();
+        }
+        segment.failed = false;
     }
-}
-
+};
 
 /**
- * Generates the frame diff matrix and writes to a cache file
- * @param string file
+ * Decodes the video as settings.decodeSegments segments at once, each on its own capture
+ * Every segment also decodes the first frame of the next one, and it has to be the same frame the next segment
+ * started with, otherwise seeking isn't frame accurate for this file. Returns false if anything doesn't line up,
+ * and the video is then decoded in one pass.
  */
-void VideoTexture::generateFrameDistanceMatrix(string file)
+bool VideoTexture::decodeFramesInSegments()
 {
-    //First convert all frames to greyscale
-    this->generateGreyscaleFrames();
+    cv::VideoCapture probe(this->file);
+    int estimate = probe.isOpened() ? (int)probe.get(CV_CAP_PROP_FRAME_COUNT) : 0;
+    probe.release();
+    estimate = FrameRangeReader::rangeLength(estimate, this->settings.startFrame, this->settings.endFrame, this->settings.frameStride);
     
-    //Initialize the arrays
-    this->frameDistanceMatrix = this->initMatrix(this->frameCount);
-
-    //Calculate the distance between each frame
-    for (int row=0; row < this->frameCount; row++)
+    int numSegments = min(this->settings.decodeSegments, estimate / 2);
+    if (numSegments < 2 || this->width <= 0 || this->height <= 0)
     {
-        cout << "Calculating distances for frame: " << row << endl;
-        for (int col=0; col < this->frameCount; col++)
+        return false;
+    }
+    
+    cout << "Decoding " << numSegments << " segments at once" << endl;
+    
+    bool makeGreyscale = (this->greyscaleFrames == NULL);
+    cv::Size analysisSize = this->getAnalysisSize();
+    
+    //Sized for the frames the container reports, so every segment can write into its place
+    this->colourStore = new FrameStore((size_t)this->width * this->height * 3);
+    this->colourStore->resize(estimate);
+    if (makeGreyscale)
+    {
+        this->greyscaleStore = new FrameStore((size_t)analysisSize.width * analysisSize.height);
+        this->greyscaleStore->resize(estimate);
+    }
+    
+    vector<DecodeSegment> segments(numSegments);
+    ThreadPool pool(numSegments);
+    for (int k=0; k<numSegments; k++)
+    {
+        segments[k].videoTexture = this;
+        segments[k].start = (int)((int64_t)estimate * k / numSegments);
+        segments[k].end = (k == numSegments - 1) ? -1 : (int)((int64_t)estimate * (k + 1) / numSegments);
+        segments[k].storedFrames = estimate;
+        segments[k].makeGreyscale = makeGreyscale;
+        
+        DecodeSegmentTask* task = new DecodeSegmentTask();
+        task->segment = &segments[k];
+        pool.add(task);
+    }
+    pool.wait();
+    
+    //Every segment has to be complete and start with the frame the one before it decoded next
+    bool ok = true;
+    for (int k=0; k<numSegments && ok; k++)
+    {
+        ok = !segments[k].failed;
+        if (ok && k > 0)
         {
-            double diff = this->getDistanceBetweenFrames(this->greyscaleFrames[row], this->greyscaleFrames[col]);
-            this->frameDistanceMatrix[row][col] = diff;
-            //cout << "Distance between frames " << row << " and " << col << ": " << diff << endl;
+            const cv::Mat& expected = segments[k - 1].nextFrame;
+            size_t frameBytes = this->colourStore->getFrameBytes();
+            ok = !expected.empty() && expected.isContinuous()
+                && memcmp(expected.ptr<uchar>(0), this->colourStore->frame(segments[k].start), frameBytes) == 0;
         }
     }
     
-    //cout << "Normalizing frame distances..." << endl;
+    if (!ok)
+    {
+        cout << "Segments don't line up, decoding in one pass" << endl;
+        delete this->colourStore;
+        delete this->greyscaleStore;
+        this->colourStore = NULL;
+        this->greyscaleStore = NULL;
+        return false;
+    }
     
-    //Normalize the distances between 0-1
-    //this->normalizeMatrix(this->frameDistanceMatrix);
-     
+    int decoded = segments[numSegments - 1].start + segments[numSegments - 1].decoded;
+    if (!makeGreyscale && decoded != this->getSourceFrameCount())
+    {
+        throw string("Frame cache doesn't match the video");
+    }
     
-    //Open the file handler to write
-    fstream outfile;
-    outfile.open(file.c_str(), ios::out);
+    this->colourStore->resize(decoded);
+    cout << "Number of real frames in sequence: " << decoded << endl;
     
-    if (!outfile.is_open())
+    //Views of the stores
+    this->frames = new cv::Mat[decoded];
+    for (int i=0; i<decoded; i++)
     {
-        throw string("Could not open " + file);
+        this->frames[i] = cv::Mat(this->height, this->width, CV_8UC3, this->colourStore->frame(i));
     }
     
-    //Write distances to file
-    for (int row=0; row < this->frameCount; row++)
+    if (makeGreyscale)
     {
+        this->frameCount = decoded;
+        this->greyscaleStore->resize(this->frameCount);
+        this->greyscaleFrames = new cv::Mat[this->frameCount];
+        for (int i=0; i<this->frameCount; i++)
+        {
+            this->greyscaleFrames[i] = cv::Mat(analysisSize, CV_8UC1, this->greyscaleStore->frame(i));
+        }
         
-        for (int col=0; col < this->frameCount; col++)
-        { 
-            outfile << this->frameDistanceMatrix[row][col] << endl;
+        if (!this->settings.frameCacheFile.empty())
+        {
+            this->writeFrameCache();
         }
-    }    
-    
-    //Close the file handler
-    outfile.close();
+    }
+    return true;
+}
+
+/**
+ * Maps the greyscale frames from the frame cache
+ */
+bool VideoTexture::openFrameCache()
+{
+    FrameCache* cache = new FrameCache();
+    cv::Size analysisSize = this->getAnalysisSize();
+    if (!cache->open(this->settings.frameCacheFile) || !cache->matchesSource(this->file) || cache->header.channels != 1
+        || cache->header.width != analysisSize.width || cache->header.height != analysisSize.height
+        || cache->header.startFrame != max(0, this->settings.startFrame) || cache->header.endFrame != max(-1, this->settings.endFrame)
+        || cache->header.temporalStride != max(1, this->settings.frameStride))
+    {
+        cout << "No frame cache for this video in " << this->settings.frameCacheFile << endl;
+        delete cache;
+        return false;
+    }
     
-    cout << "Wrote frame distance matrix to: " << file << endl;
+    this->frameCache = cache;
+    this->frameCount = cache->header.frameCount;
+    cout << "Number of real frames in sequence: " << this->frameCount << " (from " << this->settings.frameCacheFile << ")" << endl;
     
+    //Read only views, the analysis never writes to the greyscale frames
+    this->greyscaleFrames = new cv::Mat[this->frameCount];
+    for (int i=0; i<this->frameCount; i++)
+    {
+        this->greyscaleFrames[i] = cv::Mat(cache->header.height, cache->header.width, CV_8UC1, (void*)cache->frame(i));
+    }
+    return true;
 }
 
-
 /**
- * Loads the frame diff matrix from a file
- * @param string file
+ * Saves the greyscale frames so the next run can map them
  */
-void VideoTexture::loadFrameDiffMatrix(string file)
+void VideoTexture::writeFrameCache()
 {
-    //Initialize matrix
-    this->frameDistanceMatrix = this->initMatrix(this->frameCount);
+    if (this->frameCount == 0)
+    {
+        return;
+    }
     
-    //open the file
-    fstream infile;
-    infile.open(file.c_str(), ios::in);
-    if (!infile.is_open())
+    cout << "Writing frame cache: " << this->settings.frameCacheFile << endl;
+    
+    vector<const unsigned char*> pixels(this->frameCount);
+    for (int i=0; i<this->frameCount; i++)
     {
-        throw string("Couldn't open file " + file);
+        pixels[i] = this->greyscaleFrames[i].ptr<uchar>(0);
     }
     
-    string line;
+    FrameCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.frameCount = this->frameCount;
+    header.width = this->greyscaleFrames[0].cols;
+    header.height = this->greyscaleFrames[0].rows;
+    header.channels = 1;
+    header.startFrame = max(0, this->settings.startFrame);
+    header.endFrame = max(-1, this->settings.endFrame);
+    header.temporalStride = max(1, this->settings.frameStride);
+    FrameCache::write(this->settings.frameCacheFile, this->file, header, &pixels[0]);
+    
+    if (this->analysisCache != NULL)
+    {
+        this->analysisCache->added(this->settings.frameCacheFile);
+    }
+}
+
+/**
+ * Colour frame for playback and output
+ * Encoded frames are decoded through the cache, the callers know which frames come next and prefetch them
+ */
+cv::Mat VideoTexture::getColourFrame(int frame)
+{
+    return this->getSourceColourFrame(this->getSourceFrame(frame));
+}
+
+/**
+ * Colour frame of the video, by its number in the video rather than among the collapsed frames
+ */
+cv::Mat VideoTexture::getSourceColourFrame(int sourceFrame)
+{
+    //Not decoded at load time when the analysis frames came from the frame cache
+    if (this->frames == NULL && this->compressedFrames == NULL)
+    {
+        this->decodeFrames();
+    }
+    
+    if (this->compressedFrames != NULL)
+    {
+        return this->compressedFrames->get(sourceFrame);
+    }
+    return this->frames[sourceFrame];
+}
+
+/**
+ * Prefetches colour frames by their number among the analysed frames, with the runs of duplicates they stand for
+ * @param int frame
+ * @param int count
+ */
+void VideoTexture::prefetchColourFrames(int frame, int count)
+{
+    if (this->compressedFrames == NULL || count <= 0 || frame < 0 || frame >= this->frameCount)
+    {
+        return;
+    }
+    
+    int first = this->getSourceFrame(frame);
+    int last = (frame + count < this->frameCount) ? this->getSourceFrame(frame + count) : this->getSourceFrameCount();
+    this->compressedFrames->prefetch(first, last - first);
+}
+
+/**
+ * Prefetches settings.colourPrefetch frames along the output: the rest of the segment up to end, then from jumpTo
+ * @param int frame - the frame being written
+ * @param int end - the segment stops before this frame
+ * @param int jumpTo - where the output carries on after the segment
+ */
+void VideoTexture::prefetchLoopFrames(int frame, int end, int jumpTo)
+{
+    int ahead = max(0, min(this->settings.colourPrefetch, end - frame - 1));
+    this->prefetchColourFrames(frame + 1, ahead);
+    this->prefetchColourFrames(jumpTo, this->settings.colourPrefetch - ahead);
+}
+
+/**
+ * Number of the frame in the video
+ */
+int VideoTexture::getSourceFrame(int frame)
+{
+    return this->sourceFrames.empty() ? frame : this->sourceFrames[frame];
+}
+
+/**
+ * Number of frames of the video the frame stands for, 1 unless duplicates were collapsed into it
+ */
+int VideoTexture::getRunLength(int frame)
+{
+    if (this->sourceFrames.empty())
+    {
+        return 1;
+    }
+    int next = (frame + 1 < this->frameCount) ? this->sourceFrames[frame + 1] : this->sourceFrameCount;
+    return next - this->sourceFrames[frame];
+}
+
+int VideoTexture::getSourceFrameCount()
+{
+    return this->sourceFrames.empty() ? this->frameCount : this->sourceFrameCount;
+}
+
+/**
+ * Collapses runs of consecutive frames that are the same into the first frame of the run
+ * Identical frames are found by hash and confirmed byte for byte. With settings.duplicateThreshold > 0, frames whose
+ * RMS difference from the first frame of the run is at most that many grey levels are collapsed too. Every frame is
+ * compared with the first frame of its run, so a slow fade can't creep through a long run.
+ * Only the greyscale frames are collapsed, colour frames stay numbered as in the video and are found with sourceFrames.
+ */
+void VideoTexture::collapseDuplicateFrames()
+{
+    if (this->greyscaleFrames == NULL || this->frameCount == 0)
+    {
+        cout << "Duplicate frames are only collapsed when the frames are loaded" << endl;
+        return;
+    }
+    
+    size_t length = (size_t)this->greyscaleFrames[0].rows * this->greyscaleFrames[0].cols;
+    double threshold = this->settings.duplicateThreshold;
+    uint64_t maxDifference = (uint64_t)floor(threshold * threshold * length);
+    
+    vector<int> kept;
+    kept.push_back(0);
+    uint64_t keptHash = hashPixels(this->greyscaleFrames[0].ptr<uchar>(0), length);
+    for (int i=1; i<this->frameCount; i++)
+    {
+        const uchar* first = this->greyscaleFrames[kept.back()].ptr<uchar>(0);
+        const uchar* pixels = this->greyscaleFrames[i].ptr<uchar>(0);
+        
+        bool duplicate;
+        if (threshold > 0.0f)
+        {
+            duplicate = FrameDistance::sumSquaredDifference(first, pixels, length) <= maxDifference;
+        }
+        else
+        {
+            uint64_t hash = hashPixels(pixels, length);
+            duplicate = (hash == keptHash) && memcmp(first, pixels, length) == 0;
+            if (!duplicate)
+            {
+                keptHash = hash;
+            }
+        }
+        
+        if (!duplicate)
+        {
+            kept.push_back(i);
+        }
+    }
+    
+    cout << "Collapsed " << this->frameCount << " frames into " << kept.size() << endl;
+    if ((int)kept.size() == this->frameCount)
+    {
+        return;
+    }
+    
+    //Views only, the pixels stay where they are
+    cv::Mat* collapsed = new cv::Mat[kept.size()];
+    for (size_t i=0; i<kept.size(); i++)
+    {
+        collapsed[i] = this->greyscaleFrames[kept[i]];
+    }
+    delete [] this->greyscaleFrames;
+    this->greyscaleFrames = collapsed;
+    
+    this->sourceFrameCount = this->frameCount;
+    this->sourceFrames = kept;
+    this->frameCount = (int)kept.size();
+}
+
+/**
+ * Play the loaded video
+ */
+void VideoTexture::playVideo()
+{
+    cout << "Playing video straight through" << endl;
+    
+    bool stop = false;
+    int delay = 1000 / this->frameRate;
+    int currentFrame = 0;
+    
+    //Open a window
+    cv::namedWindow("Video");
+    
+    while (!stop)
+    {
+        //Display the current frame
+        cv::imshow("Video", this->getSourceColourFrame(currentFrame));
+        if (this->compressedFrames != NULL)
+        {
+            this->compressedFrames->prefetch(currentFrame + 1, this->settings.colourPrefetch);
+        }
+        
+        currentFrame++;
+        
+        //Wait for key or delay
+        if (cv::waitKey(delay) >= 0)
+        {
+            stop = true;
+        }
+    }
+}
+
+/**
+ * Play the greyscale video
+ */
+void VideoTexture::playGreyscaleVideo()
+{
+    cout << "Playing greyscale video straight through" << endl;
+    
+    bool stop = false;
+    int delay = 1000 / this->frameRate;
+    int currentFrame = 0;
+    
+    //Open a window
+    cv::namedWindow("Video");
+    
+    while (!stop)
+    {
+        //Display the current frame
+        cv::imshow("Video", this->greyscaleFrames[currentFrame]);
+
+        currentFrame++;
+        
+        //Wait for key or delay
+        if (cv::waitKey(delay) >= 0)
+        {
+            stop = true;
+        }
+    }
+}
+
+/**
+ * Calculate the L2 distance between two frames
+ * Requires both frames to have 1 channel
+ * The sum of squared differences is accumulated exactly in integers and only scaled to 0-1 at the end
+ */
+double VideoTexture::getDistanceBetweenFrames(const cv::Mat& image1, const cv::Mat& image2, const cv::Mat& mask)
+{
+    uint64_t sum = 0;
+
+    if (!mask.empty())
+    {
+        //Each run of masked pixels in a row is contiguous, so the kernel still gets whole spans
+        for (int y=0; y<image1.rows; y++)
+        {
+            const uchar* maskRow = mask.ptr<uchar>(y);
+            int x = 0;
+            while (x < image1.cols)
+            {
+                if (maskRow[x] == 0)
+                {
+                    x++;
+                    continue;
+                }
+                
+                int runStart = x;
+                while (x < image1.cols && maskRow[x] != 0)
+                {
+                    x++;
+                }
+                sum += FrameDistance::sumSquaredDifference(image1.ptr<uchar>(y) + runStart, image2.ptr<uchar>(y) + runStart, x - runStart);
+            }
+        }
+    }
+    else if (image1.isContinuous() && image2.isContinuous())
+    {
+        //Whole frame in one go
+        sum = FrameDistance::sumSquaredDifference(image1.ptr<uchar>(0), image2.ptr<uchar>(0), (size_t)image1.rows * image1.cols);
+    }
+    else
+    {
+        //Row by row
+        for (int y=0; y<image1.rows; y++)
+        {
+            sum += FrameDistance::sumSquaredDifference(image1.ptr<uchar>(y), image2.ptr<uchar>(y), image1.cols);
+        }
+    }
+
+    return FrameDistance::distanceFromSumSquaredDifference(sum);
+}
+
+
+/**
+ * Loads the analysis mask from an image file the size of the video
+ * @param string file - pixels that aren't black are compared
+ */
+void VideoTexture::loadAnalysisMask(string file)
+{
+    cv::Mat mask = cv::imread(file, 0);
+    if (mask.empty())
+    {
+        throw string("Couldn't open mask " + file);
+    }
+    
+    this->setAnalysisMask(mask, file);
+}
+
+/**
+ * Sets the analysis mask
+ * @param const cv::Mat& mask - 8 bit, the size of the video
+ * @param string name - recorded in the cache metadata
+ */
+void VideoTexture::setAnalysisMask(const cv::Mat& mask, string name)
+{
+    if (mask.cols != this->width || mask.rows != this->height || mask.type() != CV_8UC1)
+    {
+        throw string("Mask " + name + " isn't an 8 bit greyscale image the size of the video");
+    }
+    
+    //Anything that isn't black is in
+    this->analysisMask = cv::Mat(mask.rows, mask.cols, CV_8UC1);
+    for (int y=0; y<mask.rows; y++)
+    {
+        const uchar* in = mask.ptr<uchar>(y);
+        uchar* out = this->analysisMask.ptr<uchar>(y);
+        for (int x=0; x<mask.cols; x++)
+        {
+            out[x] = (in[x] != 0) ? 255 : 0;
+        }
+    }
+    this->analysisMaskName = name;
+    
+    cv::Size analysisSize = this->getAnalysisSize();
+    this->maskOffsets = this->getMaskOffsets(analysisSize);
+    if (this->maskOffsets.empty())
+    {
+        throw string("Mask " + name + " is empty");
+    }
+    
+    cout << "Comparing " << this->maskOffsets.size() << " of " << analysisSize.width * analysisSize.height << " pixels" << endl;
+}
+
+/**
+ * Sets the analysis mask to a list of rectangles
+ * @param const vector<cv::Rect>& regions
+ */
+void VideoTexture::setAnalysisRegions(const vector<cv::Rect>& regions)
+{
+    cv::Mat mask = cv::Mat::zeros(this->height, this->width, CV_8UC1);
+    
+    stringstream name;
+    name << "regions";
+    for (size_t i=0; i<regions.size(); i++)
+    {
+        cv::Rect region = regions[i] & cv::Rect(0, 0, this->width, this->height);
+        mask(region).setTo(cv::Scalar(255));
+        name << " " << regions[i].x << "," << regions[i].y << "," << regions[i].width << "x" << regions[i].height;
+    }
+    
+    this->setAnalysisMask(mask, name.str());
+}
+
+/**
+ * Offsets of the masked pixels in a continuous frame of the given size
+ * The mask is scaled with nearest neighbour if the frames are a different size
+ */
+vector<int> VideoTexture::getMaskOffsets(cv::Size size)
+{
+    vector<int> offsets;
+    if (this->analysisMask.empty())
+    {
+        return offsets;
+    }
+    
+    cv::Mat mask = this->analysisMask;
+    if (size.width != mask.cols || size.height != mask.rows)
+    {
+        cv::resize(this->analysisMask, mask, size, 0, 0, cv::INTER_NEAREST);
+    }
+    
+    for (int y=0; y<mask.rows; y++)
+    {
+        const uchar* row = mask.ptr<uchar>(y);
+        for (int x=0; x<mask.cols; x++)
+        {
+            if (row[x] != 0)
+            {
+                offsets.push_back(y * mask.cols + x);
+            }
+        }
+    }
+    return offsets;
+}
+
+/**
+ * Gathers the masked pixels of a continuous frame
+ */
+static void packPixels(const uchar* frame, const vector<int>& offsets, uchar* packed)
+{
+    for (size_t i=0; i<offsets.size(); i++)
+    {
+        packed[i] = frame[offsets[i]];
+    }
+}
+
+/**
+ * Greyscale frame with everything outside the mask black, for the analysis that works on whole images
+ */
+cv::Mat VideoTexture::getMaskedGreyscaleFrame(int frame)
+{
+    if (this->analysisMask.empty())
+    {
+        return this->greyscaleFrames[frame];
+    }
+    
+    //The mask is the size of the video, the frame may have been scaled down
+    cv::Mat mask = this->analysisMask;
+    if (mask.size() != this->greyscaleFrames[frame].size())
+    {
+        cv::resize(this->analysisMask, mask, this->greyscaleFrames[frame].size(), 0, 0, cv::INTER_NEAREST);
+    }
+    
+    cv::Mat masked = cv::Mat::zeros(this->greyscaleFrames[frame].size(), CV_8UC1);
+    this->greyscaleFrames[frame].copyTo(masked, mask);
+    return masked;
+}
+
+
+/**
+ * Generates greyscale frames for analysis
+ */
+void VideoTexture::generateGreyscaleFrames()
+{
+    //loadVideo makes them while decoding
+    if (this->greyscaleFrames == NULL)
+    {
+        cout << "Generating greyscale frames" << endl;
+        
+        this->greyscaleFrames = new cv::Mat[this->frameCount];
+        
+        cv::Mat fullSize;
+        for (int i=0; i<this->frameCount; i++)
+        {
+            //Generate the greyscale frame
+            this->greyscaleFrames[i] = appendFrame(this->greyscaleStore, this->getAnalysisSize(), CV_8UC1);
+            this->makeAnalysisFrame(this->frames[i], this->greyscaleFrames[i], fullSize);
+        }
+    }
+    
+    //Gather the masked pixels of every frame once, so the distance kernels read them contiguously
+    if (!this->maskOffsets.empty())
+    {
+        this->packedFrames = cv::Mat(this->frameCount, (int)this->maskOffsets.size(), CV_8UC1);
+        for (int i=0; i<this->frameCount; i++)
+        {
+            if (!this->greyscaleFrames[i].isContinuous())
+            {
+                this->greyscaleFrames[i] = this->greyscaleFrames[i].clone();
+            }
+            packPixels(this->greyscaleFrames[i].ptr<uchar>(0), this->maskOffsets, this->packedFrames.ptr<uchar>(i));
+        }
+    }
+}
+
+/**
+ * Scale of the greyscale frames relative to the video
+ * A target pixel count wins over the scale
+ */
+double VideoTexture::getAnalysisScale()
+{
+    double scale = this->settings.analysisScale;
+    if (this->settings.analysisPixels > 0 && this->width > 0 && this->height > 0)
+    {
+        scale = sqrt((double)this->settings.analysisPixels / ((double)this->width * this->height));
+    }
+    return min(1.0, scale);
+}
+
+cv::Size VideoTexture::getAnalysisSize()
+{
+    double scale = this->getAnalysisScale();
+    if (scale == 1.0)
+    {
+        return cv::Size(this->width, this->height);
+    }
+    return cv::Size(max(1, (int)round(this->width * scale)), max(1, (int)round(this->height * scale)));
+}
+
+/**
+ * Same as cv::cvtColor(colour, greyscale, CV_RGB2GRAY), with the fixed point SIMD conversion for 8 bit colour frames
+ * greyscale is only allocated if it isn't already the right size
+ */
+static void convertToGreyscale(const cv::Mat& colour, cv::Mat& greyscale)
+{
+    if (colour.type() != CV_8UC3)
+    {
+        cv::cvtColor(colour, greyscale, CV_RGB2GRAY);
+        return;
+    }
+    
+    greyscale.create(colour.rows, colour.cols, CV_8UC1);
+    if (colour.isContinuous() && greyscale.isContinuous())
+    {
+        GreyscaleConversion::fromBGR(colour.ptr<uchar>(0), greyscale.ptr<uchar>(0), (size_t)colour.rows * colour.cols);
+        return;
+    }
+    
+    for (int y=0; y<colour.rows; y++)
+    {
+        GreyscaleConversion::fromBGR(colour.ptr<uchar>(y), greyscale.ptr<uchar>(y), colour.cols);
+    }
+}
+
+/**
+ * Converts a colour frame to greyscale and scales it down to the analysis size
+ * Area averaging, so every source pixel counts and small movements aren't aliased away
+ * The full size greyscale frame goes in fullSize, which callers keep between frames so it is only allocated once
+ * Safe to call from several threads at once, each with its own fullSize
+ */
+void VideoTexture::makeAnalysisFrame(const cv::Mat& colour, cv::Mat& greyscale, cv::Mat& fullSize)
+{
+    cv::Size analysisSize = this->getAnalysisSize();
+    if (analysisSize.width == colour.cols && analysisSize.height == colour.rows)
+    {
+        convertToGreyscale(colour, greyscale);
+        return;
+    }
+    
+    convertToGreyscale(colour, fullSize);
+    cv::resize(fullSize, greyscale, analysisSize, 0, 0, cv::INTER_AREA);
+}
+
+
+/**
+ * Pointer to the flattened pixels of a greyscale frame
+ */
+const uchar* VideoTexture::getAnalysisPixels(int frame)
+{
+    if (!this->packedFrames.empty())
+    {
+        return this->packedFrames.ptr<uchar>(frame);
+    }
+    return this->greyscaleFrames[frame].ptr<uchar>(0);
+}
+
+/**
+ * Number of pixels compared per frame
+ */
+size_t VideoTexture::getAnalysisLength()
+{
+    if (!this->packedFrames.empty())
+    {
+        return (size_t)this->packedFrames.cols;
+    }
+    return (size_t)this->greyscaleFrames[0].rows * this->greyscaleFrames[0].cols;
+}
+
+/**
+ * Calculate |a|^2 for every greyscale frame
+ */
+void VideoTexture::computeFrameNorms()
+{
+    size_t length = this->getAnalysisLength();
+    
+    //Called again whenever the frames change, eg. after an update or when another mode recomputes them
+    delete [] this->frameNorms;
+    this->frameNorms = new uint64_t[this->frameCount];
+    for (int i=0; i<this->frameCount; i++)
+    {
+        //The tiles read frames as one flat array
+        if (!this->greyscaleFrames[i].isContinuous())
+        {
+            this->greyscaleFrames[i] = this->greyscaleFrames[i].clone();
+        }
+        
+        const uchar* pixels = this->getAnalysisPixels(i);
+        this->frameNorms[i] = FrameDistance::dotProduct(pixels, pixels, length);
+    }
+}
+
+/**
+ * Dot products of every row frame with every column frame of a tile
+ * The dot products are accumulated a chunk of pixels at a time so that the chunk of every frame in the tile stays in cache,
+ * and two rows by two columns at a time so that every load is used twice.
+ * rowStart and colStart are the frame numbers of the first row and column. 2x2 blocks that are entirely on or below the
+ * diagonal are skipped, so tiles on the diagonal only do the upper half.
+ */
+static void computeTileDots(const uchar* const* rowPixels, const uchar* const* colPixels, int rowStart, int colStart, int numRows, int numCols, size_t length, uint64_t dots[][VideoTexture::distanceTileSize])
+{
+    for (int i=0; i<numRows; i++)
+    {
+        for (int j=0; j<numCols; j++)
+        {
+            dots[i][j] = 0;
+        }
+    }
+    
+    for (size_t offset=0; offset < length; offset += VideoTexture::distanceChunkSize)
+    {
+        size_t chunk = min((size_t)VideoTexture::distanceChunkSize, length - offset);
+        
+        for (int i=0; i<numRows; i+=2)
+        {
+            for (int j=0; j<numCols; j+=2)
+            {
+                //Skip 2x2 blocks entirely on or below the diagonal
+                if (colStart + j + 1 <= rowStart + i)
+                {
+                    continue;
+                }
+                
+                const uchar* a0 = rowPixels[i] + offset;
+                const uchar* b0 = colPixels[j] + offset;
+                
+                if (i + 1 < numRows && j + 1 < numCols)
+                {
+                    const uchar* a1 = rowPixels[i + 1] + offset;
+                    const uchar* b1 = colPixels[j + 1] + offset;
+                    
+                    uint64_t block[4];
+                    FrameDistance::dotProducts2x2(a0, a1, b0, b1, chunk, block);
+                    dots[i][j] += block[0];
+                    dots[i][j+1] += block[1];
+                    dots[i+1][j] += block[2];
+                    dots[i+1][j+1] += block[3];
+                }
+                else
+                {
+                    //Edge of an odd sized tile
+                    for (int ii=i; ii < min(i + 2, numRows); ii++)
+                    {
+                        for (int jj=j; jj < min(j + 2, numCols); jj++)
+                        {
+                            dots[ii][jj] += FrameDistance::dotProduct(rowPixels[ii] + offset, colPixels[jj] + offset, chunk);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Calculate one tile of the distance matrix using |a-b|^2 = |a|^2 + |b|^2 - 2a.b
+ * Only pairs with col > row are written (and mirrored), so tiles on the diagonal do the upper half.
+ */
+void VideoTexture::computeDistanceTile(int rowStart, int rowEnd, int colStart, int colEnd)
+{
+    const int tileSize = VideoTexture::distanceTileSize;
+    int numRows = rowEnd - rowStart;
+    int numCols = colEnd - colStart;
+    
+    const uchar* rowPixels[tileSize];
+    const uchar* colPixels[tileSize];
+    for (int i=0; i<numRows; i++)
+    {
+        rowPixels[i] = this->getAnalysisPixels(rowStart + i);
+    }
+    for (int j=0; j<numCols; j++)
+    {
+        colPixels[j] = this->getAnalysisPixels(colStart + j);
+    }
+    
+    uint64_t dots[tileSize][tileSize];
+    computeTileDots(rowPixels, colPixels, rowStart, colStart, numRows, numCols, this->getAnalysisLength(), dots);
+    
+    //Convert to distances and mirror into the lower triangle
+    for (int i=0; i<numRows; i++)
+    {
+        int row = rowStart + i;
+        for (int j=0; j<numCols; j++)
+        {
+            int col = colStart + j;
+            if (col <= row)
+            {
+                continue;
+            }
+            
+            uint64_t ssd = FrameDistance::sumSquaredDifferenceFromDot(this->frameNorms[row], this->frameNorms[col], dots[i][j]);
+            double distance = FrameDistance::distanceFromSumSquaredDifference(ssd);
+            this->frameDistanceMatrix[row][col] = distance;
+            this->frameDistanceMatrix[col][row] = distance;
+        }
+    }
+}
+
+
+/**
+ * Task that fills in one tile of the distance matrix
+ */
+class DistanceTileTask : public Task
+{
+public:
+    VideoTexture* videoTexture;
+    int rowStart, rowEnd, colStart, colEnd;
+    
+    DistanceTileTask(VideoTexture* videoTexture, int rowStart, int rowEnd, int colStart, int colEnd)
+    {
+        this->videoTexture = videoTexture;
+        this->rowStart = rowStart;
+        this->rowEnd = rowEnd;
+        this->colStart = colStart;
+        this->colEnd = colEnd;
+    }
+    
+    void run()
+    {
+        this->videoTexture->computeDistanceTile(this->rowStart, this->rowEnd, this->colStart, this->colEnd);
+    }
+};
+
+
+/**
+ * Generates the frame diff matrix and writes to a cache file
+ * @param string file
+ */
+void VideoTexture::generateFrameDistanceMatrix(string file)
+{
+    //A result for the same video content and settings is reused
+    if (file.empty())
+    {
+        file = this->getAnalysisCacheFile();
+        if (this->analysisCache->find(file))
+        {
+            cout << "Reusing frame distance matrix: " << file << endl;
+            this->analysisCache->setLatest(this->file, this->getAnalysisParameters(), DistanceCache::extension, file);
+            
+            //The pipeline deferred decoding and the frame cache is missing, decoding writes it for the next run
+            if (this->frameCount == 0 && !this->settings.frameCacheFile.empty())
+            {
+                this->decodeFrames();
+            }
+            return;
+        }
+        
+        //Only the frames that were appended are calculated if the video grew since its last result
+        if (this->adoptPreviousDistanceCache(file))
+        {
+            this->updateFrameDistanceMatrix(file);
+        }
+        else
+        {
+            this->generateFrameDistanceMatrix(file);
+        }
+        this->analysisCache->added(file);
+        this->analysisCache->setLatest(this->file, this->getAnalysisParameters(), DistanceCache::extension, file);
+        return;
+    }
+    
+    if (this->settings.pipeline && this->settings.distanceMode == DISTANCE_DENSE && this->settings.memoryBudget == 0 && this->greyscaleFrames == NULL)
+    {
+        this->pipelineFrameDistanceMatrix();
+        this->writeFrameDistanceMatrix(file);
+        return;
+    }
+    
+    //The pipeline defers decoding, the other modes need all of the frames up front
+    if (this->greyscaleFrames == NULL && this->settings.memoryBudget == 0)
+    {
+        this->decodeFrames();
+    }
+    
+    if (this->settings.memoryBudget > 0)
+    {
+        if (this->settings.distanceMode != DISTANCE_DENSE)
+        {
+            throw string("A memory budget is only supported for dense distance matrices");
+        }
+        this->streamFrameDistanceMatrix(file);
+        return;
+    }
+    
+    if (this->settings.distanceMode == DISTANCE_PYRAMID)
+    {
+        this->computeSparseFrameDistanceMatrix();
+        this->writeSparseFrameDistanceMatrix(file);
+        return;
+    }
+    
+    if (this->settings.distanceMode == DISTANCE_KNN)
+    {
+        this->computeNearestNeighbourDistanceMatrix();
+        this->writeSparseFrameDistanceMatrix(file);
+        return;
+    }
+    
+    if (this->settings.distanceMode == DISTANCE_HISTOGRAM)
+    {
+        this->computeHistogramDistanceMatrix();
+        this->writeFrameDistanceMatrix(file);
+        return;
+    }
+    
+    this->computeFrameDistanceMatrix();
+    this->writeFrameDistanceMatrix(file);
+}
+
+
+/**
+ * Calculates the frame distance matrix
+ * Each tile writes its own cells of the matrix with exact integer arithmetic, so the result is the same for any number of threads
+ */
+void VideoTexture::computeFrameDistanceMatrix()
+{
+    //First convert all frames to greyscale
+    this->generateGreyscaleFrames();
+    
+    //Initialize the arrays
+    this->frameDistanceMatrix = this->initMatrix(this->frameCount);
+    this->computeFrameNorms();
+    
+    this->computeFrameDistanceTiles(0);
+}
+
+
+/**
+ * Calculates the distances of every pair with at least one frame from firstNewFrame onwards,
+ * ie. the new columns of the old rows and all of the new rows (N*M + M^2 pairs for M new frames)
+ * The rest of the frameDistanceMatrix is left as it is.
+ * @param int firstNewFrame - 0 for the whole matrix
+ */
+void VideoTexture::computeFrameDistanceTiles(int firstNewFrame)
+{
+    ThreadPool pool(this->settings.numThreads);
+    cout << "Calculating frame distances on " << pool.getNumThreads() << " threads" << endl;
+    pool.setProgressLabel("Distance tiles");
+    
+    //The matrix is symmetric with a zero diagonal, so only the tiles on or above the diagonal are computed
+    int tileSize = VideoTexture::distanceTileSize;
+    for (int rowStart=0; rowStart < this->frameCount; rowStart += tileSize)
+    {
+        int rowEnd = min(rowStart + tileSize, this->frameCount);
+        for (int colStart=max(rowStart, firstNewFrame); colStart < this->frameCount; colStart += tileSize)
+        {
+            pool.add(new DistanceTileTask(this, rowStart, rowEnd, colStart, min(colStart + tileSize, this->frameCount)));
+        }
+    }
+    pool.wait();
+}
+
+
+/**
+ * Task that calculates one tile of a pair of streamed blocks
+ */
+class StreamTileTask : public Task
+{
+public:
+    const uchar* const* rowPixels;
+    const uchar* const* colPixels;
+    const uint64_t* rowNorms;
+    const uint64_t* colNorms;
+    int rowStart, colStart;     //Frame numbers of the first row and column
+    int numRows, numCols;
+    size_t length;
+    double* distances;          //Tile's top left corner in the block pair's distances
+    int stride;
+    double* mirror;             //Tile's top left corner in the transposed distances, NULL unless both blocks are the same
+    
+    void run()
+    {
+        uint64_t dots[VideoTexture::distanceTileSize][VideoTexture::distanceTileSize];
+        computeTileDots(this->rowPixels, this->colPixels, this->rowStart, this->colStart, this->numRows, this->numCols, this->length, dots);
+        
+        for (int i=0; i<this->numRows; i++)
+        {
+            for (int j=0; j<this->numCols; j++)
+            {
+                if (this->colStart + j <= this->rowStart + i)
+                {
+                    continue;
+                }
+                
+                uint64_t ssd = FrameDistance::sumSquaredDifferenceFromDot(this->rowNorms[i], this->colNorms[j], dots[i][j]);
+                double distance = FrameDistance::distanceFromSumSquaredDifference(ssd);
+                this->distances[i * this->stride + j] = distance;
+                if (this->mirror != NULL)
+                {
+                    this->mirror[j * this->stride + i] = distance;
+                }
+            }
+        }
+    }
+};
+
+
+/**
+ * Stores a block of distances through an accessor, which also fills in the mirrored pair
+ */
+struct StoreDistanceBlock
+{
+    const double* distances;    //numRows x numCols
+    int rowStart;
+    int colStart;
+    int numRows;
+    int numCols;
+    
+    template <class Distances>
+    void operator()(const Distances& matrix)
+    {
+        for (int i=0; i<this->numRows; i++)
+        {
+            for (int j=0; j<this->numCols; j++)
+            {
+                matrix.set(this->rowStart + i, this->colStart + j, this->distances[(size_t)i * this->numCols + j]);
+            }
+        }
+    }
+};
+
+/**
+ * Writes distances to a streamed cache as fixed width records
+ * @param fstream& outfile
+ * @param size_t record - index of the first record, ie. row * frameCount + col
+ * @param const double* values
+ * @param int count
+ * @param int step - distance between consecutive values
+ */
+static void writeStreamRecords(fstream& outfile, size_t record, const double* values, int count, int step)
+{
+    string buffer;
+    buffer.reserve(count * VideoTexture::streamRecordSize);
+    
+    char text[64];
+    for (int i=0; i<count; i++)
+    {
+        snprintf(text, sizeof(text), "%.10e\n", values[i * step]);
+        buffer += text;
+    }
+    
+    outfile.seekp(record * VideoTexture::streamRecordSize);
+    outfile.write(buffer.data(), buffer.size());
+}
+
+
+/**
+ * Calculates the dense frame distance matrix without holding the video in memory
+ * The frames are split into blocks. For every pair of blocks, the two blocks of (optionally downscaled) greyscale frames are
+ * the only frames in memory, and their distances are written straight into their place in the cache file.
+ * The block size is the largest that keeps two blocks, the distances between them and one decoded colour frame within
+ * settings.memoryBudget. Every block row seeks to its first block and decodes the rest of the video from there, so the
+ * video is decoded about (number of blocks)/2 times in total.
+ * @param string file
+ */
+void VideoTexture::streamFrameDistanceMatrix(string file)
+{
+    cv::Size analysisSize = this->getAnalysisSize();
+    vector<int> offsets = this->getMaskOffsets(analysisSize);
+    size_t length = offsets.empty() ? (size_t)analysisSize.width * analysisSize.height : offsets.size();
+    size_t colourFrame = (size_t)this->width * this->height * 3;
+    size_t budget = this->settings.memoryBudget;
+    
+    //Largest block that fits
+    int blockSize = 0;
+    if (budget > colourFrame)
+    {
+        size_t available = budget - colourFrame;
+        blockSize = (int)min((size_t)this->frameCount, available / (2 * (length + sizeof(uint64_t))));
+        while (blockSize > 0 && 2 * blockSize * (length + sizeof(uint64_t)) + (size_t)blockSize * blockSize * sizeof(double) > available)
+        {
+            blockSize--;
+        }
+    }
+    if (blockSize < 1)
+    {
+        throw string("Memory budget is too small to hold two frames");
+    }
+    
+    int numBlocks = (this->frameCount + blockSize - 1) / blockSize;
+    cout << "Streaming " << analysisSize.width << "x" << analysisSize.height << " frames in " << numBlocks << " blocks of " << blockSize << endl;
+    
+    //Binary caches are mapped and the distances stored straight into them, text caches are fixed width records
+    bool binary = DistanceCache::usesBinaryFormat(file);
+    DistanceCache cache;
+    vector<double*> cacheRows;
+    fstream outfile;
+    if (binary)
+    {
+        this->createDistanceCache(file, cache);
+        for (int i=0; !cache.isPacked() && !cache.isTiled() && i<this->frameCount; i++)
+        {
+            cacheRows.push_back(cache.row(i));
+        }
+    }
+    else
+    {
+        outfile.open(file.c_str(), ios::out | ios::binary);
+        if (!outfile.is_open())
+        {
+            throw string("Could not open " + file);
+        }
+        
+        //Size the file up front, every record gets written exactly once
+        size_t numRecords = (size_t)this->frameCount * this->frameCount;
+        outfile.seekp(numRecords * VideoTexture::streamRecordSize - 1);
+        outfile.put('\n');
+    }
+    
+    ThreadPool pool(this->settings.numThreads);
+    cout << "Calculating frame distances on " << pool.getNumThreads() << " threads" << endl;
+    
+    const int tileSize = VideoTexture::distanceTileSize;
+    vector<cv::Mat> rowBlock, colBlock;
+    vector<uint64_t> rowNorms, colNorms;
+    vector<const uchar*> rowPixels, colPixels;
+    vector<double> distances;
+    
+    for (int rowBlockIndex=0; rowBlockIndex < numBlocks; rowBlockIndex++)
+    {
+        int rowStart = rowBlockIndex * blockSize;
+        int numRows = min(blockSize, this->frameCount - rowStart);
+        
+        //Seek to the block
+        FrameRangeReader reader(this->file, this->settings.startFrame, this->settings.endFrame, this->settings.frameStride, rowStart);
+        if (!reader.isOpened())
+        {
+            throw string("Couldn't open file");
+        }
+        this->readStreamBlock(reader, numRows, offsets, rowBlock, rowNorms);
+        
+        rowPixels.resize(numRows);
+        for (int i=0; i<numRows; i++)
+        {
+            rowPixels[i] = rowBlock[i].ptr<uchar>(0);
+        }
+        
+        for (int colBlockIndex=rowBlockIndex; colBlockIndex < numBlocks; colBlockIndex++)
+        {
+            int colStart = colBlockIndex * blockSize;
+            int numCols = min(blockSize, this->frameCount - colStart);
+            bool diagonal = (colBlockIndex == rowBlockIndex);
+            
+            //The diagonal block pairs the row block with itself, later ones continue from where the reader is
+            if (!diagonal)
+            {
+                this->readStreamBlock(reader, numCols, offsets, colBlock, colNorms);
+            }
+            vector<cv::Mat>& cols = diagonal ? rowBlock : colBlock;
+            vector<uint64_t>& norms = diagonal ? rowNorms : colNorms;
+            
+            colPixels.resize(numCols);
+            for (int j=0; j<numCols; j++)
+            {
+                colPixels[j] = cols[j].ptr<uchar>(0);
+            }
+            
+            distances.assign((size_t)numRows * numCols, 0.0f);
+            
+            for (int i=0; i<numRows; i+=tileSize)
+            {
+                for (int j=(diagonal ? i : 0); j<numCols; j+=tileSize)
+                {
+                    StreamTileTask* task = new StreamTileTask();
+                    task->rowPixels = &rowPixels[i];
+                    task->colPixels = &colPixels[j];
+                    task->rowNorms = &rowNorms[i];
+                    task->colNorms = &norms[j];
+                    task->rowStart = rowStart + i;
+                    task->colStart = colStart + j;
+                    task->numRows = min(tileSize, numRows - i);
+                    task->numCols = min(tileSize, numCols - j);
+                    task->length = length;
+                    task->distances = &distances[(size_t)i * numCols + j];
+                    task->stride = numCols;
+                    task->mirror = diagonal ? &distances[(size_t)j * numCols + i] : NULL;
+                    pool.add(task);
+                }
+            }
+            pool.wait();
+            
+            if (binary)
+            {
+                StoreDistanceBlock store = {&distances[0], rowStart, colStart, numRows, numCols};
+                if (cache.isPacked())
+                {
+                    cache.packed().visit(store);
+                }
+                else if (cache.isTiled())
+                {
+                    store(cache.tiled());
+                }
+                else
+                {
+                    store(FullDistanceMatrix(&cacheRows[0]));
+                }
+            }
+            else
+            {
+                //Rows of the block pair, and for blocks off the diagonal the same distances again as columns
+                for (int i=0; i<numRows; i++)
+                {
+                    writeStreamRecords(outfile, (size_t)(rowStart + i) * this->frameCount + colStart, &distances[(size_t)i * numCols], numCols, 1);
+                }
+                if (!diagonal)
+                {
+                    for (int j=0; j<numCols; j++)
+                    {
+                        writeStreamRecords(outfile, (size_t)(colStart + j) * this->frameCount + rowStart, &distances[j], numRows, numCols);
+                    }
+                }
+            }
+            
+            cout << "Distance blocks: " << rowBlockIndex << "," << colBlockIndex << " of " << numBlocks << endl;
+        }
+    }
+    
+    if (binary)
+    {
+        cache.finish();
+        cout << "Wrote frame distance matrix to: " << file << endl;
+        return;
+    }
+    
+    if (!outfile.good())
+    {
+        throw string("Could not write " + file);
+    }
+    outfile.close();
+    
+    this->getCacheMetadata().save(CacheMetadata::sidecarFile(file));
+    
+    cout << "Wrote frame distance matrix to: " << file << endl;
+}
+
+
+/**
+ * Reads the next count frames of the range as greyscale analysis frames
+ * @param FrameRangeReader& reader
+ * @param int count
+ * @param const vector<int>& offsets - masked pixels to keep, empty for the whole frame
+ * @param vector<cv::Mat>& block - filled with the frames
+ * @param vector<uint64_t>& norms - filled with |a|^2 of each frame
+ */
+void VideoTexture::readStreamBlock(FrameRangeReader& reader, int count, const vector<int>& offsets, vector<cv::Mat>& block, vector<uint64_t>& norms)
+{
+    block.resize(count);
+    norms.resize(count);
+    
+    cv::Mat frame, fullSize, scaled;
+    for (int i=0; i<count; i++)
+    {
+        if (!reader.read(frame))
+        {
+            throw string("Video ended before the expected number of frames");
+        }
+        
+        this->makeAnalysisFrame(frame, scaled, fullSize);
+        
+        if (!offsets.empty())
+        {
+            block[i].create(1, (int)offsets.size(), CV_8UC1);
+            packPixels(scaled.ptr<uchar>(0), offsets, block[i].ptr<uchar>(0));
+        }
+        else
+        {
+            scaled.copyTo(block[i]);
+        }
+        
+        const uchar* pixels = block[i].ptr<uchar>(0);
+        norms[i] = FrameDistance::dotProduct(pixels, pixels, (size_t)block[i].rows * block[i].cols);
+    }
+}
+
+
+/**
+ * One frame on its way through the pipeline
+ */
+struct PipelineFrame
+{
+    cv::Mat colour;
+    cv::Mat greyscale;
+    cv::Mat analysis;       //Greyscale frame, or its packed masked pixels
+    uint64_t norm;
+    volatile int ready;     //Set once the converter is done with it
+};
+
+/**
+ * State shared by the decoder, the converters and the analysis
+ * Frames live in chunks that are never moved, so the other threads can read a frame while the decoder adds more.
+ */
+class FramePipeline
+{
+public:
+    static const int chunkSize = 1024;
+    static const int maxChunks = 4096;
+    
+    VideoTexture* videoTexture;
+    FrameRangeReader* reader;
+    RingBuffer<int>* decoded;   //Frame numbers waiting for conversion, -1 = stop
+    int numWorkers;
+    
+    PipelineFrame* chunks[maxChunks];
+    volatile int decodedFrames;
+    volatile int decodeFinished;
+    
+    FramePipeline()
+    {
+        this->reader = NULL;
+        this->decoded = NULL;
+        for (int c=0; c<maxChunks; c++)
+        {
+            this->chunks[c] = NULL;
+        }
+    }
+    
+    ~FramePipeline()
+    {
+        delete this->reader;
+        delete this->decoded;
+        for (int c=0; c<maxChunks; c++)
+        {
+            delete [] this->chunks[c];
+        }
+    }
+    
+    PipelineFrame& frame(int i)
+    {
+        return this->chunks[i / chunkSize][i % chunkSize];
+    }
+};
+
+/**
+ * Decoder thread
+ */
+static void* pipelineDecode(void* data)
+{
+    FramePipeline* pipeline = (FramePipeline*) data;
+    
+    cv::Mat frame;
+    int i = 0;
+    while (i < FramePipeline::chunkSize * FramePipeline::maxChunks && pipeline->reader->read(frame))
+    {
+        if (i % FramePipeline::chunkSize == 0)
+        {
+            pipeline->chunks[i / FramePipeline::chunkSize] = new PipelineFrame[FramePipeline::chunkSize];
+        }
+        
+        //The stores never move a frame, so the converters can fill in the greyscale frame while more are added
+        PipelineFrame& slot = pipeline->frame(i);
+        CompressedFrameStore* compressed = pipeline->videoTexture->compressedFrames;
+        if (compressed != NULL)
+        {
+            //Only kept until the converter is done with it
+            compressed->add(frame);
+            slot.colour = frame.clone();
+        }
+        else
+        {
+            slot.colour = appendFrame(pipeline->videoTexture->colourStore, frame.size(), frame.type());
+            frame.copyTo(slot.colour);    //Need to copy the actual frame, the capture reuses it
+        }
+        slot.greyscale = appendFrame(pipeline->videoTexture->greyscaleStore, pipeline->videoTexture->getAnalysisSize(), CV_8UC1);
+        slot.ready = 0;
+        
+        //Publishes the frame to the converters
+        pipeline->decoded->push(i);
+        
+        i++;
+        __sync_synchronize();
+        pipeline->decodedFrames = i;
+    }
+    
+    __sync_synchronize();
+    pipeline->decodeFinished = 1;
+    
+    for (int w=0; w<pipeline->numWorkers; w++)
+    {
+        pipeline->decoded->push(-1);
+    }
+    return NULL;
+}
+
+/**
+ * Converter thread, makes the greyscale and analysis frames
+ */
+static void* pipelineConvert(void* data)
+{
+    FramePipeline* pipeline = (FramePipeline*) data;
+    const vector<int>& offsets = pipeline->videoTexture->maskOffsets;
+    
+    int i;
+    cv::Mat fullSize;
+    while (true)
+    {
+        pipeline->decoded->pop(i);
+        if (i < 0)
+        {
+            break;
+        }
+        
+        PipelineFrame& slot = pipeline->frame(i);
+        pipeline->videoTexture->makeAnalysisFrame(slot.colour, slot.greyscale, fullSize);
+        if (pipeline->videoTexture->compressedFrames != NULL)
+        {
+            slot.colour.release();
+        }
+        
+        if (!offsets.empty())
+        {
+            slot.analysis.create(1, (int)offsets.size(), CV_8UC1);
+            packPixels(slot.greyscale.ptr<uchar>(0), offsets, slot.analysis.ptr<uchar>(0));
+        }
+        else
+        {
+            slot.analysis = slot.greyscale;
+        }
+        
+        const uchar* pixels = slot.analysis.ptr<uchar>(0);
+        slot.norm = FrameDistance::dotProduct(pixels, pixels, (size_t)slot.analysis.rows * slot.analysis.cols);
+        
+        __sync_synchronize();
+        slot.ready = 1;
+    }
+    return NULL;
+}
+
+/**
+ * Stops and joins the first started converters, for when the pipeline can't be started
+ */
+static void stopPipelineConverters(FramePipeline* pipeline, vector<pthread_t>& workers, int started)
+{
+    for (int w=0; w<started; w++)
+    {
+        pipeline->decoded->push(-1);
+    }
+    for (int w=0; w<started; w++)
+    {
+        pthread_join(workers[w], NULL);
+    }
+}
+
+/**
+ * Task that calculates one tile between frames that are already in the pipeline and the newest frames
+ */
+class PipelineTileTask : public Task
+{
+public:
+    const uchar* const* pixels;
+    const uint64_t* norms;
+    double** columns;           //columns[c][r] = distance for r < c
+    int rowStart, rowEnd, colStart, colEnd;
+    size_t length;
+    
+    void run()
+    {
+        int numRows = this->rowEnd - this->rowStart;
+        int numCols = this->colEnd - this->colStart;
+        
+        uint64_t dots[VideoTexture::distanceTileSize][VideoTexture::distanceTileSize];
+        computeTileDots(this->pixels + this->rowStart, this->pixels + this->colStart, this->rowStart, this->colStart, numRows, numCols, this->length, dots);
+        
+        for (int i=0; i<numRows; i++)
+        {
+            int row = this->rowStart + i;
+            for (int j=0; j<numCols; j++)
+            {
+                int col = this->colStart + j;
+                if (col <= row)
+                {
+                    continue;
+                }
+                
+                uint64_t ssd = FrameDistance::sumSquaredDifferenceFromDot(this->norms[row], this->norms[col], dots[i][j]);
+                this->columns[col][row] = FrameDistance::distanceFromSumSquaredDifference(ssd);
+            }
+        }
+    }
+};
+
+/**
+ * Calculates the dense frame distance matrix while the video is still being decoded
+ * A decoder thread feeds frame numbers through a lock free ring to settings.pipelineWorkers converter threads.
+ * Meanwhile this thread waits for the next run of converted frames and compares them against every frame before
+ * them on the thread pool, so decoding and analysis overlap and the total time heads towards the slower of the two.
+ * Leaves frames, greyscaleFrames, frameNorms and frameDistanceMatrix the same as loading and then computing.
+ */
+void VideoTexture::pipelineFrameDistanceMatrix()
+{
+    FramePipeline* pipeline = new FramePipeline();
+    pipeline->videoTexture = this;
+    pipeline->numWorkers = max(1, this->settings.pipelineWorkers);
+    pipeline->decoded = new RingBuffer<int>(max(2, this->settings.pipelineDepth));
+    pipeline->decodedFrames = 0;
+    pipeline->decodeFinished = 0;
+    
+    pipeline->reader = new FrameRangeReader(this->file, this->settings.startFrame, this->settings.endFrame, this->settings.frameStride);
+    if (!pipeline->reader->isOpened())
+    {
+        delete pipeline;
+        throw string("Couldn't open file");
+    }
+    
+    if (!this->settings.colourFrameEncoding.empty())
+    {
+        this->compressedFrames = new CompressedFrameStore(this->settings.colourFrameEncoding, (size_t)this->settings.colourCacheMegabytes * 1024 * 1024, this->settings.numThreads);
+    }
+    
+    ThreadPool pool(this->settings.numThreads);
+    cout << "Decoding and calculating frame distances on " << pool.getNumThreads() << " threads" << endl;
+    
+    //Workers first, so the decoder always has someone to send its stop values to
+    //If a thread can't be started, the ones that were are sent their stop values and joined before the pipeline goes
+    pthread_t decoder;
+    vector<pthread_t> workers(pipeline->numWorkers);
+    for (int w=0; w<pipeline->numWorkers; w++)
+    {
+        if (pthread_create(&workers[w], NULL, pipelineConvert, pipeline) != 0)
+        {
+            stopPipelineConverters(pipeline, workers, w);
+            delete pipeline;
+            throw string("Couldn't start converter thread");
+        }
+    }
+    if (pthread_create(&decoder, NULL, pipelineDecode, pipeline) != 0)
+    {
+        stopPipelineConverters(pipeline, workers, pipeline->numWorkers);
+        delete pipeline;
+        throw string("Couldn't start decoder thread");
+    }
+    
+    //The matrix grows a column per frame, column c holds the distances to the frames before c
+    const int tileSize = VideoTexture::distanceTileSize;
+    vector<const uchar*> pixels;
+    vector<uint64_t> norms;
+    vector<double*> columns;
+    size_t length = 0;
+    int done = 0;
+    
+    while (true)
+    {
+        int finished = pipeline->decodeFinished;
+        __sync_synchronize();
+        int available = pipeline->decodedFrames;
+        
+        int ready = done;
+        while (ready < available && pipeline->frame(ready).ready)
+        {
+            ready++;
+        }
+        __sync_synchronize();
+        
+        bool last = finished && ready == available;
+        if (ready - done < tileSize && !(last && ready > done))
+        {
+            if (last)
+            {
+                break;
+            }
+            usleep(1000);
+            continue;
+        }
+        
+        //Add the new frames
+        for (int i=done; i<ready; i++)
+        {
+            PipelineFrame& slot = pipeline->frame(i);
+            pixels.push_back(slot.analysis.ptr<uchar>(0));
+            norms.push_back(slot.norm);
+            columns.push_back(new double[i + 1]);
+            columns[i][i] = 0.0f;
+        }
+        length = (size_t)pipeline->frame(0).analysis.rows * pipeline->frame(0).analysis.cols;
+        
+        //Every earlier frame against the new ones
+        for (int rowStart=0; rowStart < ready; rowStart += tileSize)
+        {
+            for (int colStart=done; colStart < ready; colStart += tileSize)
+            {
+                int colEnd = min(colStart + tileSize, ready);
+                if (colEnd - 1 <= rowStart)
+                {
+                    continue;
+                }
+                
+                PipelineTileTask* task = new PipelineTileTask();
+                task->pixels = &pixels[0];
+                task->norms = &norms[0];
+                task->columns = &columns[0];
+                task->rowStart = rowStart;
+                task->rowEnd = min(rowStart + tileSize, ready);
+                task->colStart = colStart;
+                task->colEnd = colEnd;
+                task->length = length;
+                pool.add(task);
+            }
+        }
+        pool.wait();
+        
+        done = ready;
+        cout << "Frames compared: " << done << endl;
+    }
+    
+    pthread_join(decoder, NULL);
+    for (int w=0; w<pipeline->numWorkers; w++)
+    {
+        pthread_join(workers[w], NULL);
+    }
+    delete pipeline->reader;
+    pipeline->reader = NULL;
+    
+    //Hand everything over, the frames are views of the stores
+    this->frameCount = done;
+    cout << "Number of real frames in sequence: " << this->frameCount << endl;
+    
+    if (this->compressedFrames != NULL)
+    {
+        this->compressedFrames->finish();
+    }
+    else
+    {
+        this->frames = new cv::Mat[this->frameCount];
+    }
+    this->greyscaleFrames = new cv::Mat[this->frameCount];
+    delete [] this->frameNorms;
+    this->frameNorms = new uint64_t[this->frameCount];
+    for (int i=0; i<this->frameCount; i++)
+    {
+        PipelineFrame& slot = pipeline->frame(i);
+        if (this->frames != NULL)
+        {
+            this->frames[i] = slot.colour;
+        }
+        this->greyscaleFrames[i] = slot.greyscale;
+        this->frameNorms[i] = slot.norm;
+    }
+    
+    //Column i becomes row i, last to first, so the rows after it already hold the rest of it and it can be freed
+    //straight away. At most the N^2 matrix is alive at once, not the matrix and every column.
+    this->frameDistanceMatrix = new double*[this->frameCount];
+    for (int i=this->frameCount-1; i>=0; i--)
+    {
+        double* row = new double[this->frameCount];
+        memcpy(row, columns[i], (i + 1) * sizeof(double));
+        delete [] columns[i];
+        for (int j=i+1; j<this->frameCount; j++)
+        {
+            row[j] = this->frameDistanceMatrix[j][i];
+        }
+        this->frameDistanceMatrix[i] = row;
+    }
+    
+    //Packs the masked pixels into packedFrames, the greyscale frames already exist
+    if (!this->maskOffsets.empty())
+    {
+        this->generateGreyscaleFrames();
+    }
+    
+    delete pipeline;
+    
+    if (!this->settings.frameCacheFile.empty())
+    {
+        this->writeFrameCache();
+    }
+}
+
+
+/**
+ * Brings a cache up to date with the video
+ * If the metadata shows that the cache covers the first frames of this video with the same analysis, only the pairs
+ * involving the new frames are calculated and merged in. Otherwise the whole cache is generated again.
+ * Sparse caches are always generated again, their pruning depends on every row.
+ * @param string file
+ */
+void VideoTexture::updateFrameDistanceMatrix(string file)
+{
+    CacheMetadata cached;
+    
+    //The frames aren't in memory when streaming
+    if (this->settings.memoryBudget > 0)
+    {
+        this->generateFrameDistanceMatrix(file);
+        return;
+    }
+    
+    if (!this->loadCacheMetadata(file, cached))
+    {
+        cout << "No metadata for " << file << ", generating the whole cache" << endl;
+        this->generateFrameDistanceMatrix(file);
+        return;
+    }
+    
+    //The pipeline defers decoding, the frames have to be counted before they can be compared with the cache
+    if (this->frameCount == 0)
+    {
+        this->decodeFrames();
+    }
+    
+    CacheMetadata current = this->getCacheMetadata();
+    int cachedFrames = (int)cached.getInt("frames");
+    if (this->settings.distanceMode != DISTANCE_DENSE
+        || cached.get("mode") != current.get("mode")
+        || cached.get("width") != current.get("width")
+        || cached.get("height") != current.get("height")
+        || cached.get("analysisWidth") != current.get("analysisWidth")
+        || cached.get("analysisHeight") != current.get("analysisHeight")
+        || cached.has("streamScale")    //Older caches only recorded the scale of streamed frames
+        || cached.get("maskHash") != current.get("maskHash")
+        || cached.get("duplicateThreshold") != current.get("duplicateThreshold")
+        || cached.get("startFrame") != current.get("startFrame")
+        || cached.get("endFrame") != current.get("endFrame")
+        || cached.get("frameStride") != current.get("frameStride")
+        || cachedFrames <= 0 || cachedFrames > this->frameCount)
+    {
+        cout << "Cache " << file << " doesn't match this video, generating the whole cache" << endl;
+        this->generateFrameDistanceMatrix(file);
+        return;
+    }
+    
+    if (this->greyscaleFrames == NULL)
+    {
+        this->decodeFrames();
+    }
+    this->generateGreyscaleFrames();
+    this->computeFrameNorms();
+    
+    //The last cached frame has to be the same frame, otherwise the footage changed rather than grew
+    //Older caches only recorded the squared norm of the frame
+    stringstream lastNorm;
+    lastNorm << this->frameNorms[cachedFrames - 1];
+    if ((cached.has("lastFrameHash") && cached.get("lastFrameHash") != hashImage(this->greyscaleFrames[cachedFrames - 1]))
+        || (cached.has("lastFrameNorm") && cached.get("lastFrameNorm") != lastNorm.str()))
+    {
+        cout << "Frame " << cachedFrames - 1 << " changed since " << file << " was generated, generating the whole cache" << endl;
+        this->frameDistanceMatrix = this->initMatrix(this->frameCount);
+        this->computeFrameDistanceTiles(0);
+        this->writeFrameDistanceMatrix(file);
+        return;
+    }
+    
+    if (cachedFrames == this->frameCount)
+    {
+        cout << file << " is up to date" << endl;
+        return;
+    }
+    
+    cout << "Extending " << file << " from " << cachedFrames << " to " << this->frameCount << " frames" << endl;
+    
+    this->frameDistanceMatrix = this->initMatrix(this->frameCount);
+    this->readFrameDistanceMatrix(file, cachedFrames);
+    
+    this->computeFrameDistanceTiles(cachedFrames);
+    this->writeFrameDistanceMatrix(file);
+}
+
+
+/**
+ * Metadata for a cache generated from this video
+ */
+CacheMetadata VideoTexture::getCacheMetadata()
+{
+    CacheMetadata metadata;
+    metadata.set("mode", distanceModeName(this->settings.distanceMode));
+    metadata.setInt("frames", this->frameCount);
+    metadata.setInt("width", this->width);
+    metadata.setInt("height", this->height);
+    
+    //Size the frames were compared at, when they were scaled down
+    if (this->getAnalysisScale() != 1.0)
+    {
+        cv::Size analysisSize = this->getAnalysisSize();
+        metadata.setDouble("analysisScale", this->getAnalysisScale());
+        metadata.setInt("analysisWidth", analysisSize.width);
+        metadata.setInt("analysisHeight", analysisSize.height);
+    }
+    
+    //Only part of the video was loaded, frame numbers in the cache count from startFrame in steps of frameStride
+    if (this->settings.startFrame > 0 || this->settings.endFrame >= 0 || this->settings.frameStride > 1)
+    {
+        metadata.setInt("startFrame", max(0, this->settings.startFrame));
+        metadata.setInt("endFrame", max(-1, this->settings.endFrame));
+        metadata.setInt("frameStride", max(1, this->settings.frameStride));
+    }
+    
+    //Frames were collapsed, so frame numbers in the cache aren't frame numbers in the video
+    if (this->settings.collapseDuplicates)
+    {
+        metadata.setDouble("duplicateThreshold", this->settings.duplicateThreshold);
+        metadata.setInt("sourceFrames", this->getSourceFrameCount());
+    }
+    
+    //The mask, and a fingerprint of its pixels so a changed mask file is noticed
+    if (!this->analysisMask.empty())
+    {
+        metadata.set("mask", this->analysisMaskName);
+        metadata.set("maskHash", hashImage(this->analysisMask));
+        metadata.setInt("maskPixels", this->maskOffsets.size());
+    }
+    
+    //Fingerprint of the pixels of the last frame, so an update can tell that the cached frames are still the same
+    if (this->greyscaleFrames != NULL && this->frameCount > 0)
+    {
+        metadata.set("lastFrameHash", hashImage(this->greyscaleFrames[this->frameCount - 1]));
+    }
+    
+    return metadata;
+}
+
+
+/**
+ * Copies the upper triangle of a full matrix into packed or tiled distances
+ */
+struct PackDistances
+{
+    double** matrix;
+    int count;
+    
+    template <class Distances>
+    void operator()(const Distances& packed)
+    {
+        for (int row=0; row < this->count; row++)
+        {
+            for (int col=row+1; col < this->count; col++)
+            {
+                packed.set(row, col, this->matrix[row][col]);
+            }
+        }
+    }
+};
+
+/**
+ * Largest distance of packed distances
+ */
+struct LargestDistance
+{
+    double largest;
+    
+    template <class Distances>
+    void operator()(const Distances& distances)
+    {
+        this->largest = distances.max();
+    }
+};
+
+static double largestDistance(double** matrix, int count)
+{
+    double largest = 0.0;
+    for (int row=0; row < count; row++)
+    {
+        for (int col=0; col < count; col++)
+        {
+            largest = max(largest, matrix[row][col]);
+        }
+    }
+    return largest;
+}
+
+
+/**
+ * Parameters the distances depend on
+ * The cache metadata without what is found by the analysis itself, plus the settings of the distance mode
+ */
+CacheMetadata VideoTexture::getAnalysisParameters()
+{
+    CacheMetadata parameters = this->getCacheMetadata();
+    parameters.values.erase("frames");
+    parameters.values.erase("sourceFrames");
+    parameters.values.erase("lastFrameHash");
+    parameters.values.erase("mask");    //Only the name, maskHash is the mask itself
+    parameters.values.erase("maskPixels");
+    
+    switch (this->settings.distanceMode)
+    {
+        case DISTANCE_PYRAMID:
+            parameters.setInt("pyramidLevels", this->settings.pyramidLevels);
+            parameters.setDouble("pyramidQuantile", this->settings.pyramidQuantile);
+            parameters.setDouble("pyramidThreshold", this->settings.pyramidThreshold);
+            break;
+        case DISTANCE_KNN:
+            parameters.setInt("knnNeighbours", this->settings.knnNeighbours);
+            parameters.setInt("knnOversampling", this->settings.knnOversampling);
+            parameters.setInt("knnFeatureWidth", this->settings.knnFeatureWidth);
+            parameters.setInt("knnDimensions", this->settings.knnDimensions);
+            break;
+        case DISTANCE_HISTOGRAM:
+            parameters.setInt("histogramColorReduction", this->settings.histogramColorReduction);
+            break;
+        default:
+            break;
+    }
+    
+    if (this->usesPackedDistances())
+    {
+        parameters.setInt("distanceElement", this->settings.distanceElement);
+    }
+    
+    return parameters;
+}
+
+
+/**
+ * Distance cache for this video and settings in the analysis cache
+ */
+string VideoTexture::getAnalysisCacheFile()
+{
+    if (this->analysisCache == NULL)
+    {
+        throw string("No cache file given and settings.analysisCacheDirectory isn't set");
+    }
+    return this->analysisCache->file(this->file, this->getAnalysisParameters(), DistanceCache::extension);
+}
+
+
+/**
+ * Finds an earlier dense result for this video: the latest one for its path, which was generated before frames were
+ * appended, or a .vtd or .txt cache named after the video from before the analysis cache. A binary one is moved to
+ * file and a text one is converted, updateFrameDistanceMatrix then checks that it really is the start of this video.
+ * @param string file
+ */
+bool VideoTexture::adoptPreviousDistanceCache(string file)
+{
+    if (this->settings.distanceMode != DISTANCE_DENSE || this->settings.memoryBudget > 0)
+    {
+        return false;
+    }
+    
+    string previous = this->analysisCache->latest(this->file, this->getAnalysisParameters(), DistanceCache::extension);
+    if (previous.empty() || previous == file)
+    {
+        previous = this->analysisCache->legacyFile(this->file, DistanceCache::extension);
+    }
+    if (DistanceCache::isDistanceCache(previous))
+    {
+        cout << "Extending " << previous << " as " << file << endl;
+        return rename(previous.c_str(), file.c_str()) == 0;
+    }
+    
+    //Text caches could only be checked against the video if they had metadata
+    string textCache = this->analysisCache->legacyFile(this->file, ".txt");
+    if (CacheMetadata().load(CacheMetadata::sidecarFile(textCache)))
+    {
+        cout << "Converting " << textCache << " to " << file << endl;
+        DistanceCache::convertTextCache(textCache, file, this->file);
+        return true;
+    }
+    
+    return false;
+}
+
+
+/**
+ * Metadata of an existing cache
+ * @param string file
+ * @param CacheMetadata& metadata
+ */
+bool VideoTexture::loadCacheMetadata(string file, CacheMetadata& metadata)
+{
+    if (DistanceCache::isDistanceCache(file))
+    {
+        DistanceCache cache;
+        if (!cache.open(file))
+        {
+            return false;
+        }
+        metadata = cache.metadata;
+        return true;
+    }
+    return metadata.load(CacheMetadata::sidecarFile(file));
+}
+
+
+/**
+ * Makes a binary cache for the frameDistanceMatrix, described by the same metadata a text cache has in its sidecar
+ * @param string file
+ * @param DistanceCache& cache
+ */
+void VideoTexture::createDistanceCache(string file, DistanceCache& cache, double largestDistance)
+{
+    cv::Size analysisSize = this->getAnalysisSize();
+    
+    DistanceCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.frameCount = this->frameCount;
+    header.rows = this->frameCount;
+    header.cols = this->frameCount;
+    strncpy(header.metric, distanceModeName(this->settings.distanceMode), sizeof(header.metric) - 1);
+    header.analysisScale = this->getAnalysisScale();
+    header.analysisWidth = analysisSize.width;
+    header.analysisHeight = analysisSize.height;
+    header.layout = DistanceCache::LAYOUT_FULL;
+    header.elementType = ELEMENT_FLOAT64;
+    header.elementScale = 1.0;
+    
+    if (this->usesTiledCache())
+    {
+        header.layout = DistanceCache::LAYOUT_TILED;
+        header.tileSize = this->settings.cacheTileSize;
+    }
+    else if (!DistanceCache::isSymmetricMetric(header.metric) && (this->settings.packedDistances || this->settings.cacheTileSize > 0))
+    {
+        cout << header.metric << " distances aren't symmetric, storing all of them row by row" << endl;
+    }
+    else if (this->settings.packedDistances)
+    {
+        header.layout = DistanceCache::LAYOUT_PACKED_UPPER;
+        header.elementType = this->settings.distanceElement;
+        if (this->settings.distanceElement == ELEMENT_UINT16 && largestDistance > 0.0)
+        {
+            header.elementScale = largestDistance;
+        }
+        else if (this->settings.distanceElement == ELEMENT_UINT16)
+        {
+            cout << "The largest distance isn't known up front, storing float16 distances instead of uint16" << endl;
+            header.elementType = ELEMENT_FLOAT16;
+        }
+    }
+    
+    cache.create(file, this->file, header, this->getCacheMetadata());
+}
+
+
+/**
+ * Only symmetric distances are packed or tiled, both keep D[i][j] for i < j and read it back for D[j][i]
+ */
+bool VideoTexture::usesPackedDistances()
+{
+    return this->settings.packedDistances && this->settings.cacheTileSize == 0
+        && DistanceCache::isSymmetricMetric(distanceModeName(this->settings.distanceMode));
+}
+
+bool VideoTexture::usesTiledCache()
+{
+    return this->settings.cacheTileSize > 0 && DistanceCache::isSymmetricMetric(distanceModeName(this->settings.distanceMode));
+}
+
+
+/**
+ * Writes the frame distance matrix to a cache file
+ * Files named *.vtd are written as a binary DistanceCache, anything else as text with a .meta sidecar
+ * @param string file
+ */
+void VideoTexture::writeFrameDistanceMatrix(string file)
+{
+    //The metadata goes inside binary caches, there is no sidecar
+    if (DistanceCache::usesBinaryFormat(file))
+    {
+        DistanceCache cache;
+        PackDistances pack = {this->frameDistanceMatrix, this->frameCount};
+        if (this->usesTiledCache())
+        {
+            this->createDistanceCache(file, cache);
+            pack(cache.tiled());
+        }
+        else if (this->usesPackedDistances())
+        {
+            this->createDistanceCache(file, cache, largestDistance(this->frameDistanceMatrix, this->frameCount));
+            cache.packed().visit(pack);
+        }
+        else
+        {
+            this->createDistanceCache(file, cache);
+            for (int row=0; row < this->frameCount; row++)
+            {
+                memcpy(cache.row(row), this->frameDistanceMatrix[row], this->frameCount * sizeof(double));
+            }
+        }
+        cache.finish();
+        
+        cout << "Wrote frame distance matrix to: " << file << endl;
+        return;
+    }
+    
+    //Open the file handler to write
+    fstream outfile;
+    outfile.open(file.c_str(), ios::out);
+    
+    if (!outfile.is_open())
+    {
+        throw string("Could not open " + file);
+    }
+    
+    //Write distances to file
+    for (int row=0; row < this->frameCount; row++)
+    {
+        
+        for (int col=0; col < this->frameCount; col++)
+        { 
+            outfile << this->frameDistanceMatrix[row][col] << endl;
+        }
+    }    
+    
+    //Close the file handler
+    outfile.close();
+    
+    this->getCacheMetadata().save(CacheMetadata::sidecarFile(file));
+    
+    cout << "Wrote frame distance matrix to: " << file << endl;
+    
+}
+
+
+/**
+ * Task that fills in one row of the sparse distance matrix
+ */
+class SparseDistanceRowTask : public Task
+{
+public:
+    VideoTexture* videoTexture;
+    int row;
+    cv::Mat* coarseFrames;
+    double coarseScale;
+    double* largest;
+    
+    SparseDistanceRowTask(VideoTexture* videoTexture, int row, cv::Mat* coarseFrames, double coarseScale, double* largest)
+    {
+        this->videoTexture = videoTexture;
+        this->row = row;
+        this->coarseFrames = coarseFrames;
+        this->coarseScale = coarseScale;
+        this->largest = largest;
+    }
+    
+    void run()
+    {
+        this->largest[this->row] = this->videoTexture->computeSparseDistanceRow(this->row, this->coarseFrames, this->coarseScale);
+    }
+};
+
+
+/**
+ * Calculates the sparse frame distance matrix coarse to fine
+ * Every pair is compared on a heavily downsampled pyramid level, and only the pairs that come out closest
+ * (settings.pyramidQuantile of each row, or under settings.pyramidThreshold) are compared again at full resolution.
+ */
+void VideoTexture::computeSparseFrameDistanceMatrix()
+{
+    this->generateGreyscaleFrames();
+    this->computeFrameNorms();
+    
+    //Build the coarse level of every frame
+    cout << "Building pyramid level " << this->settings.pyramidLevels << endl;
+    cv::Mat* coarseFrames = new cv::Mat[this->frameCount];
+    for (int i=0; i<this->frameCount; i++)
+    {
+        cv::Mat level = this->getMaskedGreyscaleFrame(i);
+        for (int l=0; l<this->settings.pyramidLevels; l++)
+        {
+            cv::Mat next;
+            cv::pyrDown(level, next);
+            level = next;
+        }
+        coarseFrames[i] = level;
+    }
+    
+    //A coarse distance covers fewer pixels, so scale it back up to be comparable with full resolution distances
+    //(a masked area shrinks by the same factor)
+    double coarseScale = sqrt((double)(this->greyscaleFrames[0].rows * this->greyscaleFrames[0].cols) / (double)(coarseFrames[0].rows * coarseFrames[0].cols));
+    
+    this->sparseFrameDistanceMatrix = new SparseMatrix(this->frameCount);
+    
+    ThreadPool pool(this->settings.numThreads);
+    cout << "Calculating coarse to fine frame distances on " << pool.getNumThreads() << " threads" << endl;
+    pool.setProgressLabel("Distance rows");
+    vector<double> largest(this->frameCount);
+    for (int row=0; row < this->frameCount; row++)
+    {
+        pool.add(new SparseDistanceRowTask(this, row, coarseFrames, coarseScale, &largest[0]));
+    }
+    pool.wait();
+    
+    delete [] coarseFrames;
+    
+    //Normalizing by the largest kept distance would stretch the distances, most of the far pairs were pruned
+    this->sparseFrameDistanceMatrix->largestValue = *max_element(largest.begin(), largest.end());
+    
+    size_t entries = this->sparseFrameDistanceMatrix->numEntries();
+    cout << "Refined " << entries << " of " << (size_t)this->frameCount * this->frameCount << " pairs at full resolution" << endl;
+}
+
+
+/**
+ * Calculates one row of the sparse distance matrix
+ * @param int row
+ * @param cv::Mat* coarseFrames - pyramid level of every frame
+ * @param double coarseScale - converts coarse distances to full resolution units
+ */
+double VideoTexture::computeSparseDistanceRow(int row, cv::Mat* coarseFrames, double coarseScale)
+{
+    size_t coarseLength = (size_t)coarseFrames[0].rows * coarseFrames[0].cols;
+    size_t length = this->getAnalysisLength();
+    
+    //Coarse distances to every frame
+    vector<double> coarseRow(this->frameCount);
+    for (int col=0; col < this->frameCount; col++)
+    {
+        uint64_t ssd = FrameDistance::sumSquaredDifference(coarseFrames[row].ptr<uchar>(0), coarseFrames[col].ptr<uchar>(0), coarseLength);
+        coarseRow[col] = FrameDistance::distanceFromSumSquaredDifference(ssd) * coarseScale;
+    }
+    
+    //Cut off at the quantile, or the threshold if that lets more through
+    int keep = max(1, (int)ceil(this->settings.pyramidQuantile * this->frameCount));
+    keep = min(keep, this->frameCount);
+    vector<double> sorted(coarseRow);
+    nth_element(sorted.begin(), sorted.begin() + (keep - 1), sorted.end());
+    double cutoff = max(sorted[keep - 1], this->settings.pyramidThreshold);
+    
+    //Refine the candidates at full resolution
+    vector<SparseEntry> entries;
+    double largest = *max_element(coarseRow.begin(), coarseRow.end());
+    for (int col=0; col < this->frameCount; col++)
+    {
+        if (col != row && coarseRow[col] > cutoff)
+        {
+            continue;
+        }
+        
+        SparseEntry entry;
+        entry.col = col;
+        entry.value = 0.0f;
+        if (col != row)
+        {
+            uint64_t ssd = FrameDistance::sumSquaredDifference(this->getAnalysisPixels(row), this->getAnalysisPixels(col), length);
+            entry.value = FrameDistance::distanceFromSumSquaredDifference(ssd);
+        }
+        largest = max(largest, entry.value);
+        entries.push_back(entry);
+    }
+    
+    this->sparseFrameDistanceMatrix->setRow(row, entries);
+    return largest;
+}
+
+
+/**
+ * Task that fills in one row of the nearest neighbour distance matrix
+ */
+class NearestNeighbourRowTask : public Task
+{
+public:
+    VideoTexture* videoTexture;
+    int row;
+    const int* candidates;
+    int numCandidates;
+    double* largest;
+    
+    NearestNeighbourRowTask(VideoTexture* videoTexture, int row, const int* candidates, int numCandidates, double* largest)
+    {
+        this->videoTexture = videoTexture;
+        this->row = row;
+        this->candidates = candidates;
+        this->numCandidates = numCandidates;
+        this->largest = largest;
+    }
+    
+    void run()
+    {
+        this->largest[this->row] = this->videoTexture->computeNearestNeighbourRow(this->row, this->candidates, this->numCandidates);
+    }
+};
+
+
+/**
+ * Calculates the sparse frame distance matrix from the k nearest neighbours of each frame
+ * Each frame is downsampled and projected onto its main PCA components. A kd-tree over the projections
+ * gives approximate candidates, which are then compared exactly at full resolution and the best
+ * settings.knnNeighbours are kept. Memory is O(N*k) instead of O(N^2).
+ */
+void VideoTexture::computeNearestNeighbourDistanceMatrix()
+{
+    this->generateGreyscaleFrames();
+    this->computeFrameNorms();
+    
+    //Downsampled feature vector of every frame, one per row
+    int featureWidth = min(this->settings.knnFeatureWidth, this->greyscaleFrames[0].cols);
+    int featureHeight = max(1, (int)round((double)featureWidth * this->greyscaleFrames[0].rows / this->greyscaleFrames[0].cols));
+    cout << "Building " << featureWidth << "x" << featureHeight << " feature vectors" << endl;
+    
+    cv::Mat features(this->frameCount, featureWidth * featureHeight, CV_32F);
+    for (int i=0; i<this->frameCount; i++)
+    {
+        cv::Mat small;
+        cv::resize(this->getMaskedGreyscaleFrame(i), small, cv::Size(featureWidth, featureHeight), 0, 0, cv::INTER_AREA);
+        
+        cv::Mat row = features.row(i);
+        small.reshape(1, 1).convertTo(row, CV_32F);
+    }
+    
+    //Project onto the main components
+    int dimensions = min(this->settings.knnDimensions, min(features.cols, this->frameCount));
+    cout << "Projecting onto " << dimensions << " PCA components" << endl;
+    cv::PCA pca(features, cv::Mat(), CV_PCA_DATA_AS_ROW, dimensions);
+    cv::Mat projected = pca.project(features);
+    
+    //Approximate candidates from the index
+    int numCandidates = min(this->settings.knnNeighbours * this->settings.knnOversampling + 1, this->frameCount);
+    cout << "Searching for " << numCandidates << " candidates per frame" << endl;
+    cv::flann::Index index(projected, cv::flann::KDTreeIndexParams(4));
+    cv::Mat indices(this->frameCount, numCandidates, CV_32S);
+    cv::Mat dists(this->frameCount, numCandidates, CV_32F);
+    index.knnSearch(projected, indices, dists, numCandidates, cv::flann::SearchParams(64));
+    
+    //Exact distances for the candidates
+    this->sparseFrameDistanceMatrix = new SparseMatrix(this->frameCount);
+    
+    ThreadPool pool(this->settings.numThreads);
+    cout << "Calculating nearest neighbour distances on " << pool.getNumThreads() << " threads" << endl;
+    pool.setProgressLabel("Distance rows");
+    vector<double> largest(this->frameCount);
+    for (int row=0; row < this->frameCount; row++)
+    {
+        pool.add(new NearestNeighbourRowTask(this, row, indices.ptr<int>(row), numCandidates, &largest[0]));
+    }
+    pool.wait();
+    
+    //Only the closest pairs are kept, normalizing by the largest of them would make the neighbours look far apart
+    this->sparseFrameDistanceMatrix->largestValue = *max_element(largest.begin(), largest.end());
+    
+    size_t entries = this->sparseFrameDistanceMatrix->numEntries();
+    cout << "Kept " << entries << " of " << (size_t)this->frameCount * this->frameCount << " pairs" << endl;
+}
+
+
+/**
+ * Order entries by distance
+ */
+static bool entryCloser(const SparseEntry& a, const SparseEntry& b)
+{
+    if (a.value != b.value) return a.value < b.value;
+    return a.col < b.col;
+}
+
+/**
+ * Calculates one row of the nearest neighbour distance matrix
+ * @param int row
+ * @param const int* candidates - approximate neighbours from the index
+ * @param int numCandidates
+ */
+double VideoTexture::computeNearestNeighbourRow(int row, const int* candidates, int numCandidates)
+{
+    size_t length = this->getAnalysisLength();
+    double largest = 0.0;
+    
+    vector<SparseEntry> entries;
+    for (int c=0; c<numCandidates; c++)
+    {
+        int col = candidates[c];
+        if (col < 0 || col >= this->frameCount || col == row)
+        {
+            continue;
+        }
+        
+        SparseEntry entry;
+        entry.col = col;
+        entry.value = FrameDistance::distanceFromSumSquaredDifference(FrameDistance::sumSquaredDifference(this->getAnalysisPixels(row), this->getAnalysisPixels(col), length));
+        largest = max(largest, entry.value);
+        entries.push_back(entry);
+    }
+    
+    //The candidates are all close by, frames spread evenly through the video give the scale of the far pairs
+    int samples = min(this->settings.knnNeighbours, this->frameCount - 1);
+    for (int s=1; s<=samples; s++)
+    {
+        int col = (row + (int)((int64_t)s * this->frameCount / (samples + 1))) % this->frameCount;
+        largest = max(largest, FrameDistance::distanceFromSumSquaredDifference(FrameDistance::sumSquaredDifference(this->getAnalysisPixels(row), this->getAnalysisPixels(col), length)));
+    }
+    
+    //Keep the k best
+    sort(entries.begin(), entries.end(), entryCloser);
+    if (entries.size() > (size_t)this->settings.knnNeighbours)
+    {
+        entries.resize(this->settings.knnNeighbours);
+    }
+    
+    //A frame is always at distance 0 from itself
+    SparseEntry self;
+    self.col = row;
+    self.value = 0.0f;
+    entries.push_back(self);
+    
+    this->sparseFrameDistanceMatrix->setRow(row, entries);
+    return largest;
+}
+
+
+/**
+ * Task that fills in one row of the histogram distance matrix
+ */
+class HistogramRowTask : public Task
+{
+public:
+    VideoTexture* videoTexture;
+    int row;
+    
+    HistogramRowTask(VideoTexture* videoTexture, int row)
+    {
+        this->videoTexture = videoTexture;
+        this->row = row;
+    }
+    
+    void run()
+    {
+        this->videoTexture->computeHistogramDistanceRow(this->row);
+    }
+};
+
+
+/**
+ * Calculates the frame distance matrix as the chi-square distance between colour histograms
+ * Each frame's histogram is calculated once and kept in frameHistograms, then the rows are compared on the thread pool.
+ * The cost of a comparison depends on the number of histogram bins rather than the frame size.
+ * Chi-square isn't symmetric, D[i][j] uses frame i as the reference like ImageComparator::compare.
+ */
+void VideoTexture::computeHistogramDistanceMatrix()
+{
+    ImageComparator comparator;
+    comparator.setColorReduction(this->settings.histogramColorReduction);
+    this->histogramSize = comparator.getHistogramSize();
+    
+    cout << "Calculating " << this->histogramSize << " bin colour histograms" << endl;
+    this->frameHistograms = new float[(size_t)this->frameCount * this->histogramSize];
+    for (int i=0; i<this->frameCount; i++)
+    {
+        this->prefetchColourFrames(i + 1, this->settings.colourPrefetch);
+        comparator.computeHistogram(this->getColourFrame(i), this->frameHistograms + (size_t)i * this->histogramSize);
+    }
+    
+    this->frameDistanceMatrix = this->initMatrix(this->frameCount);
+    
+    ThreadPool pool(this->settings.numThreads);
+    cout << "Calculating histogram distances on " << pool.getNumThreads() << " threads" << endl;
+    pool.setProgressLabel("Distance rows");
+    for (int row=0; row < this->frameCount; row++)
+    {
+        pool.add(new HistogramRowTask(this, row));
+    }
+    pool.wait();
+}
+
+
+/**
+ * Compares one frame's histogram against every frame
+ * @param int row
+ */
+void VideoTexture::computeHistogramDistanceRow(int row)
+{
+    ImageComparator comparator;
+    comparator.setColorReduction(this->settings.histogramColorReduction);
+    
+    comparator.compareAll(this->frameHistograms + (size_t)row * this->histogramSize, this->frameHistograms, this->frameCount, this->frameDistanceMatrix[row]);
+}
+
+
+/**
+ * Writes the sparse frame distance matrix to a cache file
+ * The first line is "sparse <frameCount>", then one "row col distance" line per stored pair
+ * @param string file
+ */
+void VideoTexture::writeSparseFrameDistanceMatrix(string file)
+{
+    fstream outfile;
+    outfile.open(file.c_str(), ios::out);
+    
+    if (!outfile.is_open())
+    {
+        throw string("Could not open " + file);
+    }
+    
+    //The largest distance of the whole matrix follows the size, the stored pairs are only the closest ones
+    outfile << "sparse " << this->frameCount << " " << this->sparseFrameDistanceMatrix->largestValue << endl;
+    for (int row=0; row < this->frameCount; row++)
+    {
+        vector<SparseEntry>& entries = this->sparseFrameDistanceMatrix->rows[row];
+        for (size_t i=0; i<entries.size(); i++)
+        {
+            outfile << row << " " << entries[i].col << " " << entries[i].value << endl;
+        }
+    }
+    
+    outfile.close();
+    
+    this->getCacheMetadata().save(CacheMetadata::sidecarFile(file));
+    
+    cout << "Wrote sparse frame distance matrix to: " << file << endl;
+}
+
+
+/**
+ * Loads the frame diff matrix from a file
+ * @param string file
+ */
+void VideoTexture::loadFrameDiffMatrix(string file)
+{
+    if (file.empty())
+    {
+        file = this->getAnalysisCacheFile();
+        if (!this->analysisCache->find(file))
+        {
+            if (this->loadFrameRangeDistances())
+            {
+                return;
+            }
+            cout << "No frame distance matrix for this video and settings in the analysis cache yet" << endl;
+            this->generateFrameDistanceMatrix();
+        }
+    }
+    
+    //The pipeline defers decoding until the distances are calculated, a cache that was already there still needs the frames
+    if (this->frameCount == 0)
+    {
+        this->decodeFrames();
+    }
+    
+    //Binary caches are mapped, the rows of the matrix point straight into the file
+    if (DistanceCache::isDistanceCache(file))
+    {
+        DistanceCache* cache = new DistanceCache();
+        if (!cache->open(file))
+        {
+            delete cache;
+            throw string("Couldn't open distance cache " + file);
+        }
+        if (cache->header.frameCount != this->frameCount || cache->header.rows != this->frameCount || cache->header.cols != this->frameCount)
+        {
+            stringstream message;
+            message << file << " covers " << cache->header.frameCount << " frames but the video has " << this->frameCount << ", update the cache first";
+            delete cache;
+            throw message.str();
+        }
+        
+        //Tiles are copied out into ordinary rows, the stages read the matrix row by row
+        if (cache->isTiled())
+        {
+            this->frameDistanceMatrix = this->initMatrix(this->frameCount);
+            cache->readWindow(0, 0, this->frameCount, this->frameCount, this->frameDistanceMatrix);
+            delete cache;
+            this->normalizeMatrix(this->frameDistanceMatrix);
+            return;
+        }
+        
+        this->distanceCache = cache;
+        
+        //Packed distances are read through the accessor, normalizing only changes their scale
+        if (cache->isPacked())
+        {
+            LargestDistance largest = {0.0};
+            this->packedDistances = cache->packed();
+            this->packedDistances.visit(largest);
+            if (largest.largest > 0.0)
+            {
+                this->packedDistances.scale /= largest.largest;
+            }
+            cout << "Packed distances: " << this->packedDistances.bytes() << " bytes" << endl;
+            return;
+        }
+        
+        this->frameDistanceMatrix = new double*[this->frameCount];
+        for (int row=0; row < this->frameCount; row++)
+        {
+            this->frameDistanceMatrix[row] = cache->row(row);
+        }
+        
+        //Rescale matrix so that its maxima is 1, the mapping is private so the file keeps the raw distances
+        this->normalizeMatrix(this->frameDistanceMatrix);
+        return;
+    }
+    
+    //open the file
+    fstream infile;
+    infile.open(file.c_str(), ios::in);
+    if (!infile.is_open())
+    {
+        throw string("Couldn't open file " + file);
+    }
+    
+    string line;
+    
+    //Sparse cache files start with a header line
+    if (infile.peek() == 's')
+    {
+        getline(infile, line);
+        
+        this->sparseFrameDistanceMatrix = new SparseMatrix(this->frameCount);
+        
+        //Older caches don't have the largest distance, they are normalized by the largest stored one
+        stringstream header(line);
+        string sparse;
+        int size;
+        header >> sparse >> size >> this->sparseFrameDistanceMatrix->largestValue;
+        int row, col;
+        double value;
+        while (infile >> row >> col >> value)
+        {
+            if (row < this->frameCount && col < this->frameCount)
+            {
+                this->sparseFrameDistanceMatrix->set(row, col, value);
+            }
+        }
+        
+        //Rescale matrix so that its maxima is 1
+        this->sparseFrameDistanceMatrix->normalize();
+        return;
+    }
+    
+    //A cache that was generated before frames were appended to the video doesn't cover the new frames
+    CacheMetadata cached;
+    if (cached.load(CacheMetadata::sidecarFile(file)) && cached.getInt("frames") != this->frameCount)
+    {
+        stringstream message;
+        message << file << " covers " << cached.getInt("frames") << " frames but the video has " << this->frameCount << ", update the cache first";
+        throw message.str();
+    }
+    infile.close();
+    
+    //Initialize matrix
+    this->frameDistanceMatrix = this->initMatrix(this->frameCount);
+    
+    this->readFrameDistanceMatrix(file, this->frameCount);
+    
+    //Rescale matrix so that its maxima is 1
+    this->normalizeMatrix(this->frameDistanceMatrix);
+}
+
+
+/**
+ * Reads the distances of a dense cache, a binary cache in any layout or a text cache one per line in row order
+ * @param string file
+ * @param int cachedFrames - number of frames the cache covers, at most frameCount
+ */
+void VideoTexture::readFrameDistanceMatrix(string file, int cachedFrames)
+{
+    if (DistanceCache::isDistanceCache(file))
+    {
+        DistanceCache cache;
+        if (!cache.open(file) || cache.header.rows < cachedFrames || cache.header.cols < cachedFrames)
+        {
+            throw string("Couldn't read distance cache " + file);
+        }
+        cache.readWindow(0, 0, cachedFrames, cachedFrames, this->frameDistanceMatrix);
+        return;
+    }
+    
+    //Text caches are mapped and parsed in chunks on every thread
+    DistanceCache::readTextCache(file, this->frameDistanceMatrix, cachedFrames, this->settings.numThreads);
+}
+
+
+/**
+ * Loads the distances of the frames [startFrame, startFrame + frameCount) from the analysis cache result for the whole
+ * video, distances only depend on the two frames so a range is a window of the whole matrix. Returns false when the
+ * range isn't one (a stride or collapsed duplicates), packed distances are wanted or there is no whole video result.
+ */
+bool VideoTexture::loadFrameRangeDistances()
+{
+    int first = max(0, this->settings.startFrame);
+    if (this->analysisCache == NULL || max(1, this->settings.frameStride) != 1 || this->settings.collapseDuplicates || this->usesPackedDistances())
+    {
+        return false;
+    }
+    
+    CacheMetadata parameters = this->getAnalysisParameters();
+    if (!parameters.has("startFrame"))
+    {
+        return false;
+    }
+    parameters.values.erase("startFrame");
+    parameters.values.erase("endFrame");
+    parameters.values.erase("frameStride");
+    
+    string file = this->analysisCache->file(this->file, parameters, DistanceCache::extension);
+    if (!this->analysisCache->find(file))
+    {
+        return false;
+    }
+    
+    //The pipeline defers decoding, the number of frames in the range is only known once they are decoded
+    if (this->frameCount == 0)
+    {
+        this->decodeFrames();
+    }
     
-    for (int row=0; row < this->frameCount; row++)
+    DistanceCache cache;
+    if (!DistanceCache::isDistanceCache(file) || !cache.open(file) || cache.header.rows < first + this->frameCount)
     {
-        for (int col=0; col < this->frameCount; col++)
-        {
-            if (infile.good())
-            {
-                getline(infile, line);
-                this->frameDistanceMatrix[row][col] = atof(line.c_str());
-            }
-        }
+        return false;
     }
     
-    //Rescale matrix so that its maxima is 1
+    cout << "Reading frames " << first << " to " << first + this->frameCount << " from the distances of the whole video" << endl;
+    this->frameDistanceMatrix = this->initMatrix(this->frameCount);
+    cache.readWindow(first, first, this->frameCount, this->frameCount, this->frameDistanceMatrix);
     this->normalizeMatrix(this->frameDistanceMatrix);
+    return true;
 }
 
 
@@ -338,89 +3233,293 @@ void VideoTexture::debugFrame(int frameNum)
     }
 }
 
+/**
+ * Calls stage(distances) with an accessor for whichever dense distances are there, full or packed
+ * @param const PackedDistances& packed - used when it has data
+ * @param double** full - otherwise
+ */
+template <class Stage>
+static void visitDistances(const PackedDistances& packed, double** full, Stage& stage)
+{
+    if (packed.data != NULL)
+    {
+        packed.visit(stage);
+    }
+    else
+    {
+        stage(FullDistanceMatrix(full));
+    }
+}
+
+/**
+ * probability[i,j] = exp(-D[i+1, j]/sigma
+ */
+struct ProbabilityStage
+{
+    VideoTexture* videoTexture;
+    double** probabilities;
+    
+    template <class Distances>
+    void operator()(const Distances& distances)
+    {
+        VideoTexture* vt = this->videoTexture;
+        for (int row=0; row < vt->frameCount - 1; row++)
+        {
+            for (int col=0; col < vt->frameCount; col++)
+            {
+                this->probabilities[row][col] = exp(-distances(row+1, col)/vt->sigma);
+            }
+        }
+    }
+};
+
 /**
  * Generate the probability matrix
  */
 void VideoTexture::generateProbabilityMatrix()
 {
+    if (this->sparseFrameDistanceMatrix != NULL)
+    {
+        this->sparseFrameProbabilityMatrix = this->generateSparseProbabilityMatrix(this->sparseFrameDistanceMatrix);
+        this->sparseFrameProbabilityMatrix->normalizeRows();
+        return;
+    }
+    
     //Initialize probability matrix
     this->frameProbabilityMatrix = this->initMatrix(this->frameCount);
     
     //Calculate the probability for each frame
+    ProbabilityStage stage = {this, this->frameProbabilityMatrix};
+    visitDistances(this->packedDistances, this->frameDistanceMatrix, stage);
+    
+    //Normalize the matrix so that each row adds up to 1
+    this->normalizeMatrixRows(this->frameProbabilityMatrix);
+
+}
+
+/**
+ * Probability matrix for a sparse distance matrix
+ * Pairs that aren't stored are far apart, so their probability is 0 and they aren't stored either
+ */
+SparseMatrix* VideoTexture::generateSparseProbabilityMatrix(SparseMatrix* distances)
+{
+    SparseMatrix* probabilities = new SparseMatrix(this->frameCount);
+    
     //probability[i,j] = exp(-D[i+1, j]/sigma
     for (int row=0; row < this->frameCount - 1; row++)
     {
-        for (int col=0; col < this->frameCount; col++)
+        vector<SparseEntry> entries(distances->rows[row+1]);
+        for (size_t i=0; i<entries.size(); i++)
         {
-            this->frameProbabilityMatrix[row][col] = exp(-this->frameDistanceMatrix[row+1][col]/this->sigma);
+            entries[i].value = exp(-entries[i].value/this->sigma);
         }
+        probabilities->setRow(row, entries);
     }
     
-    //Normalize the matrix so that each row adds up to 1
-    this->normalizeMatrixRows(this->frameProbabilityMatrix);
-
+    return probabilities;
 }
 
 /**
- * Get average Distance
+ * Sum of every distance
  */
-double VideoTexture::getAverageDistance()
+struct DistanceSum
 {
-    double sum = 0.0f;
-    for (int row=0; row<this->frameCount; row++)
+    int count;
+    double sum;
+    
+    template <class Distances>
+    void operator()(const Distances& distances)
     {
-        for (int col=0; col<this->frameCount; col++)
+        for (int row=0; row<this->count; row++)
         {
-            sum += this->frameDistanceMatrix[row][col];
+            for (int col=0; col<this->count; col++)
+            {
+                this->sum += distances(row, col);
+            }
         }
     }
-    return sum / (this->frameCount * this->frameCount);
+};
+
+/**
+ * Get average Distance
+ */
+double VideoTexture::getAverageDistance()
+{
+    DistanceSum total = {this->frameCount, 0.0};
+    visitDistances(this->packedDistances, this->frameDistanceMatrix, total);
+    return total.sum / (this->frameCount * this->frameCount);
 }
 
 
+/**
+ * Writes single cells of a full matrix, the histogram distances aren't symmetric
+ */
+struct MatrixCells
+{
+    double** rows;
+    
+    void set(int row, int col, double value) const
+    {
+        this->rows[row][col] = value;
+    }
+};
+
+/**
+ * D'[i,j] = sum of w[k] * D[i+k, j+k], Algorithm from Schodl et al
+ * Packed distances are symmetric with a zero diagonal, so D' is too. Only the pairs above the diagonal are calculated,
+ * into packed weighted distances of the same element type. Full distances give a full matrix.
+ */
+struct WeightedDistanceStage
+{
+    VideoTexture* videoTexture;
+    
+    template <class Element>
+    void operator()(const PackedDistanceMatrix<Element>& distances)
+    {
+        PackedDistances& packed = this->videoTexture->packedWeightedDistances;
+        this->weigh(distances, PackedDistanceMatrix<Element>(packed.data, packed.size, packed.scale), true);
+    }
+    
+    void operator()(const FullDistanceMatrix& distances)
+    {
+        MatrixCells cells = {this->videoTexture->weightedFrameDistanceMatrix};
+        this->weigh(distances, cells, false);
+    }
+    
+    template <class Distances, class Weighted>
+    void weigh(const Distances& distances, const Weighted& weighted, bool upperTriangle)
+    {
+        VideoTexture* vt = this->videoTexture;
+        
+        int m = 2;  //2 tap filter  (paper says you can make it 1)
+        double w[] = {0.25f, 0.75f, 0.75f, 0.25f};  //4 tap weighted kernels
+        
+        for (int row=0; row<vt->frameCount; row++)
+        {
+            for (int col=(upperTriangle ? row+1 : 0); col<vt->frameCount; col++)
+            {
+                //Pairs too close to the ends for the whole kernel keep the value from the non weighted version
+                if (row < m || row >= (vt->frameCount - (m-1)) || col < m || col >= (vt->frameCount - (m-1)))
+                {
+                    weighted.set(row, col, distances(row, col));
+                    continue;
+                }
+                
+                //Calculate D'[i,j]
+                double sum = 0.0f;
+                
+                int w_index = 0;    //I can't figure out a better way to access w
+                
+                for (int k=-m; k<m; k++)
+                {
+                    sum = sum + (w[w_index] * distances(row+k, col+k));
+                    w_index++;
+                }
+                
+                weighted.set(row, col, sum);
+            }
+        }
+    }
+};
+
 /**
  * Generate the weighted frame distance matrix
  */
 void VideoTexture::generateWeightedFrameDistanceMatrix()
 {
-    //Initialize the weighted matrix
-    this->weightedFrameDistanceMatrix = this->initMatrix(this->frameCount);
-    for (int i=0; i<this->frameCount; i++)
+    if (this->sparseFrameDistanceMatrix != NULL)
     {
-        //Preset all values to values from the non weighted version
-        for (int j=0; j<this->frameCount; j++)
+        this->generateSparseWeightedFrameDistanceMatrix();
+        return;
+    }
+    
+    //Packed distances are weighted into a packed matrix of their own type, it is half the size of a full one
+    //The weights add up to 2, which is the largest weighted distance a uint16 matrix has to be able to hold
+    if (this->packedDistances.data != NULL)
+    {
+        LargestDistance largest = {0.0};
+        this->packedDistances.visit(largest);
+        this->packedWeightedDistances = this->packedDistances;
+        this->packedWeightedDistances.scale = (largest.largest > 0.0) ? 2.0 * largest.largest : 1.0;
+        this->packedWeightedDistances.data = new char[this->packedWeightedDistances.bytes()];
+        this->weightedFrameDistanceMatrix = NULL;
+        cout << "Packed weighted distances: " << this->packedWeightedDistances.bytes() << " bytes" << endl;
+    }
+    else
+    {
+        this->weightedFrameDistanceMatrix = this->initMatrix(this->frameCount);
+    }
+    
+    WeightedDistanceStage stage = {this};
+    visitDistances(this->packedDistances, this->frameDistanceMatrix, stage);
+    
+    //Normalize the distances between 0-1
+    if (this->packedWeightedDistances.data != NULL)
+    {
+        LargestDistance largest = {0.0};
+        this->packedWeightedDistances.visit(largest);
+        if (largest.largest > 0.0)
         {
-            this->weightedFrameDistanceMatrix[i][j] = this->frameDistanceMatrix[i][j];
+            this->packedWeightedDistances.scale /= largest.largest;
         }
     }
+    else
+    {
+        this->normalizeMatrix(this->weightedFrameDistanceMatrix);
+    }
+    
+}
+
+/**
+ * Generate the weighted frame distance matrix for a sparse distance matrix
+ * Only the stored pairs are weighted. A tap that falls on a pair that isn't stored uses the largest stored
+ * distance of its row, which is a lower bound for it.
+ */
+void VideoTexture::generateSparseWeightedFrameDistanceMatrix()
+{
+    SparseMatrix* distances = this->sparseFrameDistanceMatrix;
+    this->sparseWeightedFrameDistanceMatrix = new SparseMatrix(this->frameCount);
     
+    vector<double> rowMax(this->frameCount);
+    for (int i=0; i<this->frameCount; i++)
+    {
+        rowMax[i] = distances->rowMax(i);
+    }
     
-    //Algorithm from Schodl et al
-    int m = 2;  //2 tap filter  (paper says you can make it 1)
-    double w[] = {0.25f, 0.75f, 0.75f, 0.25f};  //4 tap weighted kernels
+    //Algorithm from Schodl et al, same kernel as the dense version
+    int m = 2;
+    double w[] = {0.25f, 0.75f, 0.75f, 0.25f};
     
-    for (int row=m; row<(this->frameCount - (m-1)); row++)
+    for (int row=0; row<this->frameCount; row++)
     {
-        for (int col=m; col<(this->frameCount - (m-1)); col++)
+        vector<SparseEntry> entries(distances->rows[row]);
+        
+        if (row >= m && row < (this->frameCount - (m-1)))
         {
-            //Calculate D'[i,j]
-            double sum = 0.0f;
-            
-            int w_index = 0;    //I can't figure out a better way to access w
-            
-            for (int k=-m; k<m; k++)
+            for (size_t e=0; e<entries.size(); e++)
             {
-                sum = sum + (w[w_index] * this->frameDistanceMatrix[row+k][col+k]);
-                w_index++;
+                int col = entries[e].col;
+                if (col < m || col >= (this->frameCount - (m-1)))
+                {
+                    continue;
+                }
+                
+                double sum = 0.0f;
+                int w_index = 0;
+                for (int k=-m; k<m; k++)
+                {
+                    sum = sum + (w[w_index] * distances->get(row+k, col+k, rowMax[row+k]));
+                    w_index++;
+                }
+                entries[e].value = sum;
             }
-            
-            this->weightedFrameDistanceMatrix[row][col] = sum;
         }
+        
+        this->sparseWeightedFrameDistanceMatrix->setRow(row, entries);
     }
     
     //Normalize the distances between 0-1
-    this->normalizeMatrix(this->weightedFrameDistanceMatrix);
-    
+    this->sparseWeightedFrameDistanceMatrix->normalize();
 }
 
 /**
@@ -428,19 +3527,19 @@ void VideoTexture::generateWeightedFrameDistanceMatrix()
  */
 void VideoTexture::generateWeightedProbabilityMatrix()
 {
+    if (this->sparseWeightedFrameDistanceMatrix != NULL)
+    {
+        this->sparseWeightedFrameProbabilityMatrix = this->generateSparseProbabilityMatrix(this->sparseWeightedFrameDistanceMatrix);
+        this->sparseWeightedFrameProbabilityMatrix->normalizeRows();
+        return;
+    }
+    
     //Initialize probability matrix
     this->weightedFrameProbabilityMatrix = this->initMatrix(this->frameCount);
     
     //Calculate the probability for each frame
-    //probability[i,j] = exp(-D[i+1, j]/sigma
-    
-    for (int row=0; row < this->frameCount - 1; row++)
-    {
-        for (int col=0; col < this->frameCount; col++)
-        {
-            this->weightedFrameProbabilityMatrix[row][col] = exp(-this->weightedFrameDistanceMatrix[row+1][col]/this->sigma);
-        }
-    }
+    ProbabilityStage stage = {this, this->weightedFrameProbabilityMatrix};
+    visitDistances(this->packedWeightedDistances, this->weightedFrameDistanceMatrix, stage);
     
     //Normalize the matrix so that each row adds up to 1
     this->normalizeMatrixRows(this->weightedFrameProbabilityMatrix);
@@ -448,6 +3547,30 @@ void VideoTexture::generateWeightedProbabilityMatrix()
 }
 
 
+/**
+ * D''[i,j] = D'[i,j]^p + alpha * m[j], from the weighted distances, full or packed
+ */
+struct FutureCostStage
+{
+    VideoTexture* videoTexture;
+    double p;
+    double alpha;
+    const double* m;    //Smallest cost of leaving each frame, NULL before the first pass
+    
+    template <class Distances>
+    void operator()(const Distances& weighted)
+    {
+        VideoTexture* vt = this->videoTexture;
+        for (int i=vt->frameCount-1; i>=0; i--)
+        {
+            for (int j=0; j<vt->frameCount; j++)
+            {
+                vt->anticipatedFutureCostMatrix[i][j] = pow(weighted(i, j), this->p) + (this->m != NULL ? this->alpha * this->m[j] : 0.0);
+            }
+        }
+    }
+};
+
 /**
  * Anticipate future cost using Shodl et al
  * @param double p
@@ -456,16 +3579,17 @@ void VideoTexture::generateWeightedProbabilityMatrix()
  */
 void VideoTexture::generateAnticipatedFutureCostMatrix(double p, double alpha, double convergenceThreshold)
 {
+    if (this->sparseWeightedFrameDistanceMatrix != NULL)
+    {
+        this->generateSparseAnticipatedFutureCostMatrix(p, alpha, convergenceThreshold);
+        return;
+    }
+    
     //First, initialize the new anticipated future cost matrix of D'' 
+    //Initialize default values of D''ij as D'ij^p  (D'ij is the weighted distance matrix)
     this->anticipatedFutureCostMatrix = this->initMatrix(this->frameCount);
-    for (int i=0; i<this->frameCount; i++)
-    {       
-        //Initialize default values of D''ij as D'ij^p  (D'ij is the weighted distance matrix)
-        for (int j=0; j<this->frameCount; j++)
-        {
-            this->anticipatedFutureCostMatrix[i][j] = pow(this->weightedFrameDistanceMatrix[i][j], p);
-        }
-    } 
+    FutureCostStage initial = {this, p, alpha, NULL};
+    visitDistances(this->packedWeightedDistances, this->weightedFrameDistanceMatrix, initial);
 
     //Initialize array m, which holds the minimum for each row
     double m[this->frameCount];
@@ -515,14 +3639,8 @@ void VideoTexture::generateAnticipatedFutureCostMatrix(double p, double alpha, d
         }
         
         //Step 2 Calculate new D''ij
-        for (int i=this->frameCount-1; i>=0; i--)
-        {
-            for (int j=0; j<this->frameCount; j++)
-            {
-                this->anticipatedFutureCostMatrix[i][j] = pow(this->weightedFrameDistanceMatrix[i][j], p) + (alpha * m[j]);
-                
-            }
-        }
+        FutureCostStage stage = {this, p, alpha, m};
+        visitDistances(this->packedWeightedDistances, this->weightedFrameDistanceMatrix, stage);
         
         //Normalize the distances between 0-1
         this->normalizeMatrix(this->anticipatedFutureCostMatrix);
@@ -550,6 +3668,72 @@ void VideoTexture::generateAnticipatedFutureCostMatrix(double p, double alpha, d
 }
 
 
+/**
+ * Anticipate future cost for a sparse weighted distance matrix
+ * Same iteration as the dense version, but the minimum of each row is only taken over the stored pairs
+ */
+void VideoTexture::generateSparseAnticipatedFutureCostMatrix(double p, double alpha, double convergenceThreshold)
+{
+    SparseMatrix* weighted = this->sparseWeightedFrameDistanceMatrix;
+    
+    //D''ij starts as D'ij^p and has the same stored pairs
+    this->sparseAnticipatedFutureCostMatrix = new SparseMatrix(this->frameCount);
+    SparseMatrix* cost = this->sparseAnticipatedFutureCostMatrix;
+    for (int i=0; i<this->frameCount; i++)
+    {
+        vector<SparseEntry> entries(weighted->rows[i]);
+        for (size_t e=0; e<entries.size(); e++)
+        {
+            entries[e].value = pow(entries[e].value, p);
+        }
+        cost->setRow(i, entries);
+    }
+    
+    vector<double> m(this->frameCount, 10000.0f);
+    
+    bool converged = false;
+    while (!converged)
+    {
+        //Step 1 - Find the minimum distance for each row  min_k D''jk
+        for (int j=0; j<this->frameCount; j++)
+        {
+            double m_j = 10000.0f;
+            vector<SparseEntry>& entries = cost->rows[j];
+            for (size_t e=0; e<entries.size(); e++)
+            {
+                if (entries[e].value < m_j && entries[e].col != j)
+                {
+                    m_j = entries[e].value;
+                }
+            }
+            
+            if (fabs(m[j] - m_j) < convergenceThreshold)
+            {
+                converged = true;
+            }
+            m[j] = m_j;
+        }
+        
+        //Step 2 Calculate new D''ij
+        for (int i=0; i<this->frameCount; i++)
+        {
+            vector<SparseEntry>& entries = cost->rows[i];
+            vector<SparseEntry>& weightedEntries = weighted->rows[i];
+            for (size_t e=0; e<entries.size(); e++)
+            {
+                entries[e].value = pow(weightedEntries[e].value, p) + (alpha * m[entries[e].col]);
+            }
+        }
+        
+        //Normalize the distances between 0-1
+        cost->normalize();
+    }
+    
+    //Probability matrix, not row normalized, same as the dense version
+    this->sparseAnticipatedFutureCostProbabilityMatrix = this->generateSparseProbabilityMatrix(cost);
+}
+
+
 /**
  * Initialize a matrix
  */
@@ -715,31 +3899,38 @@ void VideoTexture::randomPlay(double** matrix, double pruneThreshold, bool cross
     
     while (!stop)
     {
-        //Display the current frame
-        cv::imshow("Video Texture", this->frames[currentFrame]);
+        //Display the current frame, for as long as the run of duplicates it stands for
+        cv::imshow("Video Texture", this->getColourFrame(currentFrame));
+        int wait = delay * this->getRunLength(currentFrame);
         
         cout << "Playing frame: " << currentFrame << endl;
 
         //Get the highest probability next transition
         int nextFrame = this->getNextFrameStochastically(currentFrame, playMatrix);
         
+        //Decode where the transition goes while this frame is shown, playback usually carries on from there
+        this->prefetchColourFrames(nextFrame, this->settings.colourPrefetch);
+        
         if (crossFade)
         {
             if (abs(nextFrame - currentFrame) > 1)
             {
-                cv::Mat fadeFrame = this->createCrossFadeFrame(this->frames[currentFrame], this->frames[nextFrame]);
-                if (cv::waitKey(delay) >= 0)
+                cv::Mat from = this->getColourFrame(currentFrame);
+                cv::Mat to = this->getColourFrame(nextFrame);
+                cv::Mat fadeFrame = this->createCrossFadeFrame(from, to);
+                if (cv::waitKey(wait) >= 0)
                 {
                     stop = true;
                 }
                 cout << "Playing frame: crossfade" << endl;
                 cv::imshow("Video Texture", fadeFrame);
+                wait = delay;
             }            
         }
         currentFrame = nextFrame;
         
         //Wait for key or delay
-        if (cv::waitKey(delay) >= 0)
+        if (cv::waitKey(wait) >= 0)
         {
             stop = true;
         }
@@ -1065,6 +4256,82 @@ void VideoTexture::findTransitions(double** matrix, int numTransitions, int min_
 }
 
 
+/**
+ * A possible transition from a sparse matrix
+ */
+struct TransitionCandidate
+{
+    int i;
+    int j;
+    double cost;
+};
+
+/**
+ * Cheapest first, ties in the same order as the dense search
+ */
+static bool candidateBefore(const TransitionCandidate& a, const TransitionCandidate& b)
+{
+    if (a.cost != b.cost) return a.cost < b.cost;
+    if (a.i != b.i) return a.i < b.i;
+    return a.j < b.j;
+}
+
+/**
+ * Find the best transitions from a sparse matrix
+ * Follows the same rules as the dense version: only i > j, zero and repeated costs are skipped, cheapest first
+ */
+void VideoTexture::findTransitions(SparseMatrix* matrix, int numTransitions, int min_length)
+{
+    vector<Transition*>* transitions = new vector<Transition*>();
+    
+    //Only the stored pairs can be transitions
+    vector<TransitionCandidate> candidates;
+    for (int i=0; i<matrix->size; i++)
+    {
+        vector<SparseEntry>& entries = matrix->rows[i];
+        for (size_t e=0; e<entries.size(); e++)
+        {
+            if (entries[e].col < i)
+            {
+                TransitionCandidate candidate;
+                candidate.i = i;
+                candidate.j = entries[e].col;
+                candidate.cost = entries[e].value;
+                candidates.push_back(candidate);
+            }
+        }
+    }
+    sort(candidates.begin(), candidates.end(), candidateBefore);
+    
+    double global_min = 0.0f;
+    for (size_t c=0; c<candidates.size() && transitions->size() < (size_t)numTransitions; c++)
+    {
+        if (candidates[c].cost <= global_min)
+        {
+            continue;
+        }
+        global_min = candidates[c].cost;
+        
+        Transition* transition = Transition::create(candidates[c].i, candidates[c].j, candidates[c].cost);
+        transition->asc();
+        
+        if (transition->length >= min_length)
+        {
+            transitions->push_back(transition);
+        }
+    }
+    
+    //Debug the transitions
+    for (size_t i=0; i<transitions->size(); i++)
+    {
+        Transition* transition = transitions->at(i);
+        cout << i << ". " << transition->startFrame << " to " << transition->endFrame << " costing: " << transition->cost << " length: " << transition->length << endl;
+    }
+    
+    this->transitions = transitions;
+}
+
+
 /**
  * Magically creates a compound loop or returns NULL
  */
@@ -1284,6 +4551,19 @@ void VideoTexture::writeVideoTextures(TransitionsTable* transitionsTable, string
     
 }
 
+/**
+ * Writes the frames of the video a frame stands for, so runs of collapsed duplicates keep their length
+ */
+void VideoTexture::writeSourceFrames(cv::VideoWriter& writer, int frame)
+{
+    int first = this->getSourceFrame(frame);
+    int length = this->getRunLength(frame);
+    for (int i=first; i<first + length; i++)
+    {
+        writer.write(this->getSourceColourFrame(i));
+    }
+}
+
 /**
  * Write out an individual video
  */
@@ -1305,14 +4585,17 @@ void VideoTexture::writeVideoTexture(VideoLoop *compoundLoop, string filename)
     
     for (int i=startFrame; i<currentTransition->endFrame; i++)
     {
-        writer.write(this->frames[i]);
+        this->prefetchLoopFrames(i, currentTransition->endFrame, currentTransition->startFrame);
+        this->writeSourceFrames(writer, i);
         lastFrameWritten = i;
     }
     
     //For the remaining loops
     while (currentTransition != NULL)
     {
-        cv::Mat crossfade = this->createCrossFadeFrame(this->frames[lastFrameWritten], this->frames[currentTransition->startFrame]); 
+        cv::Mat from = this->getColourFrame(lastFrameWritten);
+        cv::Mat to = this->getColourFrame(currentTransition->startFrame);
+        cv::Mat crossfade = this->createCrossFadeFrame(from, to); 
         writer.write(crossfade);
         
         startFrame = currentTransition->startFrame;
@@ -1321,7 +4604,8 @@ void VideoTexture::writeVideoTexture(VideoLoop *compoundLoop, string filename)
             break;
         for (int i=startFrame; i<currentTransition->endFrame; i++)
         {
-            writer.write(this->frames[i]);
+            this->prefetchLoopFrames(i, currentTransition->endFrame, currentTransition->startFrame);
+            this->writeSourceFrames(writer, i);
             lastFrameWritten = i;
         }
     }
@@ -7,20 +7,39 @@
 //
 
 #include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <exception>
 #include <math.h>
 #include <fstream>
+#include <sstream>
 #include <algorithm>
 
 //Include OpenCV libraries
 #include "core.hpp"
 #include "imgproc.hpp"
 #include "highgui.hpp"
+#include "flann.hpp"
 
 //My libraries
 #include "VideoLoop.h"
 #include "Transition.h"
 #include "TransitionsTable.h"
+#include "FrameDistance.h"
+#include "GreyscaleConversion.h"
+#include "ThreadPool.h"
+#include "SparseMatrix.h"
+#include "CacheMetadata.h"
+#include "ImageComparator.h"
+#include "RingBuffer.h"
+#include "FrameStore.h"
+#include "FrameCache.h"
+#include "DistanceCache.h"
+#include "AnalysisCache.h"
+#include "CompressedFrameStore.h"
+#include "FrameRangeReader.h"
+#include "VideoTextureSettings.h"
 
 
 #ifndef VIDEOTEXTURE_H
@@ -36,10 +55,29 @@ class VideoTexture {
     
 public:
     
-    //Frames
+    //Loading and analysis options
+    VideoTextureSettings settings;
+    
+    //Video file
+    string file;
+    
+    //Frames (NULL when streaming with settings.memoryBudget, or when they are kept in compressedFrames)
     cv::Mat *frames;
     cv::Mat *greyscaleFrames; //Greyscale versions of the same frames for analysis
     
+    //Pixels of the frames above, one allocation per plane. frames and greyscaleFrames are views into them.
+    FrameStore *colourStore;
+    FrameStore *greyscaleStore;
+    
+    //Encoded colour frames, used instead of frames when settings.colourFrameEncoding is set
+    CompressedFrameStore *compressedFrames;
+    
+    //Mapped settings.frameCacheFile when the greyscale frames came from it, greyscaleFrames are then views into it
+    FrameCache *frameCache;
+    
+    //settings.analysisCacheDirectory, NULL when it isn't set
+    AnalysisCache *analysisCache;
+    
     //Framerate
     double frameRate;
     
@@ -50,6 +88,44 @@ public:
     //Frame distance matrix
     double **frameDistanceMatrix;
     
+    //Mapped binary cache when the distances were loaded from one, the rows of the matrix are then views into it
+    DistanceCache *distanceCache;
+    
+    //Upper triangle of the distances in distanceCache, used instead of frameDistanceMatrix when the cache was packed
+    //(settings.packedDistances). frameDistanceMatrix is then NULL, the stages read either through the same accessor.
+    PackedDistances packedDistances;
+    
+    //Frame distance matrix when only the closest pairs are kept (DISTANCE_PYRAMID, DISTANCE_KNN)
+    //When it is set the later stages fill in the sparse versions of their matrices instead of the dense ones
+    SparseMatrix *sparseFrameDistanceMatrix;
+    SparseMatrix *sparseFrameProbabilityMatrix;
+    SparseMatrix *sparseWeightedFrameDistanceMatrix;
+    SparseMatrix *sparseWeightedFrameProbabilityMatrix;
+    SparseMatrix *sparseAnticipatedFutureCostMatrix;
+    SparseMatrix *sparseAnticipatedFutureCostProbabilityMatrix;
+    
+    //Squared norms of the greyscale frames, for |a-b|^2 = |a|^2 + |b|^2 - 2a.b
+    uint64_t *frameNorms;
+    
+    //Only the pixels where the mask isn't 0 are compared (empty = the whole frame)
+    cv::Mat analysisMask;
+    string analysisMaskName;
+    
+    //Offsets of the masked pixels in a frame, and the masked pixels of every greyscale frame packed into one row each
+    vector<int> maskOffsets;
+    cv::Mat packedFrames;
+    
+    //Colour histograms of every frame, one after the other, for DISTANCE_HISTOGRAM
+    float *frameHistograms;
+    int histogramSize;
+    
+    //Distance matrix is computed in tiles of frames x frames, and each tile walks the pixels in chunks that stay in cache
+    static const int distanceTileSize = 32;
+    static const int distanceChunkSize = 8192;
+    
+    //Width of one distance in a streamed cache, including the newline, so tiles can be written anywhere in the file
+    static const int streamRecordSize = 17;
+    
     //Frame probability matrix
     double **frameProbabilityMatrix;
     
@@ -57,7 +133,9 @@ public:
     double sigma;
     
     //Weighted frame distance matrix and probability matrices for preserving dynamics
+    //The weighted distances of packedDistances are packed too, in packedWeightedDistances, and the matrix is then NULL
     double **weightedFrameDistanceMatrix;
+    PackedDistances packedWeightedDistances;
     double **weightedFrameProbabilityMatrix;
     
     //Anticipated future cost matrix
@@ -67,6 +145,12 @@ public:
     //FrameCount
     int frameCount;    
     
+    //Frame number in the loaded range of each frame when runs of duplicates were collapsed, empty when they weren't
+    //Frames are numbered within the range set by settings.startFrame, endFrame and frameStride, never as in the file.
+    //frames (colour) is always numbered as in the range, greyscaleFrames and the matrices only have the kept frames
+    vector<int> sourceFrames;
+    int sourceFrameCount;
+    
     //list of transitions
     vector<Transition*>* transitions;
     
@@ -74,26 +158,165 @@ public:
     //METHODS
     
     //Constructor
-    VideoTexture(string file, double sigma);
+    VideoTexture(string file, double sigma, VideoTextureSettings settings = VideoTextureSettings());
+    ~VideoTexture();
     
     //Load a video
     void loadVideo(string file);
     
+    //Decode every frame of the video into frames and greyscaleFrames (only frames if greyscaleFrames came from the frame cache)
+    void decodeFrames();
+    
+    //Colour frame for playback and output, from frames or compressedFrames. Decodes the video the first time if neither is loaded.
+    cv::Mat getColourFrame(int frame);
+    cv::Mat getSourceColourFrame(int sourceFrame);
+    
+    //Decodes the encoded colour frames [frame, frame + count) in the background, before playback or output asks for them
+    void prefetchColourFrames(int frame, int count);
+    
+    //Prefetches the frames after frame when the output jumps back to jumpTo at end
+    void prefetchLoopFrames(int frame, int end, int jumpTo);
+    
+    //Mapping between the frames that are analysed and the frames of the video
+    int getSourceFrame(int frame);
+    int getRunLength(int frame);
+    int getSourceFrameCount();
+    
+    //Keeps only the first of each run of identical (or nearly identical) consecutive frames
+    void collapseDuplicateFrames();
+    
+    //Decodes settings.decodeSegments parts of the video at once, false if the parts don't line up
+    bool decodeFramesInSegments();
+    
+    //Maps the greyscale frames from settings.frameCacheFile, false if there is no cache for the video as it is now
+    bool openFrameCache();
+    
+    //Saves the greyscale frames to settings.frameCacheFile
+    void writeFrameCache();
+    
     //Generates the frameDiffMatrix and writes to a cache file
-    void generateFrameDistanceMatrix(string file);
+    //"" = the result for this video and settings in the analysis cache, which is only generated if it isn't there yet
+    void generateFrameDistanceMatrix(string file = "");
+    
+    //Calculates the frameDistanceMatrix on settings.numThreads threads
+    void computeFrameDistanceMatrix();
+    
+    //Calculates every pair that involves a frame from firstNewFrame onwards
+    void computeFrameDistanceTiles(int firstNewFrame);
+    
+    //Decodes the video and calculates the frameDistanceMatrix at the same time
+    void pipelineFrameDistanceMatrix();
+    
+    //Calculates the frameDistanceMatrix straight into a cache file, keeping only two blocks of frames in memory
+    void streamFrameDistanceMatrix(string file);
+    
+    //Decodes and converts frames [start, start + count) for streaming, capture must be positioned at start
+    void readStreamBlock(FrameRangeReader& reader, int count, const vector<int>& offsets, vector<cv::Mat>& block, vector<uint64_t>& norms);
+    
+    //Extends an existing cache with the frames that were appended to the video since it was generated
+    void updateFrameDistanceMatrix(string file);
+    
+    //Describes the cache generated from this video with the current settings
+    CacheMetadata getCacheMetadata();
+    
+    //Everything that affects the distances, the key of the result in the analysis cache
+    CacheMetadata getAnalysisParameters();
+    
+    //Distance cache for this video and settings in the analysis cache
+    string getAnalysisCacheFile();
+    
+    //Moves the result this video had before it grew, or converts a cache from before the analysis cache, to file
+    //False if there is neither, only dense caches can be extended
+    bool adoptPreviousDistanceCache(string file);
+    
+    //Metadata of an existing cache, from inside a binary cache or from the sidecar of a text cache. False if there is none
+    bool loadCacheMetadata(string file, CacheMetadata& metadata);
+    
+    //Makes a binary cache for a frameCount x frameCount matrix, to be filled in and finished by the caller
+    //Packed uint16 distances are quantized against largestDistance, without it (eg. streaming) they are stored as float16
+    void createDistanceCache(string file, DistanceCache& cache, double largestDistance = 0.0);
+    
+    //settings.packedDistances and settings.cacheTileSize, unless the distance mode isn't symmetric and the lower
+    //triangle would be lost
+    bool usesPackedDistances();
+    bool usesTiledCache();
+    
+    //Writes the frameDistanceMatrix to a cache file
+    void writeFrameDistanceMatrix(string file);
+    
+    //Calculates the sparseFrameDistanceMatrix coarse to fine
+    void computeSparseFrameDistanceMatrix();
+    
+    //Calculates one row of the sparseFrameDistanceMatrix from the coarse frames
+    //Returns the largest distance in the row, including the pairs that were pruned at the coarse level
+    double computeSparseDistanceRow(int row, cv::Mat* coarseFrames, double coarseScale);
+    
+    //Calculates the sparseFrameDistanceMatrix from the k nearest neighbours of each frame
+    void computeNearestNeighbourDistanceMatrix();
+    
+    //Calculates one row of the sparseFrameDistanceMatrix from the nearest neighbour candidates
+    //Returns the largest distance it found from the row's frame, to the candidates or to frames spread through the video
+    double computeNearestNeighbourRow(int row, const int* candidates, int numCandidates);
+    
+    //Calculates the frameDistanceMatrix from the colour histograms of the frames
+    void computeHistogramDistanceMatrix();
+    
+    //Calculates one row of the histogram distance matrix
+    void computeHistogramDistanceRow(int row);
+    
+    //Writes the sparseFrameDistanceMatrix to a cache file
+    void writeSparseFrameDistanceMatrix(string file);
     
     //Loads the frameDiffMatrix to a file
-    void loadFrameDiffMatrix(string file);
+    //"" = the result for this video and settings in the analysis cache, it is generated first if it isn't there
+    void loadFrameDiffMatrix(string file = "");
+    
+    //Reads a dense cache of cachedFrames x cachedFrames distances into the top left of the frameDistanceMatrix, without normalizing
+    //Either format, binary caches are told apart by their magic
+    void readFrameDistanceMatrix(string file, int cachedFrames);
+    
+    //Loads the distances of a frame range as a window of the analysis cache result for the whole video, if there is one.
+    //Only the tiles of a tiled cache that hold the window are read.
+    bool loadFrameRangeDistances();
     
     //Play the video
     void playVideo();
     
-    //Calculate the sum squared distance between two frames
-    double getDistanceBetweenFrames(const cv::Mat& image1, const cv::Mat& image2);
+    //Calculate the sum squared distance between two frames, only where the mask isn't 0 if there is one
+    double getDistanceBetweenFrames(const cv::Mat& image1, const cv::Mat& image2, const cv::Mat& mask = cv::Mat());
+    
+    //Restrict the analysis to part of the frame
+    void loadAnalysisMask(string file);
+    void setAnalysisMask(const cv::Mat& mask, string name);
+    void setAnalysisRegions(const vector<cv::Rect>& regions);
+    
+    //Offsets of the masked pixels for frames of the given size, empty without a mask
+    vector<int> getMaskOffsets(cv::Size size);
+    
+    //Greyscale frame with the pixels outside the mask set to 0
+    cv::Mat getMaskedGreyscaleFrame(int frame);
     
     //Generates greyscale frames for analysis
     void generateGreyscaleFrames();
     
+    //Size of the greyscale frames, from settings.analysisScale or settings.analysisPixels
+    cv::Size getAnalysisSize();
+    double getAnalysisScale();
+    
+    //Greyscale analysis frame of a decoded colour frame, written into greyscale. fullSize is scratch for the full size
+    //greyscale frame when it is scaled down, pass the same one for every frame so it is allocated once
+    void makeAnalysisFrame(const cv::Mat& colour, cv::Mat& greyscale, cv::Mat& fullSize);
+    
+    //Flattened pixels of a greyscale frame used for the distance matrix
+    const uchar* getAnalysisPixels(int frame);
+    size_t getAnalysisLength();
+    
+    //Calculate the squared norm of each greyscale frame
+    void computeFrameNorms();
+    
+    //Calculate the distances for one tile of the upper triangle of the distance matrix and mirror it
+    void computeDistanceTile(int rowStart, int rowEnd, int colStart, int colEnd);
+    
     //Plays back the greyscale version of the video
     void playGreyscaleVideo();
     
@@ -112,9 +335,16 @@ public:
     //Generate the weighted probability matrix
     void generateWeightedProbabilityMatrix();
     
+    //probability[i,j] = exp(-D[i+1,j]/sigma) for the stored pairs of a sparse matrix
+    SparseMatrix* generateSparseProbabilityMatrix(SparseMatrix* distances);
+    
     //Avoid dead ends
     void generateAnticipatedFutureCostMatrix(double p = 1, double alpha = 0.995, double convergenceThreshold = 0.001f);
     
+    //Sparse versions of the weighting and future cost stages, used when sparseFrameDistanceMatrix is set
+    void generateSparseWeightedFrameDistanceMatrix();
+    void generateSparseAnticipatedFutureCostMatrix(double p, double alpha, double convergenceThreshold);
+    
     //Generic function for showing a matrix
     void printMatrix(double** matrix, int size);
     
@@ -150,6 +380,7 @@ public:
     
     //Find Transitions
     void findTransitions(double** matrix, int numTransitions = 10, int min_length = 1);
+    void findTransitions(SparseMatrix* matrix, int numTransitions = 10, int min_length = 1);
     
     //Generate the transitions table
     TransitionsTable* generateTransitionsTable(vector<Transition*>* transitions, int maxFrames);
@@ -163,6 +394,13 @@ public:
     
     VideoLoop* sequenceLoop(VideoLoop* compoundLoop);
     void writeVideoTexture(VideoLoop* compoundLoop, string filename);
+    void writeSourceFrames(cv::VideoWriter& writer, int frame);
+    
+private:
+    
+    //Not copyable, it owns its frames, caches and matrices
+    VideoTexture(const VideoTexture&);
+    VideoTexture& operator=(const VideoTexture&);
     
 };
 
@@ -0,0 +1,187 @@
+//
+//  VideoTextureSettings.h
+//  VideoTexture
+//
+//  Created by Leonard Teo on 11-11-22.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include <stddef.h>
+#include <string>
+#include "PackedDistanceMatrix.h"
+
+#ifndef VIDEOTEXTURESETTINGS_H
+#define VIDEOTEXTURESETTINGS_H
+
+/**
+ * How the frame distance matrix is computed
+ */
+enum DistanceMode
+{
+    DISTANCE_DENSE,     //Every pair at full resolution
+    DISTANCE_PYRAMID,   //Every pair at a coarse pyramid level, only the closest pairs at full resolution
+    DISTANCE_KNN,       //Only the k nearest frames of each frame, found with an approximate nearest neighbour index
+    DISTANCE_HISTOGRAM  //Chi-square distance between the colour histograms of every pair
+};
+
+/**
+ * Name of a distance mode, as recorded in the cache metadata
+ */
+inline const char* distanceModeName(DistanceMode mode)
+{
+    switch (mode)
+    {
+        case DISTANCE_PYRAMID:
+            return "pyramid";
+        case DISTANCE_KNN:
+            return "knn";
+        case DISTANCE_HISTOGRAM:
+            return "histogram";
+        default:
+            return "dense";
+    }
+}
+
+/**
+ * Options for loading and analyzing a video texture
+ * The defaults reproduce the original behaviour
+ */
+struct VideoTextureSettings
+{
+    //Number of threads used for analysis, 0 = one per core
+    int numThreads;
+    
+    //How the distance matrix is computed
+    DistanceMode distanceMode;
+    
+    //DISTANCE_PYRAMID: number of pyrDown levels for the coarse pass (each level halves width and height)
+    int pyramidLevels;
+    
+    //DISTANCE_PYRAMID: fraction of each row that is refined at full resolution
+    double pyramidQuantile;
+    
+    //DISTANCE_PYRAMID: pairs whose coarse distance is under this are also refined, 0 = off
+    double pyramidThreshold;
+    
+    //DISTANCE_KNN: number of nearest frames kept per frame
+    int knnNeighbours;
+    
+    //DISTANCE_KNN: the index returns knnNeighbours * knnOversampling candidates, which are then compared exactly
+    int knnOversampling;
+    
+    //DISTANCE_KNN: frames are downsampled to this width before the projection
+    int knnFeatureWidth;
+    
+    //DISTANCE_KNN: number of PCA components in the feature vectors
+    int knnDimensions;
+    
+    //DISTANCE_HISTOGRAM: each colour channel is reduced by this factor (a power of 2) before the histogram is taken
+    int histogramColorReduction;
+    
+    //Greyscale image the size of the video, only the pixels that aren't black are compared. "" = the whole frame
+    std::string maskFile;
+    
+    //Only frames startFrame up to (not including) endFrame are loaded, and of those only every frameStride'th frame
+    //The start is found by seeking where the file allows it. endFrame < 0 = until the video ends
+    int startFrame;
+    int endFrame;
+    int frameStride;
+    
+    //Number of parts of the video decoded at once, each on its own capture. 1 = decode in one pass
+    //Only used if seeking turns out to be frame accurate for the file, otherwise the video is decoded in one pass
+    int decodeSegments;
+    
+    //Dense distance matrix: decode, convert and compare frames at the same time instead of one after the other
+    bool pipeline;
+    
+    //Pipeline: number of threads converting decoded frames for analysis
+    int pipelineWorkers;
+    
+    //Pipeline: number of decoded frames that can wait for conversion
+    int pipelineDepth;
+    
+    //Bytes of frame data kept in memory while calculating a dense distance matrix, 0 = keep the whole video in memory
+    //When it is set the video is streamed from disk in blocks of frames instead of being loaded
+    size_t memoryBudget;
+    
+    //Greyscale frames are downscaled by this factor (area averaging) when they are made, and compared at that size
+    double analysisScale;
+    
+    //Alternative to analysisScale: downscale the greyscale frames to about this many pixels, 0 = use analysisScale
+    //Frames are never upscaled
+    size_t analysisPixels;
+    
+    //Shared cache of analysis results, named after the content of the video and the settings. Distance matrices go here
+    //when no cache file is given, and the frame cache does too when frameCacheFile isn't set. "" = off
+    std::string analysisCacheDirectory;
+    
+    //analysisCacheDirectory: least recently used results are deleted above this size, 0 = no limit
+    size_t analysisCacheMegabytes;
+    
+    //Raw greyscale frames are saved here after decoding, and later runs map them instead of decoding the video again
+    //The colour frames are then only decoded if they are needed for playback or output. "" = off
+    std::string frameCacheFile;
+    
+    //Runs of identical consecutive frames (eg. held frames in animation) are analysed as one frame
+    bool collapseDuplicates;
+    
+    //collapseDuplicates: frames within this RMS difference in grey levels also count as the same, 0 = identical only
+    double duplicateThreshold;
+    
+    //Binary (.vtd) caches of dense distances only keep the upper triangle of the matrix, N(N-1)/2 values instead of N^2,
+    //in distanceElement. A packed cache stays packed in memory when it is loaded. Histogram distances aren't symmetric,
+    //they are always stored in full.
+    bool packedDistances;
+    
+    //packedDistances: type of the stored distances. ELEMENT_UINT16 is quantized against the largest distance
+    DistanceElement distanceElement;
+    
+    //Binary caches of dense distances are stored as square tiles of this many frames, so a band of rows or any other
+    //window can be read without the rest of the file. Multiples of 32 keep every tile on its own pages. 0 = row by row
+    //Overrides packedDistances. Histogram distances aren't symmetric, they are always stored row by row.
+    int cacheTileSize;
+    
+    //Colour frames are kept encoded in memory in this format (".jpg" or ".png") instead of raw. "" = raw
+    std::string colourFrameEncoding;
+    
+    //Encoded colour frames: megabytes of decoded frames kept in the cache
+    int colourCacheMegabytes;
+    
+    //Encoded colour frames: number of frames ahead of the one being played that are decoded in the background, following
+    //the transition that playback or output takes next
+    int colourPrefetch;
+    
+    VideoTextureSettings()
+    {
+        numThreads = 0;
+        distanceMode = DISTANCE_DENSE;
+        pyramidLevels = 3;
+        pyramidQuantile = 0.05f;
+        pyramidThreshold = 0.0f;
+        knnNeighbours = 20;
+        knnOversampling = 4;
+        knnFeatureWidth = 32;
+        knnDimensions = 32;
+        histogramColorReduction = 32;
+        startFrame = 0;
+        endFrame = -1;
+        frameStride = 1;
+        decodeSegments = 1;
+        pipeline = false;
+        pipelineWorkers = 2;
+        pipelineDepth = 64;
+        memoryBudget = 0;
+        analysisScale = 1.0f;
+        analysisPixels = 0;
+        collapseDuplicates = false;
+        duplicateThreshold = 0.0f;
+        packedDistances = false;
+        distanceElement = ELEMENT_FLOAT32;
+        cacheTileSize = 0;
+        analysisCacheMegabytes = 4096;
+        colourCacheMegabytes = 256;
+        colourPrefetch = 8;
+    }
+};
+
+#endif
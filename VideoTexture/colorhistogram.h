@@ -29,6 +29,18 @@ public:
 		channels[2]= 2; 
 	}
     
+	// Sets the number of bins in each dimension.
+	// Images that went through colorReduce(image,div) only need 256/div bins.
+	void setSize(int size) {
+        
+		histSize[0]= histSize[1]= histSize[2]= size;
+	}
+    
+	int getSize() {
+        
+		return histSize[0];
+	}
+    
 	// Computes the histogram.
 	cv::MatND getHistogram(const cv::Mat &image) {
         
@@ -140,29 +152,34 @@ public:
 		return hist;
 	}
     
-	cv::Mat colorReduce(const cv::Mat &image, int div=64) {
+	// Lookup table that rounds every value to the middle of its div wide range
+	cv::Mat colorReduceTable(int div=64) {
         
         int n= static_cast<int>(log(static_cast<double>(div))/log(2.0));
         // mask used to round the pixel value
         uchar mask= 0xFF<<n; // e.g. for div=16, mask= 0xF0
         
-        cv::Mat_<cv::Vec3b>::const_iterator it= image.begin<cv::Vec3b>();
-        cv::Mat_<cv::Vec3b>::const_iterator itend= image.end<cv::Vec3b>();
+        cv::Mat lut(1,256,CV_8U);
+        for (int i=0; i<256; i++)
+            lut.at<uchar>(i)= (i&mask) + div/2;
         
-        // Set output image (always 1-channel)
-        cv::Mat result(image.rows,image.cols,image.type());
-        cv::Mat_<cv::Vec3b>::iterator itr= result.begin<cv::Vec3b>();
+        return lut;
+	}
+    
+	cv::Mat colorReduce(const cv::Mat &image, int div=64) {
         
-        for ( ; it!= itend; ++it, ++itr) {
-            
-            (*itr)[0]= ((*it)[0]&mask) + div/2;
-            (*itr)[1]= ((*it)[1]&mask) + div/2;
-            (*itr)[2]= ((*it)[2]&mask) + div/2;
-        }
+        cv::Mat result;
+        cv::LUT(image,colorReduceTable(div),result);
         
         return result;
     }
     
+	// Same as colorReduce but overwrites the image instead of allocating a new one
+	void colorReduceInPlace(cv::Mat &image, int div=64) {
+        
+        cv::LUT(image,colorReduceTable(div),image);
+    }
+    
 };
 
 
@@ -180,53 +180,66 @@ int main (int argc, const char * argv[])
     //double pruneThreshold = fileSetting.pruneThreshold;
     
     string filename = videoPath + fileSetting.filename;
-    string cachefile = cachePath + fileSetting.filename + ".txt";
     
     VideoTexture *videoTexture; 
     
     try {
         
+        //Distances and greyscale frames saved by a previous run of any tool, for this video's content and these settings
+        //The colour frames are only decoded for the output
+        VideoTextureSettings settings;
+        settings.analysisCacheDirectory = cachePath;
+        settings.collapseDuplicates = false;    //Same as the cache was generated with
+        
         //Create the new video texture
-        videoTexture = new VideoTexture(filename, sigma);  
+        videoTexture = new VideoTexture(filename, sigma, settings);  
         
-        //Generate the cache file if needed
-        //videoTexture->generateFrameDistanceMatrix(cachefile);        
+        //Load the cache file, it is generated first if there isn't one yet
+        videoTexture->loadFrameDiffMatrix();
         
-        //Load the cache file
-        videoTexture->loadFrameDiffMatrix(cachefile);
+        //Sparse caches (pyramid, nearest neighbour) only have the closest pairs, so there is nothing to show
+        bool sparse = (videoTexture->sparseFrameDistanceMatrix != NULL);
+        bool packed = (videoTexture->frameDistanceMatrix == NULL);    //Packed caches are only read through the stages
         
         //Show the distance matrix
-        videoTexture->showMatrix("Distance Matrix", videoTexture->frameDistanceMatrix, videoTexture->frameCount, false, image_scale);
+        if (!sparse && !packed) videoTexture->showMatrix("Distance Matrix", videoTexture->frameDistanceMatrix, videoTexture->frameCount, false, image_scale);
 
         //Generate the probability matrix
         videoTexture->generateProbabilityMatrix();
         
         //Show the probability matrix
-        videoTexture->showMatrix("Probability Matrix", videoTexture->frameProbabilityMatrix, videoTexture->frameCount, false, image_scale);
+        if (!sparse) videoTexture->showMatrix("Probability Matrix", videoTexture->frameProbabilityMatrix, videoTexture->frameCount, false, image_scale);
         
         //Generate the weighted distance matrix
         videoTexture->generateWeightedFrameDistanceMatrix();
         
         //Show the weighted distance matrix
-        videoTexture->showMatrix("Weighted Distance Matrix", videoTexture->weightedFrameDistanceMatrix, videoTexture->frameCount, false, image_scale);
+        if (!sparse && !packed) videoTexture->showMatrix("Weighted Distance Matrix", videoTexture->weightedFrameDistanceMatrix, videoTexture->frameCount, false, image_scale);
         
         //Generate the weighted probability matrix
         videoTexture->generateWeightedProbabilityMatrix();
         
         //Show the weighted probability matrix
-        videoTexture->showMatrix("Weighted Probability Matrix", videoTexture->weightedFrameProbabilityMatrix, videoTexture->frameCount, false, image_scale);
+        if (!sparse) videoTexture->showMatrix("Weighted Probability Matrix", videoTexture->weightedFrameProbabilityMatrix, videoTexture->frameCount, false, image_scale);
         
         //Generate the anticipated future cost matrix
         videoTexture->generateAnticipatedFutureCostMatrix(1.0f, 0.995f, 0.001f);
         
         //Show the anticipated future cost matrices
-        videoTexture->showMatrix("Anticipated future cost probability matrix", videoTexture->anticipatedFutureCostProbabilityMatrix, videoTexture->frameCount, false, image_scale);
+        if (!sparse) videoTexture->showMatrix("Anticipated future cost probability matrix", videoTexture->anticipatedFutureCostProbabilityMatrix, videoTexture->frameCount, false, image_scale);
         
         //videoTexture->randomPlay(videoTexture->anticipatedFutureCostProbabilityMatrix, pruneThreshold);
         
         //return 0;
         
-        videoTexture->findTransitions(videoTexture->anticipatedFutureCostMatrix, fileSetting.numTransitions, fileSetting.minTransitionLength);
+        if (sparse)
+        {
+            videoTexture->findTransitions(videoTexture->sparseAnticipatedFutureCostMatrix, fileSetting.numTransitions, fileSetting.minTransitionLength);
+        }
+        else
+        {
+            videoTexture->findTransitions(videoTexture->anticipatedFutureCostMatrix, fileSetting.numTransitions, fileSetting.minTransitionLength);
+        }
         TransitionsTable* transitionsTable = videoTexture->generateTransitionsTable(videoTexture->transitions, fileSetting.frameTarget);
         
         //Debug the table
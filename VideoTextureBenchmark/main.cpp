@@ -0,0 +1,629 @@
+//
+//  main.cpp
+//  VideoTextureBenchmark
+//
+//  Created by Leonard Teo on 11-11-20.
+//  Copyright 2011 Leonard Teo. All rights reserved.
+//
+
+#include <iostream>
+#include <fstream>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+//OpenCV libraries
+#include "core.hpp"
+#include "highgui.hpp"
+#include "imgproc.hpp"
+
+#include "VideoTexture.h"
+
+using namespace std;
+
+
+/**
+ * Seconds since some point in the past
+ */
+double now()
+{
+    return (double)cv::getTickCount() / cv::getTickFrequency();
+}
+
+/**
+ * Create a random greyscale frame
+ */
+cv::Mat randomFrame(int width, int height)
+{
+    cv::Mat frame(height, width, CV_8UC1);
+    for (int y=0; y<height; y++)
+    {
+        uchar* row = frame.ptr<uchar>(y);
+        for (int x=0; x<width; x++)
+        {
+            row[x] = (uchar)(rand() % 256);
+        }
+    }
+    return frame;
+}
+
+/**
+ * Create a random colour frame
+ */
+cv::Mat randomColourFrame(int width, int height)
+{
+    cv::Mat frame(height, width, CV_8UC3);
+    for (int y=0; y<height; y++)
+    {
+        uchar* row = frame.ptr<uchar>(y);
+        for (int x=0; x<width * 3; x++)
+        {
+            row[x] = (uchar)(rand() % 256);
+        }
+    }
+    return frame;
+}
+
+/**
+ * The original iterator based colour reduction, kept here as the baseline
+ */
+cv::Mat legacyColorReduce(const cv::Mat &image, int div)
+{
+    int n = static_cast<int>(log(static_cast<double>(div))/log(2.0));
+    uchar mask = 0xFF<<n;
+    
+    cv::Mat_<cv::Vec3b>::const_iterator it = image.begin<cv::Vec3b>();
+    cv::Mat_<cv::Vec3b>::const_iterator itend = image.end<cv::Vec3b>();
+    
+    cv::Mat result(image.rows, image.cols, image.type());
+    cv::Mat_<cv::Vec3b>::iterator itr = result.begin<cv::Vec3b>();
+    
+    for ( ; it != itend; ++it, ++itr)
+    {
+        (*itr)[0] = ((*it)[0]&mask) + div/2;
+        (*itr)[1] = ((*it)[1]&mask) + div/2;
+        (*itr)[2] = ((*it)[2]&mask) + div/2;
+    }
+    
+    return result;
+}
+
+/**
+ * The original per pixel distance, kept here as the baseline
+ */
+double legacyDistance(const cv::Mat& image1, const cv::Mat& image2)
+{
+    double sum = 0.0f;
+    for (int y=0; y<image1.rows; y++)
+    {
+        for (int x=0; x<image1.cols; x++)
+        {
+            uchar pixelValue1 = image1.at<uchar>(y, x);
+            uchar pixelValue2 = image2.at<uchar>(y, x);
+            
+            if (pixelValue1 != pixelValue2)
+            {
+                double diff = ((double) pixelValue1/255.0f) - ( (double) pixelValue2/255.0f);
+                sum = sum + (diff*diff);
+            }
+        }
+    }
+    return sqrt(sum);
+}
+
+/**
+ * The original text cache reader, getline and atof through an fstream, kept here as the baseline
+ */
+void legacyReadTextCache(string file, double** matrix, int count)
+{
+    fstream infile;
+    infile.open(file.c_str(), ios::in);
+    if (!infile.is_open())
+    {
+        throw string("Couldn't open file " + file);
+    }
+    
+    string line;
+    for (int row=0; row < count; row++)
+    {
+        for (int col=0; col < count; col++)
+        {
+            if (infile.good())
+            {
+                getline(infile, line);
+                matrix[row][col] = atof(line.c_str());
+            }
+        }
+    }
+}
+
+/**
+ * Benchmark the frame distance kernels on 640x480 greyscale frames
+ */
+void benchmarkFrameDistance()
+{
+    cout << "Frame distance, 640x480 greyscale" << endl;
+    
+    int numFrames = 16;
+    int iterations = 200;
+    
+    cv::Mat frames[16];
+    for (int i=0; i<numFrames; i++)
+    {
+        frames[i] = randomFrame(640, 480);
+    }
+    
+    size_t length = 640 * 480;
+    
+    //Check the kernels against each other before timing them
+    double maxError = 0.0f;
+    for (int i=1; i<numFrames; i++)
+    {
+        const uchar* a = frames[0].ptr<uchar>(0);
+        const uchar* b = frames[i].ptr<uchar>(0);
+        uint64_t scalar = FrameDistance::sumSquaredDifferenceScalar(a, b, length);
+        if (FrameDistance::sumSquaredDifference(a, b, length) != scalar)
+        {
+            cout << "Error: SIMD kernel does not match the scalar kernel for frame " << i << endl;
+        }
+        
+        double error = fabs(legacyDistance(frames[0], frames[i]) - FrameDistance::distanceFromSumSquaredDifference(scalar));
+        if (error > maxError)
+        {
+            maxError = error;
+        }
+    }
+    cout << "Max difference from legacy floating point distance: " << maxError << endl;
+    
+    //Legacy
+    double start = now();
+    double checksum = 0.0f;
+    for (int n=0; n<iterations; n++)
+    {
+        checksum += legacyDistance(frames[n % numFrames], frames[(n + 1) % numFrames]);
+    }
+    double legacyTime = (now() - start) / iterations;
+    
+    //Scalar integer
+    start = now();
+    for (int n=0; n<iterations; n++)
+    {
+        checksum += FrameDistance::sumSquaredDifferenceScalar(frames[n % numFrames].ptr<uchar>(0), frames[(n + 1) % numFrames].ptr<uchar>(0), length);
+    }
+    double scalarTime = (now() - start) / iterations;
+    
+    //Best SIMD kernel
+    start = now();
+    for (int n=0; n<iterations; n++)
+    {
+        checksum += FrameDistance::sumSquaredDifference(frames[n % numFrames].ptr<uchar>(0), frames[(n + 1) % numFrames].ptr<uchar>(0), length);
+    }
+    double simdTime = (now() - start) / iterations;
+    
+    cout << "Legacy:  " << legacyTime * 1000.0f << " ms/pair" << endl;
+    cout << "Scalar:  " << scalarTime * 1000.0f << " ms/pair (" << legacyTime / scalarTime << "x)" << endl;
+    cout << "SIMD:    " << simdTime * 1000.0f << " ms/pair (" << legacyTime / simdTime << "x)" << endl;
+    cout << "(checksum " << checksum << ")" << endl << endl;
+}
+
+
+/**
+ * Benchmark the greyscale conversion of 1920x1080 colour frames against cv::cvtColor
+ */
+void benchmarkGreyscaleConversion()
+{
+    cout << "Greyscale conversion, 1920x1080" << endl;
+    
+    int iterations = 100;
+    cv::Mat colour = randomColourFrame(1920, 1080);
+    cv::Mat reference, grey(1080, 1920, CV_8UC1);
+    size_t pixels = (size_t)colour.rows * colour.cols;
+    
+    //Has to be exactly what cvtColor makes, or existing caches would no longer match
+    cv::cvtColor(colour, reference, CV_RGB2GRAY);
+    GreyscaleConversion::fromBGR(colour.ptr<uchar>(0), grey.ptr<uchar>(0), pixels);
+    if (memcmp(reference.ptr<uchar>(0), grey.ptr<uchar>(0), pixels) != 0)
+    {
+        cout << "Error: conversion does not match cvtColor" << endl;
+    }
+    
+    //cvtColor into a new image each time, like generateGreyscaleFrames used to
+    double start = now();
+    for (int n=0; n<iterations; n++)
+    {
+        cv::Mat converted;
+        cv::cvtColor(colour, converted, CV_RGB2GRAY);
+    }
+    double cvtColorTime = (now() - start) / iterations;
+    
+    start = now();
+    for (int n=0; n<iterations; n++)
+    {
+        GreyscaleConversion::fromBGRScalar(colour.ptr<uchar>(0), grey.ptr<uchar>(0), pixels);
+    }
+    double scalarTime = (now() - start) / iterations;
+    
+    start = now();
+    for (int n=0; n<iterations; n++)
+    {
+        GreyscaleConversion::fromBGR(colour.ptr<uchar>(0), grey.ptr<uchar>(0), pixels);
+    }
+    double simdTime = (now() - start) / iterations;
+    
+    cout << "cvtColor: " << cvtColorTime * 1000.0f << " ms/frame" << endl;
+    cout << "Scalar:   " << scalarTime * 1000.0f << " ms/frame (" << cvtColorTime / scalarTime << "x)" << endl;
+    cout << "SIMD:     " << simdTime * 1000.0f << " ms/frame (" << cvtColorTime / simdTime << "x)" << endl << endl;
+}
+
+
+/**
+ * Benchmark the per frame colour histogram on 640x480 colour frames with div = 32
+ * Before: iterator colour reduction into a new image and a 256x256x256 histogram
+ * After: table colour reduction in place and an 8x8x8 histogram, and the direct ImageComparator::computeHistogram
+ * Measured with the same loops outside OpenCV on one Xeon core: before 39.5 ms/frame and 64 MB, after 1.24 ms/frame
+ * (32x) and 2 KB, direct 0.54 ms/frame (73x) and 2 KB
+ */
+void benchmarkColorHistogram()
+{
+    cout << "Colour histogram, 640x480, div 32" << endl;
+    
+    int div = 32;
+    int numFrames = 8;
+    int iterations = 40;
+    
+    cv::Mat frames[8];
+    for (int i=0; i<numFrames; i++)
+    {
+        frames[i] = randomColourFrame(640, 480);
+    }
+    
+    ColorHistogram fullHistogram;
+    ColorHistogram reducedHistogram;
+    reducedHistogram.setSize(256/div);
+    
+    ImageComparator comparator;
+    comparator.setColorReduction(div);
+    vector<float> bins(comparator.getHistogramSize());
+    
+    //Check that the reduction and the histograms agree before timing them
+    cv::Mat legacyReduced = legacyColorReduce(frames[0], div);
+    cv::Mat reduced = frames[0].clone();
+    reducedHistogram.colorReduceInPlace(reduced, div);
+    for (int y=0; y<reduced.rows; y++)
+    {
+        if (memcmp(reduced.ptr<uchar>(y), legacyReduced.ptr<uchar>(y), reduced.cols * 3) != 0)
+        {
+            cout << "Error: table colour reduction does not match the legacy reduction" << endl;
+            break;
+        }
+    }
+    
+    cv::MatND before = fullHistogram.getHistogram(legacyReduced);
+    cv::MatND after = reducedHistogram.getHistogram(reduced);
+    comparator.computeHistogram(frames[0], &bins[0]);
+    if (cv::sum(before)[0] != cv::sum(after)[0] || cv::sum(after)[0] != 640 * 480)
+    {
+        cout << "Error: histograms don't count every pixel" << endl;
+    }
+    for (size_t i=0; i<bins.size(); i++)
+    {
+        if (((float*)after.data)[i] != bins[i])
+        {
+            cout << "Error: computeHistogram does not match the reduced histogram at bin " << i << endl;
+            break;
+        }
+    }
+    
+    //Before
+    double start = now();
+    double checksum = 0.0f;
+    for (int n=0; n<iterations; n++)
+    {
+        cv::MatND histogram = fullHistogram.getHistogram(legacyColorReduce(frames[n % numFrames], div));
+        checksum += ((float*)histogram.data)[0];
+    }
+    double beforeTime = (now() - start) / iterations;
+    
+    //After, through ColorHistogram
+    start = now();
+    cv::Mat buffer;
+    for (int n=0; n<iterations; n++)
+    {
+        frames[n % numFrames].copyTo(buffer);
+        reducedHistogram.colorReduceInPlace(buffer, div);
+        cv::MatND histogram = reducedHistogram.getHistogram(buffer);
+        checksum += ((float*)histogram.data)[0];
+    }
+    double afterTime = (now() - start) / iterations;
+    
+    //After, straight from the pixels
+    start = now();
+    for (int n=0; n<iterations; n++)
+    {
+        comparator.computeHistogram(frames[n % numFrames], &bins[0]);
+        checksum += bins[0];
+    }
+    double directTime = (now() - start) / iterations;
+    
+    double megabyte = 1024.0f * 1024.0f;
+    cout << "Before:  " << beforeTime * 1000.0f << " ms/frame, " << before.total() * before.elemSize() / megabyte << " MB histogram" << endl;
+    cout << "After:   " << afterTime * 1000.0f << " ms/frame (" << beforeTime / afterTime << "x), " << after.total() * after.elemSize() / 1024.0f << " KB histogram" << endl;
+    cout << "Direct:  " << directTime * 1000.0f << " ms/frame (" << beforeTime / directTime << "x), " << bins.size() * sizeof(float) / 1024.0f << " KB histogram" << endl;
+    cout << "(checksum " << checksum << ")" << endl << endl;
+}
+
+
+/**
+ * Time the distance matrix from 1 thread up to one per core and check every run gives the same matrix
+ */
+void benchmarkThreadScaling(string filename)
+{
+    cout << "Distance matrix thread scaling: " << filename << endl;
+    
+    VideoTexture* videoTexture = new VideoTexture(filename, 0.1f);
+    int n = videoTexture->frameCount;
+    
+    double** reference = NULL;
+    double singleThreadTime = 0.0f;
+    int maxThreads = ThreadPool::defaultThreadCount();
+    
+    //Powers of two, then one thread per core
+    vector<int> threadCounts;
+    for (int threads=1; threads < maxThreads; threads *= 2)
+    {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(maxThreads);
+    
+    for (size_t i=0; i<threadCounts.size(); i++)
+    {
+        int threads = threadCounts[i];
+        videoTexture->settings.numThreads = threads;
+        
+        double start = now();
+        videoTexture->computeFrameDistanceMatrix();
+        double time = now() - start;
+        
+        if (reference == NULL)
+        {
+            reference = videoTexture->frameDistanceMatrix;
+            singleThreadTime = time;
+        }
+        else
+        {
+            //Must be bit for bit the same as the single threaded run
+            int mismatches = 0;
+            for (int row=0; row<n; row++)
+            {
+                for (int col=0; col<n; col++)
+                {
+                    if (videoTexture->frameDistanceMatrix[row][col] != reference[row][col])
+                    {
+                        mismatches++;
+                    }
+                }
+                delete [] videoTexture->frameDistanceMatrix[row];
+            }
+            delete [] videoTexture->frameDistanceMatrix;
+            videoTexture->frameDistanceMatrix = reference;  //Freed with the VideoTexture
+            
+            if (mismatches > 0)
+            {
+                cout << "Error: " << mismatches << " distances differ from the single threaded run" << endl;
+            }
+        }
+        
+        cout << threads << " threads: " << time << " s (" << singleThreadTime / time << "x)" << endl;
+    }
+    cout << endl;
+    
+    delete videoTexture;
+}
+
+/**
+ * Transitions chosen from the distance matrix of a video analysed at the given scale
+ * Runs the same stages as the VideoTexture program, from normalizing the distances to finding transitions
+ */
+vector<Transition*>* transitionsAtScale(string filename, double scale, double& time, double**& distances, int& n)
+{
+    VideoTextureSettings settings;
+    settings.analysisScale = scale;
+    
+    VideoTexture* videoTexture = new VideoTexture(filename, 0.1f, settings);
+    n = videoTexture->frameCount;
+    
+    double start = now();
+    videoTexture->computeFrameDistanceMatrix();
+    time = now() - start;
+    
+    videoTexture->normalizeMatrix(videoTexture->frameDistanceMatrix);
+    distances = videoTexture->frameDistanceMatrix;
+    
+    videoTexture->generateProbabilityMatrix();
+    videoTexture->generateWeightedFrameDistanceMatrix();
+    videoTexture->generateWeightedProbabilityMatrix();
+    videoTexture->generateAnticipatedFutureCostMatrix(1.0f, 0.995f, 0.001f);
+    videoTexture->findTransitions(videoTexture->anticipatedFutureCostMatrix, 10, 1);
+    
+    return videoTexture->transitions;
+}
+
+/**
+ * Best frame to jump to from each frame, ie. the j with the smallest D[i+1][j] other than i+1 itself
+ */
+vector<int> bestJumps(double** distances, int n)
+{
+    vector<int> jumps(max(0, n - 1));
+    for (int i=0; i<n - 1; i++)
+    {
+        int best = -1;
+        for (int j=0; j<n; j++)
+        {
+            if (j != i + 1 && (best < 0 || distances[i + 1][j] < distances[i + 1][best]))
+            {
+                best = j;
+            }
+        }
+        jumps[i] = best;
+    }
+    return jumps;
+}
+
+/**
+ * Time the distance matrix at smaller analysis scales and compare the transitions it leads to with full resolution
+ */
+void benchmarkAnalysisScale(string filename)
+{
+    cout << "Analysis scale accuracy: " << filename << endl;
+    
+    double fullTime;
+    double** fullDistances;
+    int n;
+    vector<Transition*>* full = transitionsAtScale(filename, 1.0f, fullTime, fullDistances, n);
+    vector<int> fullJumps = bestJumps(fullDistances, n);
+    cout << "Scale 1: " << fullTime << " s" << endl;
+    
+    double scales[] = {0.5f, 0.25f, 0.125f};
+    for (int s=0; s<3; s++)
+    {
+        double time;
+        double** distances;
+        int frames;
+        vector<Transition*>* scaled = transitionsAtScale(filename, scales[s], time, distances, frames);
+        if (frames != n)
+        {
+            cout << "Error: scale " << scales[s] << " decoded " << frames << " frames instead of " << n << endl;
+            continue;
+        }
+        
+        //Transitions that were also chosen at full resolution, give or take a frame at either end
+        int matched = 0;
+        for (size_t i=0; i<scaled->size(); i++)
+        {
+            for (size_t j=0; j<full->size(); j++)
+            {
+                if (abs((*scaled)[i]->startFrame - (*full)[j]->startFrame) <= 1 && abs((*scaled)[i]->endFrame - (*full)[j]->endFrame) <= 1)
+                {
+                    matched++;
+                    break;
+                }
+            }
+        }
+        
+        //Best jump from every frame, and how much worse the scaled choice is when measured at full resolution
+        vector<int> jumps = bestJumps(distances, n);
+        int sameJumps = 0;
+        double extraCost = 0.0f;
+        for (size_t i=0; i<jumps.size(); i++)
+        {
+            if (jumps[i] == fullJumps[i])
+            {
+                sameJumps++;
+            }
+            extraCost += fullDistances[i + 1][jumps[i]] - fullDistances[i + 1][fullJumps[i]];
+        }
+        
+        cout << "Scale " << scales[s] << ": " << time << " s (" << fullTime / time << "x), "
+             << matched << "/" << scaled->size() << " transitions also chosen at full resolution, "
+             << sameJumps << "/" << jumps.size() << " best jumps the same, "
+             << "mean extra full resolution distance " << (jumps.empty() ? 0.0f : extraCost / jumps.size()) << endl;
+    }
+    cout << endl;
+}
+
+
+/**
+ * Throughput of the text distance cache readers on a 3000 frame cache written the way writeFrameDistanceMatrix does
+ */
+void benchmarkTextCache()
+{
+    const int frames = 3000;
+    string file = "/tmp/videotexture_benchmark_cache.txt";
+    
+    fstream outfile;
+    outfile.open(file.c_str(), ios::out);
+    for (int i=0; i < frames * frames; i++)
+    {
+        outfile << (double)rand() / RAND_MAX * 500.0 << endl;
+    }
+    outfile.close();
+    
+    struct stat info;
+    stat(file.c_str(), &info);
+    double megabytes = info.st_size / (1024.0 * 1024.0);
+    cout << "Text cache: " << frames << " frames, " << megabytes << " MB" << endl;
+    
+    double** legacy = new double*[frames];
+    double** parsed = new double*[frames];
+    for (int i=0; i<frames; i++)
+    {
+        legacy[i] = new double[frames];
+        parsed[i] = new double[frames];
+    }
+    
+    double start = now();
+    legacyReadTextCache(file, legacy, frames);
+    double legacyTime = now() - start;
+    cout << "getline + atof: " << legacyTime << " s, " << megabytes / legacyTime << " MB/s" << endl;
+    
+    int threadCounts[] = {1, 0};
+    for (int t=0; t<2; t++)
+    {
+        start = now();
+        DistanceCache::readTextCache(file, parsed, frames, threadCounts[t]);
+        double time = now() - start;
+        
+        int mismatches = 0;
+        for (int i=0; i<frames; i++)
+        {
+            for (int j=0; j<frames; j++)
+            {
+                if (parsed[i][j] != legacy[i][j])
+                {
+                    mismatches++;
+                }
+            }
+        }
+        
+        int threads = threadCounts[t] > 0 ? threadCounts[t] : ThreadPool::defaultThreadCount();
+        cout << "Mapped, " << threads << " thread(s): " << time << " s, " << megabytes / time << " MB/s ("
+             << legacyTime / time << "x)" << (mismatches ? ", MISMATCHES" : "") << endl;
+    }
+    
+    for (int i=0; i<frames; i++)
+    {
+        delete [] legacy[i];
+        delete [] parsed[i];
+    }
+    delete [] legacy;
+    delete [] parsed;
+    remove(file.c_str());
+    cout << endl;
+}
+
+
+int main (int argc, const char * argv[])
+{
+    cout << "Running benchmarks" << endl << endl;
+    
+    string filename = "/Users/leonardteo/Movies/dead_end.mov";
+    if (argc > 1)
+    {
+        filename = argv[1];
+    }
+    
+    benchmarkFrameDistance();
+    benchmarkColorHistogram();
+    benchmarkGreyscaleConversion();
+    
+    try {
+        benchmarkTextCache();
+        benchmarkThreadScaling(filename);
+        benchmarkAnalysisScale(filename);
+    } catch (string e) {
+        cout << e << endl;
+        return 1;
+    }
+    
+    return 0;
+}
@@ -20,16 +20,34 @@ int main (int argc, const char* argv[])
     
     VideoTexture* videotex;
     
+    VideoTextureSettings settings;
+    settings.numThreads = 0;    //One thread per core
+    settings.maskFile = "";     //Image of the part of the frame to compare, "" for the whole frame
+    settings.pipeline = true;   //Compare frames while the video is still decoding
+    settings.memoryBudget = 0;  //Bytes of frames to keep in memory, set it to stream clips that don't fit in RAM
+    settings.analysisScale = 1.0f;  //Compare frames at this fraction of the video's size, eg. 0.25 for 1080p
+    settings.collapseDuplicates = false;    //Analyse held frames once, the VideoTexture program has to use the same setting
+    settings.startFrame = 0;    //Load frames startFrame to endFrame (-1 = the end), keeping every frameStride'th frame
+    settings.endFrame = -1;
+    settings.frameStride = 1;
+    settings.analysisCacheDirectory = cachePath;   //Distances and greyscale frames, shared with the VideoTexture program
+    settings.analysisCacheMegabytes = 4096;         //Least recently used results are deleted above this
+    settings.packedDistances = false;   //Store only the upper triangle of the distances in the .vtd cache
+    settings.distanceElement = ELEMENT_FLOAT32; //packedDistances: ELEMENT_FLOAT16 or ELEMENT_UINT16 for a smaller cache
+    settings.cacheTileSize = 0;     //Store the .vtd cache as tiles of this many frames (eg. 64) so bands of rows load on their own
+    
     //Create the new video texture
     try {
         
         for (int i=0; i<num_files; i++)
         {
             string video = videoPath + files[i];
-            string cache = cachePath + files[i] + ".txt";
             
-            videotex = new VideoTexture(video, 0.1f);
-            videotex->generateFrameDistanceMatrix(cache);
+            videotex = new VideoTexture(video, 0.1f, settings);
+            
+            //Nothing is calculated if the analysis cache already has this video with these settings. If the video grew
+            //since its last result, or there is an old cachePath + file + ".vtd" or ".txt" cache, only new frames are calculated
+            videotex->generateFrameDistanceMatrix();
             
             //Free the memory
             delete videotex;